@@ -0,0 +1,402 @@
+#include "precomp.h" // include (only) this in every .cpp file
+#include "benchmark.h"
+#include "game.h"
+#include "timer.h"
+
+using namespace AdvancedGraphics;
+
+// The scenes of the benchmark, when none is given on the command line. An empty name is the default scene.
+static const char *const benchmarkScenes[] = {"", "assets/cube.obj", "assets/crate1.obj", "assets/legocar.obj", "assets/sibenik.obj"};
+
+bool Benchmark::Run()
+{
+	std::vector<std::string> scenes;
+	if ( config.scene.empty() )
+		scenes.assign( std::begin( benchmarkScenes ), std::end( benchmarkScenes ) );
+	else
+		scenes.push_back( config.scene );
+
+	bool measured = false;
+	for ( const std::string &scene : scenes )
+	{
+		results.push_back( Measure( scene ) );
+		measured |= results.back().error.empty();
+	}
+
+	printf( "\n%-24s %10s %10s %10s %10s %10s %10s %10s %10s\n", "Scene", "Triangles", "Build ms", "Refit ms", "Primary", "Diffuse", "Shadow", "Filter ms", "Frame ms" );
+	for ( const BenchmarkResult &r : results )
+	{
+		if ( !r.error.empty() )
+			printf( "%-24s %s\n", r.scene.c_str(), r.error.c_str() );
+		else
+			printf( "%-24s %10" PRIu64 " %10.1f %10.1f %10.2f %10.2f %10.2f %10.2f %10.1f\n", r.scene.c_str(), r.triangles, r.buildTime,
+				r.refitTime, r.primaryRays, r.diffuseRays, r.shadowRays, r.filterTime, r.frameTime );
+	}
+	printf( "Rays in millions per second, %dx%d, %u threads, averaged over %u runs\n", config.width, config.height, threads, config.runs );
+
+	#ifdef TRAVERSALSTATS
+	printf( "\n%-24s %-8s %10s %10s %10s %10s %10s %10s\n", "Scene", "Rays", "Count", "AABB", "Triangles", "Leaves", "Culled", "Early-outs" );
+	for ( const BenchmarkResult &r : results )
+	{
+		if ( !r.error.empty() )
+			continue;
+		const std::pair<const char *, const TraversalStats *> measurements[] = {
+			{"primary", &r.primaryStats}, {"diffuse", &r.diffuseStats}, {"shadow", &r.shadowStats}, {"frame", &r.frameStats}};
+		for ( const auto &m : measurements )
+		{
+			const TraversalStats &s = *m.second;
+			const double perRay = 1.0 / std::max( s.Rays(), (uint64)1 );
+			printf( "%-24s %-8s %10" PRIu64 " %10.1f %10.1f %10.2f %10.2f %10" PRIu64 "\n", r.scene.c_str(), m.first, s.Rays(),
+				s.aabbTests * perRay, s.triangleTests * perRay, s.leafVisits * perRay, s.culledNodes * perRay, s.earlyOuts );
+		}
+	}
+	printf( "Tests, leaves and culled nodes per ray, of one run and of the last frame\n" );
+	#endif
+	return measured;
+}
+
+BenchmarkResult Benchmark::Measure( const std::string &scene )
+{
+	BenchmarkResult result;
+	result.scene = scene.empty() ? "default" : scene;
+	// Loading a missing scene would exit
+	if ( !scene.empty() && !std::ifstream( scene ).good() )
+	{
+		std::cerr << "Skipping " << scene << ": file not found" << std::endl;
+		result.error = "file not found";
+		return result;
+	}
+	std::cout << "Benchmarking " << result.scene << std::endl;
+
+	Config sceneConfig = config;
+	sceneConfig.scene = scene;
+	sceneConfig.headless = true;
+	Surface surface( config.width, config.height );
+	Game game;
+	game.SetTarget( &surface );
+	game.Init( sceneConfig );
+	threads = game.threadPool->Size();
+	#ifdef USEBVH
+	result.triangles = (uint64)game.nr_instances * game.nr_triangles;
+	#else
+	result.triangles = game.nr_triangles;
+	#endif
+
+	if ( !config.hasPosition && !config.hasDirection )
+		FrameScene( &game );
+
+	std::vector<Ray> primary, diffuse, shadow;
+	GenerateRays( &game, primary, diffuse, shadow );
+
+	// The first run warms up the caches and is not counted
+	float primaryTime = 0, diffuseTime = 0, shadowTime = 0, filterTime = 0, frameTime = 0;
+	#ifdef USEBVH
+	float buildTime = 0;
+	#endif
+	for ( uint run = 0; run <= config.runs; run++ )
+	{
+		const bool counted = run > 0;
+		#ifdef USEBVH
+		if ( game.nr_triangles > 0 )
+		{
+			BVH bvh;
+			timer::TimePoint t = timer::get();
+			bvh.ConstructBVH( game.triangles, game.nr_triangles );
+			buildTime += counted ? timer::elapsed( t ) : 0;
+		}
+		#endif
+
+		// The counts are the same every run
+		const float p = TraceRays( &game, primary, RAY_PRIMARY, result.primaryStats );
+		const float d = TraceRays( &game, diffuse, RAY_BOUNCE, result.diffuseStats );
+		const float s = TraceRays( &game, shadow, RAY_SHADOW, result.shadowStats );
+
+		// The same frames every run
+		game.CameraChanged();
+		float frames = 0;
+		for ( int frame = 0; frame < BENCHMARKFRAMES; frame++ )
+		{
+			timer::TimePoint t = timer::get();
+			game.Tick();
+			frames += timer::elapsed( t );
+		}
+		#ifdef TRAVERSALSTATS
+		result.frameStats = game.FrameTraversalStats();
+		#endif
+
+		// Filter the last frame again, from the same unfiltered illumination every time since the weights depend on it
+		float filter = 0;
+		const int pixels = config.width * config.height;
+		for ( int frame = 0; KERNEL_SIZE > 0 && frame < BENCHMARKFRAMES; frame++ )
+		{
+			for ( int id = 0; id < pixels; id++ )
+			{
+				PixelData &pixel = game.pixelData[id];
+				pixel.illumination = pixel.accumulated * (1.0f / std::max( pixel.samples, 1u ));
+			}
+			timer::TimePoint t = timer::get();
+			game.FilterFrame();
+			filter += timer::elapsed( t );
+		}
+
+		if ( counted )
+		{
+			primaryTime += p, diffuseTime += d, shadowTime += s;
+			frameTime += frames / BENCHMARKFRAMES;
+			filterTime += filter / BENCHMARKFRAMES;
+		}
+	}
+
+	const float runs = (float)config.runs;
+	result.nr_primary = primary.size(), result.nr_diffuse = diffuse.size(), result.nr_shadow = shadow.size();
+	// Rays per ms * 1e-3 is millions of rays per second
+	result.primaryRays = primary.size() * 1e-3f / (primaryTime / runs);
+	result.diffuseRays = diffuse.size() * 1e-3f / (diffuseTime / runs);
+	result.shadowRays = shadow.size() * 1e-3f / (shadowTime / runs);
+	result.frameTime = frameTime / runs;
+	#ifdef USEBVH
+	if ( game.nr_triangles > 0 )
+		result.buildTime = buildTime / runs;
+	#endif
+	if ( KERNEL_SIZE > 0 )
+		result.filterTime = filterTime / runs;
+
+	#ifdef USEBVH
+	// Last, since the mesh stays moved
+	if ( game.nr_triangles > 0 )
+	{
+		std::vector<Ray> rays = primary;
+		rays.insert( rays.end(), diffuse.begin(), diffuse.end() );
+		MeasureRefit( &game, rays, result );
+	}
+	#endif
+	game.Shutdown();
+	return result;
+}
+
+void Benchmark::FrameScene( Game *game ) const
+{
+	if ( game->nr_triangles == 0 )
+		return;
+	aabb bounds;
+	bounds.Reset();
+	for ( uint i = 0; i < game->nr_triangles; i++ )
+	{
+		bounds.Grow( game->triangles[i].p0 );
+		bounds.Grow( game->triangles[i].p1 );
+		bounds.Grow( game->triangles[i].p2 );
+	}
+	if ( bounds.Contains( game->view->position ) )
+		return;
+
+	// The screen is as wide as fov times the distance to it, so the mesh fits at this distance
+	const vec3 center = (bounds.bmin3 + bounds.bmax3) * 0.5f;
+	const float radius = (bounds.bmax3 - bounds.bmin3).length() * 0.5f;
+	const vec3 direction = vec3( 1, -0.5f, 1 ).normalized();
+	const float fov = game->view->fov;
+	game->SetCamera( center - direction * (2.5f * fov * radius), direction, fov );
+}
+
+void Benchmark::GenerateRays( Game *game, std::vector<Ray> &primary, std::vector<Ray> &diffuse, std::vector<Ray> &shadow ) const
+{
+	const int width = game->screen->GetWidth(), height = game->screen->GetHeight();
+	for ( int y = 0; y < height; y++ )
+		for ( int x = 0; x < width; x++ )
+		{
+			Sampler sampler( SAMPLER_RANDOM, x, y, 0, BENCHMARKSEED );
+			Ray r = game->ComputePrimaryRay<0>( x, y, 0.0f, 1.0f, sampler );
+			primary.push_back( r );
+			uint depth = 0;
+			if ( !game->Intersect( &r, depth ) )
+				continue;
+
+			// Like the first bounce of Game::Sample
+			vec3 point = r.origin + r.t * r.direction;
+			vec3 normal = r.obj->NormalAt( r.instance != nullptr ? r.instance->ToObject( point ) : point );
+			if ( r.instance != nullptr )
+				normal = r.instance->NormalToWorld( normal );
+			if ( dot( r.direction, normal ) > 0 )
+				normal *= -1;
+
+			Ray bounce( point, CosineWeightedDiffuseReflection( normal, sampler.Get2D( 0, SAMPLE_BRDF ) ) );
+			bounce.Offset( 1e-3 );
+			diffuse.push_back( bounce );
+
+			Light *light = game->lights[sampler.GetIndex( 0, SAMPLE_LIGHT, game->nr_lights )];
+			vec3 lightDir = light->PointOnLight( sampler.Get2D( 0, SAMPLE_LIGHTPOINT ) ) - point;
+			const float lightDist = lightDir.length();
+			Ray lightRay( point, lightDir * (1 / lightDist) );
+			lightRay.t = lightDist;
+			shadow.push_back( lightRay );
+		}
+}
+
+float Benchmark::TraceRays( Game *game, const std::vector<Ray> &rays, RayKind kind, TraversalStats &stats ) const
+{
+	// Tasks of a tile worth of rays, like the render loop
+	const uint chunk = TILESIZE * TILESIZE;
+	const uint count = (uint)rays.size();
+	#ifdef TRAVERSALSTATS
+	const TraversalStats before = TraversalStats::Total();
+	#endif
+	timer::TimePoint start = timer::get();
+	game->threadPool->ParallelFor( (count + chunk - 1) / chunk, [&]( uint task ) {
+		const uint end = std::min( count, (task + 1) * chunk );
+		// CheckOcclusion counts the shadow rays itself
+		TRAVERSAL_STATS( TraversalStats::Local().rays[kind] += kind != RAY_SHADOW ? end - task * chunk : 0 );
+		for ( uint i = task * chunk; i < end; i++ )
+		{
+			Ray r = rays[i];
+			uint depth = 0;
+			if ( kind == RAY_SHADOW )
+				game->CheckOcclusion( &r );
+			else
+				game->Intersect( &r, depth );
+		}
+	} );
+	const float time = timer::elapsed( start );
+	#ifdef TRAVERSALSTATS
+	stats = TraversalStats::Total() - before;
+	#else
+	stats = TraversalStats();
+	#endif
+	return time;
+}
+
+#ifdef USEBVH
+void Benchmark::MeasureRefit( Game *game, const std::vector<Ray> &rays, BenchmarkResult &result ) const
+{
+	// A second into the animation at 60 frames per second
+	game->MoveMesh( 60 * ANIMATIONSTEP );
+	timer::TimePoint t = timer::get();
+	game->bvh->Refit();
+	result.refitTime = timer::elapsed( t );
+
+	// The closest hits have to be the same, the order of the triangles may differ between the trees.
+	// The rays are traced in mesh space, which is world space for the first instance.
+	BVH fresh;
+	fresh.ConstructBVH( game->triangles, game->nr_triangles );
+	std::atomic<uint64> mismatches( 0 );
+	const uint chunk = TILESIZE * TILESIZE;
+	const uint count = (uint)rays.size();
+	game->threadPool->ParallelFor( (count + chunk - 1) / chunk, [&]( uint task ) {
+		uint64 differ = 0;
+		for ( uint i = task * chunk; i < std::min( count, (task + 1) * chunk ); i++ )
+		{
+			Ray refitted = rays[i], built = rays[i];
+			uint depth = 0;
+			game->bvh->Intersect( &refitted, depth );
+			fresh.Intersect( &built, depth );
+			differ += refitted.t != built.t;
+		}
+		mismatches += differ;
+	} );
+	result.refitMismatches = mismatches;
+	if ( result.refitMismatches > 0 )
+		std::cerr << "Refit: " << result.refitMismatches << " of " << count << " rays hit differently than with a new BVH" << std::endl;
+	else
+		printf( "Refit: all %u rays hit the same as with a new BVH\n", count );
+}
+#endif
+
+// A JSON number, or null if there is none
+static std::string JSONNumber( float value )
+{
+	if ( !std::isfinite( value ) )
+		return "null";
+	std::ostringstream s;
+	s << value;
+	return s.str();
+}
+
+// A JSON string, scenes can have backslashes in their path
+static std::string JSONString( const std::string &value )
+{
+	std::string s = "\"";
+	for ( char c : value )
+	{
+		if ( c == '"' || c == '\\' )
+			s += '\\';
+		s += c;
+	}
+	return s + "\"";
+}
+
+#ifdef TRAVERSALSTATS
+// The counters as a JSON object on one line
+static std::string JSONTraversal( const TraversalStats &stats )
+{
+	std::ostringstream s;
+	s << "{\"primary_rays\": " << stats.rays[RAY_PRIMARY] << ", \"bounce_rays\": " << stats.rays[RAY_BOUNCE]
+	  << ", \"shadow_rays\": " << stats.rays[RAY_SHADOW] << ", \"light_hits\": " << stats.lightHits
+	  << ", \"aabb_tests\": " << stats.aabbTests << ", \"triangle_tests\": " << stats.triangleTests
+	  << ", \"leaf_visits\": " << stats.leafVisits << ", \"early_outs\": " << stats.earlyOuts
+	  << ", \"culled_nodes\": " << stats.culledNodes << "}";
+	return s.str();
+}
+#endif
+
+bool Benchmark::WriteJSON( const std::string &filename ) const
+{
+	std::ofstream f( filename );
+	f << "{\n";
+	f << "\t\"width\": " << config.width << ",\n";
+	f << "\t\"height\": " << config.height << ",\n";
+	f << "\t\"threads\": " << threads << ",\n";
+	f << "\t\"runs\": " << config.runs << ",\n";
+	f << "\t\"frames\": " << BENCHMARKFRAMES << ",\n";
+	f << "\t\"features\": [";
+	bool first = true;
+	for ( uint bit = 0; bit < sizeof( featureNames ) / sizeof( featureNames[0] ); bit++ )
+	{
+		if ( !(CanonicalFeatures( config.features ) & (1 << bit)) )
+			continue;
+		f << (first ? "" : ", ") << JSONString( featureNames[bit] );
+		first = false;
+	}
+	f << "],\n";
+	f << "\t\"scenes\": [\n";
+	for ( size_t i = 0; i < results.size(); i++ )
+	{
+		const BenchmarkResult &r = results[i];
+		f << "\t\t{\n";
+		f << "\t\t\t\"scene\": " << JSONString( r.scene ) << ",\n";
+		if ( !r.error.empty() )
+			f << "\t\t\t\"error\": " << JSONString( r.error ) << "\n";
+		else
+		{
+			f << "\t\t\t\"triangles\": " << r.triangles << ",\n";
+			f << "\t\t\t\"bvh_build_ms\": " << JSONNumber( r.buildTime ) << ",\n";
+			f << "\t\t\t\"bvh_refit_ms\": " << JSONNumber( r.refitTime ) << ",\n";
+			f << "\t\t\t\"refit_mismatched_rays\": " << r.refitMismatches << ",\n";
+			f << "\t\t\t\"primary_rays\": " << r.nr_primary << ",\n";
+			f << "\t\t\t\"diffuse_rays\": " << r.nr_diffuse << ",\n";
+			f << "\t\t\t\"shadow_rays\": " << r.nr_shadow << ",\n";
+			f << "\t\t\t\"primary_mrays_per_s\": " << JSONNumber( r.primaryRays ) << ",\n";
+			f << "\t\t\t\"diffuse_mrays_per_s\": " << JSONNumber( r.diffuseRays ) << ",\n";
+			f << "\t\t\t\"shadow_mrays_per_s\": " << JSONNumber( r.shadowRays ) << ",\n";
+			f << "\t\t\t\"filter_ms\": " << JSONNumber( r.filterTime ) << ",\n";
+			f << "\t\t\t\"frame_ms\": " << JSONNumber( r.frameTime );
+			#ifdef TRAVERSALSTATS
+			f << ",\n\t\t\t\"traversal\": {\n";
+			f << "\t\t\t\t\"primary\": " << JSONTraversal( r.primaryStats ) << ",\n";
+			f << "\t\t\t\t\"diffuse\": " << JSONTraversal( r.diffuseStats ) << ",\n";
+			f << "\t\t\t\t\"shadow\": " << JSONTraversal( r.shadowStats ) << ",\n";
+			f << "\t\t\t\t\"frame\": " << JSONTraversal( r.frameStats ) << "\n";
+			f << "\t\t\t}";
+			#endif
+			f << "\n";
+		}
+		f << "\t\t}" << (i + 1 < results.size() ? "," : "") << "\n";
+	}
+	f << "\t]\n";
+	f << "}\n";
+	f.close();
+	if ( f.fail() )
+	{
+		std::cerr << "Could not write " << filename << std::endl;
+		return false;
+	}
+	printf( "Written to %s\n", filename.c_str() );
+	return true;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "config.h"
+#include "ray.h"
+#include "traversalstats.h"
+
+namespace AdvancedGraphics
+{
+
+class Game; // forward declaration
+
+// Timings of one scene, averaged over the runs. NAN if the measurement does not apply.
+struct BenchmarkResult
+{
+	// "default" for the default scene
+	std::string scene;
+	// Why the scene was not measured, empty if it was
+	std::string error;
+	uint64 triangles = 0;
+	float buildTime = NAN; // ms
+	// Of BVH::Refit after the mesh moved like ANIMATEMESH moves it, and the rays that hit differently than with a new BVH
+	float refitTime = NAN; // ms
+	uint64 refitMismatches = 0;
+	// Number of rays of every measurement, and millions of rays per second
+	uint64 nr_primary = 0, nr_diffuse = 0, nr_shadow = 0;
+	float primaryRays = 0, diffuseRays = 0, shadowRays = 0;
+	float filterTime = NAN; // ms per frame
+	float frameTime = 0; // ms
+	// Of one run of every measurement, and of the last frame. Only counted with TRAVERSALSTATS.
+	TraversalStats primaryStats, diffuseStats, shadowStats, frameStats;
+};
+
+// Measures the parts of the renderer separately, on the bundled scenes or on the scene of the
+// command line:
+//  - construction of the BVH
+//  - refitting the BVH after the mesh moved, checked against a new BVH over the moved triangles
+//  - closest hits of the primary rays, one per pixel
+//  - closest hits of diffuse bounces from the primary hits, in cosine-weighted random directions
+//  - occlusion of shadow rays from the primary hits to a random point on a random light
+//  - the filter, and whole frames with the configured features
+// Rays are traced one at a time, like the bounces of Game::Sample. The camera and the seeds are
+// fixed and the rays are generated before the clock starts, so two builds can be compared.
+// The camera can be set with --position and --direction, for all scenes.
+class Benchmark
+{
+  public:
+	Benchmark( const Config &config ) : config( config ) {}
+
+	// Measures every scene, returns false if none could be measured
+	bool Run();
+	// Writes the results as JSON, returns false if that fails
+	bool WriteJSON( const std::string &filename ) const;
+
+  private:
+	Config config;
+	uint threads = 0;
+	std::vector<BenchmarkResult> results;
+
+	BenchmarkResult Measure( const std::string &scene );
+	// The camera of the .obj scenes is placed for the inside of Sibenik. If it is outside of the
+	// mesh, the camera looks at the center of the mesh from a fixed direction instead.
+	void FrameScene( Game *game ) const;
+	// The rays of every measurement, for every pixel that sees an object
+	void GenerateRays( Game *game, std::vector<Ray> &primary, std::vector<Ray> &diffuse, std::vector<Ray> &shadow ) const;
+	// Traces all rays on the threads of the game, shadow rays for occlusion and the others for the closest hit.
+	// Returns the time in ms, stats is set to what tracing them cost.
+	float TraceRays( Game *game, const std::vector<Ray> &rays, RayKind kind, TraversalStats &stats ) const;
+	// Moves the mesh, refits its BVH and traces the rays through it and through a new BVH.
+	// The scene stays moved.
+	void MeasureRefit( Game *game, const std::vector<Ray> &rays, BenchmarkResult &result ) const;
+};
+
+}; // namespace AdvancedGraphics
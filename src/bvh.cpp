@@ -8,71 +8,182 @@ void GrowWithTriangle( aabb* bb, const Triangle* tri)
 	bb->Grow( tri->p2 );
 }
 
-bool BVHNode::Traverse( BVH *bvh, Ray *r, uint &depth, bool checkOcclusion )
+bool BVHNode::Traverse_Leaf( BVH *bvh, Ray *r, bool checkOcclusion ) const
 {
-	// if node is a leaf
-	if ( count > 0 )
-	{
-		return Traverse_Leaf(bvh, r, checkOcclusion);
-	}
-	else
+	assert(firstleft + count <= bvh->nr_indices);
+	bool found = false;
+	const TriangleBlock *block = bvh->blocks + bvh->leaf_blocks[firstleft];
+	for ( uint i = 0; i < count; i += TRIANGLEBLOCKWIDTH, block++ )
 	{
-		return Traverse_Node(bvh, r, depth, checkOcclusion);
+		if ( block->Intersect( bvh->triangles, r, checkOcclusion ) )
+		{
+			if ( checkOcclusion ) return true;
+			found = true;
+		}
 	}
+	return found;
 }
 
-bool BVHNode::Traverse_Leaf( BVH *bvh, Ray *r, bool checkOcclusion )
+// Only the far child is pushed, the near child is visited directly,
+// so the stack never holds more nodes than the depth of the tree.
+// Deeper trees, such as those over degenerate meshes, get a stack on the heap.
+#define BVHSTACKSIZE 128
+
+bool BVH::Traverse( Ray *r, uint &depth, bool checkOcclusion )
 {
-	assert(firstleft + count <= bvh->nr_triangles);
+	if ( nr_triangles <= 0 ) return false;
+#if BVHWIDTH > 2
+	return mbvh->Traverse( this, r, depth, checkOcclusion );
+#else
+	// Far nodes that still need to be visited, with the distance at which the ray enters them
+	struct StackEntry
+	{
+		const BVHNode *node;
+		float tmin;
+	};
+	TraversalStack<StackEntry, BVHSTACKSIZE> stack( nr_levels );
+	uint stackPtr = 0;
+	TRAVERSAL_STATS( TraversalStats &stats = TraversalStats::Local() );
+
 	bool found = false;
-	for ( size_t i = 0; i < count; i++ )
+	const BVHNode *node = root;
+	while ( true )
 	{
-		Triangle *tri = bvh->triangles + bvh->indices[firstleft + i];
-		if ( checkOcclusion )
+		if ( node->count > 0 )
 		{
-			found = tri->Occludes( r );
-			if ( found ) return true;
+			// Leaf node
+			TRAVERSAL_STATS( stats.leafVisits++ );
+			TRAVERSAL_STATS( stats.triangleTests += node->count );
+			if ( node->Traverse_Leaf( this, r, checkOcclusion ) )
+			{
+				if ( checkOcclusion )
+				{
+					TRAVERSAL_STATS( stats.earlyOuts++ );
+					return true;
+				}
+				found = true;
+			}
 		}
 		else
-			found |= tri->Intersect( r );
+		{
+			const BVHNode *left = pool + node->firstleft;
+			const BVHNode *right = left + 1;
+			float tminL, tmaxL, tminR, tmaxR;
+			TRAVERSAL_STATS( stats.aabbTests += 2 );
+			bool intL = left->AABBIntersection( r, tminL, tmaxL );
+			bool intR = right->AABBIntersection( r, tminR, tmaxR );
+
+			if ( intL && intR )
+			{
+				// Visit the nearest node first, the far one is visited later
+				depth += 2;
+				if ( tminR < tminL )
+				{
+					std::swap( left, right );
+					std::swap( tminL, tminR );
+				}
+				assert( stackPtr < stack.size );
+				stack[stackPtr++] = {right, tminR};
+				node = left;
+				continue;
+			}
+			if ( intL || intR )
+			{
+				depth++;
+				node = intL ? left : right;
+				continue;
+			}
+		}
+
+		// Pop the next node, skipping the ones behind the closest intersection so far
+		while ( true )
+		{
+			if ( stackPtr == 0 )
+				return found;
+			stackPtr--;
+			if ( stack[stackPtr].tmin <= r->t )
+				break;
+			TRAVERSAL_STATS( stats.culledNodes++ );
+		}
+		node = stack[stackPtr].node;
 	}
-	return found;
+#endif
 }
 
-bool BVHNode::Traverse_Node( BVH *bvh, Ray *r, uint &depth, bool checkOcclusion )
+void BVH::TraversePacket( RayPacket &packet, bool checkOcclusion )
 {
-	assert(firstleft <= bvh->nr_nodes);
-	assert(firstleft + 1 <= bvh->nr_nodes);
-
-	float tminL, tmaxL, tminR, tmaxR;
-	bool intL = AABBIntersection( r, bvh->pool[firstleft].bounds, tminL, tmaxL );
-	bool intR = AABBIntersection( r, bvh->pool[firstleft + 1].bounds, tminR, tmaxR );
+	if ( nr_triangles <= 0 ) return;
+	if ( !packet.coherent )
+	{
+		uint depth = 0;
+		for ( uint i = 0; i < packet.count; i++ )
+		{
+			if ( checkOcclusion )
+				packet.occluded[i] = packet.occluded[i] || Traverse( packet.rays + i, depth, true );
+			else
+				Traverse( packet.rays + i, depth, false );
+		}
+		return;
+	}
 
-	// if both sides are intersected, decide which is nearest
-	if ( intL && intR )
+	// Nodes with the range of rays that were active for their parent
+	struct StackEntry
+	{
+		const BVHNode *node;
+		uint first, last;
+	};
+	// Every pop pushes at most two children, so this holds at most one node per level
+	TraversalStack<StackEntry, BVHSTACKSIZE> stack( nr_levels );
+	uint stackPtr = 0;
+	stack[stackPtr++] = {root, 0, packet.count};
+	TRAVERSAL_STATS( TraversalStats &stats = TraversalStats::Local() );
+
+	while ( stackPtr > 0 )
 	{
-		bool leftIsNearNode = tminL < tminR;
-		float bound = leftIsNearNode ? tminR : tminL;
-		BVHNode nearNode = leftIsNearNode ? bvh->pool[firstleft] : bvh->pool[firstleft + 1];
-		BVHNode farNode = leftIsNearNode ? bvh->pool[firstleft + 1] : bvh->pool[firstleft];
+		StackEntry entry = stack[--stackPtr];
+		const BVHNode *node = entry.node;
+		TRAVERSAL_STATS( stats.aabbTests++ );
+		if ( !packet.IntersectsInterval( *node ) || !packet.Active( *node, entry.first, entry.last ) )
+			continue;
 
-		// first check nearest node
-		bool found = nearNode.Traverse( bvh, r, ++depth, checkOcclusion );
-		// early out
-		if ( found && r->t <= bound )
-			return found;
+		if ( node->count > 0 )
+		{
+			float tmin, tmax;
+			for ( uint i = entry.first; i < entry.last; i++ )
+			{
+				Ray *r = packet.rays + i;
+				if ( packet.Done( i ) )
+					continue;
+				TRAVERSAL_STATS( stats.aabbTests++ );
+				if ( !node->AABBIntersection( r, tmin, tmax ) )
+					continue;
+				TRAVERSAL_STATS( stats.leafVisits++ );
+				TRAVERSAL_STATS( stats.triangleTests += node->count );
+				if ( node->Traverse_Leaf( this, r, checkOcclusion ) && checkOcclusion )
+				{
+					TRAVERSAL_STATS( stats.earlyOuts++ );
+					packet.occluded[i] = true;
+				}
+			}
+			continue;
+		}
 
-		// then far node
-		found |= farNode.Traverse( bvh, r, ++depth, checkOcclusion );
-		
-		return found;
+		// Visit the child that is nearest for the first active ray first
+		const BVHNode *left = pool + node->firstleft;
+		const BVHNode *right = left + 1;
+		float tminL, tmaxL, tminR, tmaxR;
+		const Ray *r = packet.rays + entry.first;
+		TRAVERSAL_STATS( stats.aabbTests += 2 );
+		if ( !left->AABBIntersection( r, tminL, tmaxL ) )
+			tminL = 1e34f;
+		if ( !right->AABBIntersection( r, tminR, tmaxR ) )
+			tminR = 1e34f;
+		if ( tminR < tminL )
+			std::swap( left, right );
+		assert( stackPtr + 2 <= stack.size );
+		stack[stackPtr++] = {right, entry.first, entry.last};
+		stack[stackPtr++] = {left, entry.first, entry.last};
 	}
-	if (intL)
-		return bvh->pool[firstleft].Traverse( bvh, r, ++depth, checkOcclusion );
-	if (intR)
-		return bvh->pool[firstleft + 1].Traverse( bvh, r, ++depth, checkOcclusion );
-
-	return false;
 }
 
 void Swap( uint *a, uint *b )
@@ -82,10 +193,11 @@ void Swap( uint *a, uint *b )
 	*b = t;
 }
 
-void BVHNode::Subdivide( BVH *bvh, aabb* triangle_bounds )
+void BVHNode::Subdivide( BVH *bvh, const aabb* triangle_bounds )
 {
-	// Max number of primitives per leaf
-	if ( count <= 4 || bvh->nr_nodes + 2 >= bvh->nr_nodes_max)
+	// Max number of primitives per leaf. Other tasks may still take the last nodes of the
+	// pool after this check, AllocateNodePair is the one that decides.
+	if ( count <= BVHLEAFSIZE || bvh->nr_nodes + 2 > bvh->nr_nodes_max )
 		return;
 
 #if BVHBINS == 0
@@ -97,7 +209,85 @@ void BVHNode::Subdivide( BVH *bvh, aabb* triangle_bounds )
 #endif
 }
 
-void BVHNode::Subdivide_Binned( BVH *bvh, aabb* triangle_bounds )
+// Number of chunks to split the binning of a node in.
+// Only large nodes are worth the overhead of extra tasks.
+int BinningChunks( uint count )
+{
+	if ( count <= BVHPARALLELBINS )
+		return 1;
+	return omp_get_num_threads();
+}
+
+aabb CenterBounds( const BVH *bvh, const aabb *triangle_bounds, size_t first, size_t count )
+{
+	const int nr_chunks = BinningChunks( count );
+	aabb *chunkbounds = new aabb[nr_chunks];
+	for ( int c = 0; c < nr_chunks; c++ )
+	{
+		#pragma omp task shared( chunkbounds ) if ( nr_chunks > 1 )
+		{
+			aabb bounds;
+			bounds.Reset();
+			for ( size_t i = first + count * c / nr_chunks; i < first + count * (c + 1) / nr_chunks; i++ )
+				bounds.Grow( triangle_bounds[bvh->indices[i]].Center() );
+			chunkbounds[c] = bounds;
+		}
+	}
+	#pragma omp taskwait
+
+	aabb result = chunkbounds[0];
+	for ( int c = 1; c < nr_chunks; c++ )
+		result.Grow( chunkbounds[c] );
+	delete[] chunkbounds;
+	return result;
+}
+
+void PopulateBins( const BVH *bvh, const aabb *triangle_bounds, size_t first, size_t count, int axis, float edgeMin, float binLengthInv, size_t nr_bins, uint *counts, aabb *boxes )
+{
+	const int nr_chunks = BinningChunks( count );
+	uint *chunkcounts = new uint[nr_chunks * nr_bins];
+	aabb *chunkboxes = new aabb[nr_chunks * nr_bins];
+	for ( int c = 0; c < nr_chunks; c++ )
+	{
+		#pragma omp task shared( chunkcounts, chunkboxes ) if ( nr_chunks > 1 )
+		{
+			uint *ccounts = chunkcounts + c * nr_bins;
+			aabb *cboxes = chunkboxes + c * nr_bins;
+			for ( size_t b = 0; b < nr_bins; b++ )
+			{
+				ccounts[b] = 0;
+				cboxes[b].Reset();
+			}
+			for ( size_t i = first + count * c / nr_chunks; i < first + count * (c + 1) / nr_chunks; i++ )
+			{
+				aabb bb = triangle_bounds[bvh->indices[i]];
+				size_t bin = (bb.Center(axis) - edgeMin) * binLengthInv;
+				if ( bin == nr_bins ) // For values where center == max bin edge
+					bin = nr_bins - 1;
+				ccounts[bin]++;
+				cboxes[bin].Grow(bb);
+			}
+		}
+	}
+	#pragma omp taskwait
+
+	// Merge the chunks, min/max and sums do not depend on the order so this
+	// yields exactly the same bins as a single sequential pass.
+	for ( size_t b = 0; b < nr_bins; b++ )
+	{
+		counts[b] = 0;
+		boxes[b].Reset();
+		for ( int c = 0; c < nr_chunks; c++ )
+		{
+			counts[b] += chunkcounts[c * nr_bins + b];
+			boxes[b].Grow( chunkboxes[c * nr_bins + b] );
+		}
+	}
+	delete[] chunkcounts;
+	delete[] chunkboxes;
+}
+
+void BVHNode::Subdivide_Binned( BVH *bvh, const aabb* triangle_bounds )
 {
 	#if BVHBINS == 0
 	// Ugh the compiler complains if BVHBINS is 0 on windows
@@ -107,19 +297,14 @@ void BVHNode::Subdivide_Binned( BVH *bvh, aabb* triangle_bounds )
 	#endif
 	// Find longest axis and location for split
 	// This should yield better values, but increases computational performance by a bit.
-	aabb parentbounds; parentbounds.Reset();
-	for ( size_t i = firstleft; i < firstleft + count; i++ )
-	{
-		aabb bb = triangle_bounds[bvh->indices[i]];
-		parentbounds.Grow(bb.Center());
-	}
+	aabb parentbounds = CenterBounds( bvh, triangle_bounds, firstleft, count );
 	int axis = parentbounds.LongestAxis();
 	float edgeMin = parentbounds.bmin[axis];
 	float binLength = (parentbounds.bmax[axis] - edgeMin) / nr_bins;
 	/*
-	int axis = this->bounds.LongestAxis();
-	float edgeMin = bounds.bmin[axis];
-	float binLength = (bounds.bmax[axis] - edgeMin) / nr_bins;
+	int axis = Bounds().LongestAxis();
+	float edgeMin = bmin[axis];
+	float binLength = (bmax[axis] - edgeMin) / nr_bins;
 	*/
 	float binLengthInv = 1 / binLength;
 
@@ -128,24 +313,12 @@ void BVHNode::Subdivide_Binned( BVH *bvh, aabb* triangle_bounds )
 
 	uint counts[nr_bins];
 	aabb boxes[nr_bins];
-	for (int i = 0; i < nr_bins; i++){
-		counts[i] = 0;
-		boxes[i].Reset();
-	}
 
 	// Populate step
-	for ( size_t i = firstleft; i < firstleft + count; i++ )
-	{
-		aabb bb = triangle_bounds[bvh->indices[i]];
-		int bin = (bb.Center(axis) - edgeMin) * binLengthInv;
-		if ( bin == nr_bins ) // For values where center == max bin edge
-			bin = nr_bins - 1;
-		counts[bin]++;
-		boxes[bin].Grow(bb);
-	}
+	PopulateBins( bvh, triangle_bounds, firstleft, count, axis, edgeMin, binLengthInv, nr_bins, counts, boxes );
 
 	// Sweep step
-	float splitCostBest = bounds.Area() * count;
+	float splitCostBest = Bounds().Area() * count;
 	uint leftCountBest, rightCountBest;
 	aabb leftBoxBest, rightBoxBest;
 	int splitBinBest = -1;
@@ -155,7 +328,7 @@ void BVHNode::Subdivide_Binned( BVH *bvh, aabb* triangle_bounds )
 	leftCount = 0;
 	leftBox.Reset();
 
-	for ( int b = 0; b < nr_bins - 1; b++)
+	for ( size_t b = 0; b < nr_bins - 1; b++)
 	{
 		if (counts[b] == 0)
 			continue;
@@ -166,7 +339,7 @@ void BVHNode::Subdivide_Binned( BVH *bvh, aabb* triangle_bounds )
 		rightCount = 0;
 		rightBox.Reset();
 
-		for ( int b2 = b + 1; b2 < nr_bins; b2++)
+		for ( size_t b2 = b + 1; b2 < nr_bins; b2++)
 		{
 			rightBox.Grow(boxes[b2]);
 			rightCount += counts[b2];
@@ -183,12 +356,16 @@ void BVHNode::Subdivide_Binned( BVH *bvh, aabb* triangle_bounds )
 			rightCountBest = rightCount;
 			leftBoxBest = leftBox;
 			rightBoxBest = rightBox;
-			splitBinBest = b;
+			splitBinBest = (int)b;
 		}
 	}
 
 	if (splitBinBest < 0 )
 		return;
+	// Save this
+	uint leftidx;
+	if ( !bvh->AllocateNodePair( leftidx ) )
+		return;
 
 	// Divide step
 	leftCount = 0;
@@ -209,32 +386,31 @@ void BVHNode::Subdivide_Binned( BVH *bvh, aabb* triangle_bounds )
 		}
 	}
 
-	// Save this
-	int leftidx = bvh->nr_nodes;
-
 	// Do actual split
 	BVHNode *left, *right;
-	left = &bvh->pool[bvh->nr_nodes++];
-	right = &bvh->pool[bvh->nr_nodes++];
+	left = &bvh->pool[leftidx];
+	right = &bvh->pool[leftidx + 1];
 
 	// Assign triangles to new nodes
+	left->SetBounds( leftBoxBest );
 	left->firstleft = firstleft;
 	left->count = leftCountBest;
-	left->bounds = leftBoxBest;
 
+	right->SetBounds( rightBoxBest );
 	right->firstleft = firstleft + leftCountBest;
 	right->count = rightCountBest;
-	right->bounds = rightBoxBest;
 
 	this->count = 0;
 	this->firstleft = leftidx;
 
-	// Go in recursion on both child nodes
+	// Go in recursion on both child nodes, large ones as separate tasks
+	#pragma omp task if ( leftCountBest > BVHTASKSIZE )
 	left->Subdivide( bvh, triangle_bounds );
+	#pragma omp task if ( rightCountBest > BVHTASKSIZE )
 	right->Subdivide( bvh, triangle_bounds );
 }
 
-bool BVHNode::SAH( BVH *bvh, aabb* triangle_bounds, int &bestAxis, float &bestSplitLocation )
+bool BVHNode::SAH( BVH *bvh, const aabb* triangle_bounds, int &bestAxis, float &bestSplitLocation )
 {
 	bool foundLowerCost = false;
 	// Counts and aabbs for new child nodes
@@ -242,7 +418,7 @@ bool BVHNode::SAH( BVH *bvh, aabb* triangle_bounds, int &bestAxis, float &bestSp
 	uint rightCount = 0;
 	aabb leftbox, rightbox;
 
-	float LowestCost = bounds.Area() * count;
+	float LowestCost = Bounds().Area() * count;
 	// Try every axis
 	for ( size_t a = 0; a < 3; a++ )
 	{
@@ -287,7 +463,7 @@ bool BVHNode::SAH( BVH *bvh, aabb* triangle_bounds, int &bestAxis, float &bestSp
 	return foundLowerCost;
 }
 
-void BVHNode::Divide( BVH *bvh, aabb* triangle_bounds, int &axis, float &splitLocation )
+void BVHNode::Divide( BVH *bvh, const aabb* triangle_bounds, int &axis, float &splitLocation )
 {
 	// Counts and aabbs for new child nodes
 	uint leftCount = 0;
@@ -325,47 +501,48 @@ void BVHNode::Divide( BVH *bvh, aabb* triangle_bounds, int &axis, float &splitLo
 	float splitCost = rightArea * rightCount + leftArea * leftCount;
 
 	// Calculate cost of node before split (For SAH)
-	float currentCost = bounds.Area() * count;
-	if ( splitCost < currentCost )
+	float currentCost = Bounds().Area() * count;
+	// Save this
+	uint leftidx;
+	if ( splitCost < currentCost && bvh->AllocateNodePair( leftidx ) )
 	{
-		// Save this
-		int leftidx = bvh->nr_nodes;
-
 		// Do actual split
 		BVHNode *left, *right;
-		left = &bvh->pool[bvh->nr_nodes++];
-		right = &bvh->pool[bvh->nr_nodes++];
+		left = &bvh->pool[leftidx];
+		right = &bvh->pool[leftidx + 1];
 
 		// Assign triangles to new nodes
+		left->SetBounds( leftbox );
 		left->firstleft = firstleft;
 		left->count = leftCount;
-		left->bounds = leftbox;
 
+		right->SetBounds( rightbox );
 		right->firstleft = firstleft + leftCount;
 		right->count = rightCount;
-		right->bounds = rightbox;
 
 		this->count = 0;
 		this->firstleft = leftidx;
 
-		// Go in recursion on both child nodes
+		// Go in recursion on both child nodes, large ones as separate tasks
+		#pragma omp task if ( leftCount > BVHTASKSIZE )
 		left->Subdivide( bvh, triangle_bounds );
+		#pragma omp task if ( rightCount > BVHTASKSIZE )
 		right->Subdivide( bvh, triangle_bounds );
 	}
 }
 
-void BVHNode::Subdivide_Median( BVH *bvh, aabb* triangle_bounds )
+void BVHNode::Subdivide_Median( BVH *bvh, const aabb* triangle_bounds )
 {
 	// Find longest axis for split, TODO: Binning
-	int axis = this->bounds.LongestAxis();
+	int axis = Bounds().LongestAxis();
 
 	// Middle split, TODO: becomes better
-	float splitLocation = bounds.Center( axis );
+	float splitLocation = Bounds().Center( axis );
 
 	Divide( bvh, triangle_bounds, axis, splitLocation );
 }
 
-void BVHNode::Subdivide_SAH( BVH *bvh, aabb* triangle_bounds )
+void BVHNode::Subdivide_SAH( BVH *bvh, const aabb* triangle_bounds )
 {
 	int axis;
 	float splitLocation;
@@ -373,8 +550,52 @@ void BVHNode::Subdivide_SAH( BVH *bvh, aabb* triangle_bounds )
 		Divide( bvh, triangle_bounds, axis, splitLocation );
 }
 
-void BVHNode::RecomputeBounds( const BVH* bvh, aabb* triangle_bounds )
+void BVHNode::Subdivide_Linear( BVH *bvh, const aabb *triangle_bounds, const uint64 *codes )
 {
+	// Max number of primitives per leaf
+	uint leftidx;
+	if ( count <= BVHLEAFSIZE || !bvh->AllocateNodePair( leftidx ) )
+	{
+		RecomputeBounds( bvh, triangle_bounds );
+		return;
+	}
+
+	// The codes are sorted, so all codes in this node share their bits above the highest
+	// bit in which the first and last code differ. Split where that bit becomes 1.
+	const uint64 *first = codes + firstleft, *last = codes + firstleft + count - 1;
+	uint leftCount = count / 2;
+	if ( *first != *last )
+	{
+		uint64 bit = *first ^ *last;
+		bit |= bit >> 1, bit |= bit >> 2, bit |= bit >> 4;
+		bit |= bit >> 8, bit |= bit >> 16, bit |= bit >> 32;
+		bit ^= bit >> 1;
+		leftCount = std::partition_point( first, last + 1, [bit]( uint64 c ) { return (c & bit) == 0; } ) - first;
+	}
+	// Otherwise the triangles can not be told apart, so just split them in the middle
+
+	BVHNode *left = &bvh->pool[leftidx];
+	BVHNode *right = &bvh->pool[leftidx + 1];
+	left->firstleft = firstleft;
+	left->count = leftCount;
+	right->firstleft = firstleft + leftCount;
+	right->count = count - leftCount;
+
+	this->count = 0;
+	this->firstleft = leftidx;
+
+	// The bounds are built bottom up, so wait for both children
+	#pragma omp task if ( left->count > BVHTASKSIZE )
+	left->Subdivide_Linear( bvh, triangle_bounds, codes );
+	#pragma omp task if ( right->count > BVHTASKSIZE )
+	right->Subdivide_Linear( bvh, triangle_bounds, codes );
+	#pragma omp taskwait
+	RecomputeBounds( bvh, triangle_bounds );
+}
+
+void BVHNode::RecomputeBounds( const BVH* bvh, const aabb* triangle_bounds )
+{
+	aabb bounds;
 	bounds.Reset();
 	if (count > 0)
 	{
@@ -385,26 +606,29 @@ void BVHNode::RecomputeBounds( const BVH* bvh, aabb* triangle_bounds )
 	else
 	{
 		// Intermediate node
-		bounds.Grow(bvh->pool[firstleft].bounds);
-		bounds.Grow(bvh->pool[firstleft + 1].bounds);
+		bounds.Grow(bvh->pool[firstleft].Bounds());
+		bounds.Grow(bvh->pool[firstleft + 1].Bounds());
 	}
+	SetBounds( bounds );
 }
 
-bool BVHNode::AABBIntersection( const Ray *r, const aabb &bb, float &tmin, float &tmax )
+bool BVHNode::AABBIntersection( const Ray *r, float &tmin, float &tmax ) const
 {
-	vec3 invdir( 1 / r->direction.x, 1 / r->direction.y, 1 / r->direction.z );
-	vec3 vmin = (bb.bmin3 - r->origin) * invdir;
-	vec3 vmax = (bb.bmax3 - r->origin) * invdir;
-
-	tmax = std::min( std::min( std::max( vmin.x, vmax.x ), std::max( vmin.y, vmax.y ) ), std::max( vmin.z, vmax.z ) );
-	if ( tmax < 0 )
-		return false;
-
-	tmin = std::max( std::max( std::min( vmin.x, vmax.x ), std::min( vmin.y, vmax.y ) ), std::min( vmin.z, vmax.z ) );
-	if ( tmin > tmax )
-		return false;
-
-	return true;
+	// The sign of the direction tells which plane of each slab is hit first,
+	// so no min/max is needed to order the distances.
+	const float *planes[2] = { bmin, bmax };
+	tmin = (planes[r->sign[0]][0] - r->origin.x) * r->invdir.x;
+	tmax = (planes[1 - r->sign[0]][0] - r->origin.x) * r->invdir.x;
+	const float tminy = (planes[r->sign[1]][1] - r->origin.y) * r->invdir.y;
+	const float tmaxy = (planes[1 - r->sign[1]][1] - r->origin.y) * r->invdir.y;
+	const float tminz = (planes[r->sign[2]][2] - r->origin.z) * r->invdir.z;
+	const float tmaxz = (planes[1 - r->sign[2]][2] - r->origin.z) * r->invdir.z;
+
+	tmin = std::max( std::max( tmin, tminy ), tminz );
+	tmax = std::min( std::min( tmax, tmaxy ), tmaxz );
+
+	// Behind the ray, missed, or farther away than the closest intersection so far
+	return tmax >= 0 && tmin <= tmax && tmin < r->t;
 }
 
 void BVHNode::Print(BVH* bvh, uint depth)
@@ -433,6 +657,18 @@ void BVHNode::Print(BVH* bvh, uint depth)
 	}
 }
 
+BVH::~BVH()
+{
+	FREE64( pool );
+	delete[] indices;
+#if BVHWIDTH > 2
+	delete mbvh;
+#endif
+	delete[] node_costs;
+	FREE64( blocks );
+	delete[] leaf_blocks;
+}
+
 void BVH::ConstructBVH( Triangle *triangles, uint triangleCount )
 {
 	printf( "Constructing BVH...\n" );
@@ -441,36 +677,338 @@ void BVH::ConstructBVH( Triangle *triangles, uint triangleCount )
 	this->nr_triangles = triangleCount;
 	//return;
 	
-	indices = new uint[triangleCount];
-
-	// initial index values
-	for ( size_t i = 0; i < triangleCount; i++ )
-		indices[i] = i;
+	indices = new uint[MaxIndices( triangleCount )];
 
 	// allocate space for BVH Nodes with max possible nodes
-	nr_nodes_max = triangleCount * 2 - 1;
-	pool = new BVHNode[nr_nodes_max];
+	// A binary tree over n triangles has at most 2n - 1 nodes, plus the dummy.
+	nr_nodes_max = MaxIndices( triangleCount ) * 2;
+	pool = (BVHNode *)MALLOC64( nr_nodes_max * sizeof( BVHNode ) );
 	printf( "Maximum number of nodes: %i\n", nr_nodes_max - 1 );
 
 	aabb *triangle_bounds = new aabb[triangleCount];
-	for (uint t = 0; t < triangleCount; t++)
+	ComputeTriangleBounds( triangle_bounds );
+	Build( triangle_bounds );
+	printf( "Used number of nodes: %i (%zu bytes per node, %zu KiB)\n", nr_nodes.load() - 1, sizeof( BVHNode ), nr_nodes * sizeof( BVHNode ) / 1024 );
+	printf( "SAH cost: %.2f\n", SAHCost() );
+
+	delete[] triangle_bounds;
+	GatherLeaves();
+	RecordLevels();
+	printf( "Levels: %u\n", nr_levels );
+
+#if BVHWIDTH > 2
+	mbvh = new MBVH();
+	mbvh->Construct( this );
+#endif
+}
+
+void BVH::ComputeTriangleBounds( aabb *triangle_bounds ) const
+{
+	#pragma omp parallel for
+	for ( int t = 0; t < (int)nr_triangles; t++ )
 	{
 		aabb *bb = triangle_bounds + t;
 		const Triangle *tri = triangles + t;
 		bb->Reset();
 		GrowWithTriangle( bb, tri );
 	}
+}
+
+void BVH::Build( const aabb *triangle_bounds )
+{
+	// initial index values
+	nr_indices = nr_triangles;
+	#pragma omp parallel for
+	for ( int t = 0; t < (int)nr_triangles; t++ )
+		indices[t] = t;
 
-	// leave dummy value on location 0 for cache alignment
+	// leave dummy value on location 0 for cache alignment:
+	// The root is at 1, so all sibling pairs start at an even index, i.e. on a cache line.
 	nr_nodes = 1;
  
 	root = &pool[nr_nodes++];
  	root->firstleft = 0;
- 	root->count = triangleCount;
+ 	root->count = nr_triangles;
  	root->RecomputeBounds(this, triangle_bounds);
 
-	root->Subdivide( this, triangle_bounds );
-	printf( "Used number of nodes: %i\n", nr_nodes - 1 );
+#if BVHBINS == 1
+	ConstructLinear( triangle_bounds );
+#elif defined( USESBVH )
+	ConstructSpatial( triangle_bounds );
+#else
+	// The build tasks are spawned from a single thread, the others pick them up.
+	#pragma omp parallel
+	#pragma omp single
+	{
+		build_threads = omp_get_num_threads();
+		root->Subdivide( this, triangle_bounds );
+	}
+#endif
+	RecordCosts( triangle_bounds );
+}
+
+// Subtrees near the root are refitted as separate tasks
+#define BVHREFITTASKDEPTH 8
+
+aabb BVH::RefitSubtree( uint index, const aabb *triangle_bounds, float *cost, bool update, uint depth )
+{
+	BVHNode &node = pool[index];
+	aabb bounds;
+	if ( node.count > 0 )
+	{
+		bounds.Reset();
+		for ( uint i = node.firstleft; i < node.firstleft + node.count; i++ )
+			bounds.Grow( triangle_bounds[indices[i]] );
+		cost[index] = bounds.Area() * node.count;
+	}
+	else
+	{
+		aabb left, right;
+		#pragma omp task shared( left ) if ( depth < BVHREFITTASKDEPTH )
+		left = RefitSubtree( node.firstleft, triangle_bounds, cost, update, depth + 1 );
+		right = RefitSubtree( node.firstleft + 1, triangle_bounds, cost, update, depth + 1 );
+		#pragma omp taskwait
+		bounds = aabb::Union( left, right );
+		cost[index] = bounds.Area() + cost[node.firstleft] + cost[node.firstleft + 1];
+	}
+	if ( update )
+		node.SetBounds( bounds );
+	return bounds;
+}
+
+void BVH::RecordCosts( const aabb *triangle_bounds )
+{
+	if ( node_costs == nullptr )
+		node_costs = new float[nr_nodes_max];
+	// Spatial splits clip the node bounds, so the costs are computed from the unclipped
+	// bounds that Refit would give, without changing the tree.
+	#pragma omp parallel
+	#pragma omp single
+	RefitSubtree( root - pool, triangle_bounds, node_costs, false, 0 );
+}
+
+void BVH::Refit()
+{
+	aabb *triangle_bounds = new aabb[nr_triangles];
+	ComputeTriangleBounds( triangle_bounds );
+	if ( node_costs == nullptr )
+		RecordCosts( triangle_bounds );
+
+	float *costs = new float[nr_nodes];
+	#pragma omp parallel
+	#pragma omp single
+	RefitSubtree( root - pool, triangle_bounds, costs, true, 0 );
+
+	// Find the topmost subtrees whose cost grew too much since they were built
+	std::vector<uint> degraded;
+	std::vector<uint> stack = {(uint)(root - pool)};
+	while ( !stack.empty() )
+	{
+		uint index = stack.back();
+		stack.pop_back();
+		const BVHNode &node = pool[index];
+		if ( node.count > 0 )
+			continue;
+		if ( costs[index] > BVHREBUILDFACTOR * node_costs[index] )
+			degraded.push_back( index );
+		else
+		{
+			stack.push_back( node.firstleft );
+			stack.push_back( node.firstleft + 1 );
+		}
+	}
+	delete[] costs;
+
+	if ( !degraded.empty() )
+	{
+		// The linear and spatial builds do not work on a single subtree, and the root is the whole tree
+		bool full = BVHBINS == 1 || degraded[0] == (uint)(root - pool);
+#ifdef USESBVH
+		full = true;
+#endif
+		// Each subtree is rebuilt into new nodes, the old ones are only reclaimed by a full rebuild
+		uint needed = 0;
+		for ( uint index : degraded )
+			needed += 2 * SubtreeTriangles( index );
+		if ( full || nr_nodes + needed > nr_nodes_max )
+			Build( triangle_bounds );
+		else
+		{
+			#pragma omp parallel
+			#pragma omp single
+			for ( uint index : degraded )
+			{
+				// The triangles of a subtree are contiguous in indices, make it a leaf over all of them and split again
+				BVHNode *node = &pool[index];
+				uint first = FirstTriangle( index );
+				node->count = SubtreeTriangles( index );
+				node->firstleft = first;
+				#pragma omp task
+				node->Subdivide( this, triangle_bounds );
+			}
+			RecordCosts( triangle_bounds );
+		}
+	}
+	delete[] triangle_bounds;
+	// The triangles moved, so the blocks are outdated even if the tree is not
+	GatherLeaves();
+	RecordLevels();
+
+#if BVHWIDTH > 2
+	// Refit runs every frame of an animation, so without the output of a new build
+	mbvh->Construct( this, false );
+#endif
+}
+
+void BVH::GatherLeaves()
+{
+	// Collect the leaves that are in the tree, a partial rebuild in Refit leaves unused nodes in the pool
+	std::vector<const BVHNode *> leaves;
+	std::vector<const BVHNode *> stack = {root};
+	while ( !stack.empty() )
+	{
+		const BVHNode *node = stack.back();
+		stack.pop_back();
+		if ( node->count > 0 )
+			leaves.push_back( node );
+		else
+		{
+			stack.push_back( &pool[node->firstleft + 1] );
+			stack.push_back( &pool[node->firstleft] );
+		}
+	}
+
+	// Blocks are stored in the order of the leaves, depth first
+	if ( leaf_blocks == nullptr )
+		leaf_blocks = new uint[MaxIndices( nr_triangles )];
+	nr_blocks = 0;
+	for ( const BVHNode *leaf : leaves )
+	{
+		leaf_blocks[leaf->firstleft] = nr_blocks;
+		nr_blocks += (leaf->count + TRIANGLEBLOCKWIDTH - 1) / TRIANGLEBLOCKWIDTH;
+	}
+	if ( blocks != nullptr )
+		FREE64( blocks );
+	blocks = (TriangleBlock *)MALLOC64( std::max( 1u, nr_blocks ) * sizeof( TriangleBlock ) );
+
+	#pragma omp parallel for schedule( dynamic, 256 )
+	for ( int l = 0; l < (int)leaves.size(); l++ )
+	{
+		const BVHNode *leaf = leaves[l];
+		TriangleBlock *block = blocks + leaf_blocks[leaf->firstleft];
+		for ( uint i = 0; i < leaf->count; i += TRIANGLEBLOCKWIDTH, block++ )
+			block->Set( triangles, indices + leaf->firstleft + i, std::min( leaf->count - i, (uint)TRIANGLEBLOCKWIDTH ) );
+	}
+}
+
+void BVH::RecordLevels()
+{
+	nr_levels = 0;
+	std::vector<std::pair<uint, uint>> stack = {{(uint)(root - pool), 1u}};
+	while ( !stack.empty() )
+	{
+		const uint index = stack.back().first, level = stack.back().second;
+		stack.pop_back();
+		nr_levels = std::max( nr_levels, level );
+		const BVHNode &node = pool[index];
+		if ( node.count == 0 )
+		{
+			stack.push_back( {node.firstleft, level + 1} );
+			stack.push_back( {node.firstleft + 1, level + 1} );
+		}
+	}
+}
+
+bool BVH::IsConsistent() const
+{
+	for ( uint i = 0; i < nr_indices; i++ )
+	{
+		if ( indices[i] >= nr_triangles )
+			return false;
+	}
+
+	// A node that is reached twice would make traversal visit it over and over
+	const uint nodes = nr_nodes;
+	std::vector<bool> reached( nodes, false );
+	std::vector<uint> stack = {(uint)(root - pool)};
+	while ( !stack.empty() )
+	{
+		const uint index = stack.back();
+		stack.pop_back();
+		if ( reached[index] )
+			return false;
+		reached[index] = true;
+		const BVHNode &node = pool[index];
+		if ( node.count > 0 )
+		{
+			if ( node.firstleft > nr_indices || node.count > nr_indices - node.firstleft )
+				return false;
+		}
+		else
+		{
+			// Children come after the dummy and the root
+			if ( node.firstleft < 2 || node.firstleft >= nodes - 1 )
+				return false;
+			stack.push_back( node.firstleft );
+			stack.push_back( node.firstleft + 1 );
+		}
+	}
+	return true;
+}
+
+uint BVH::SubtreeTriangles( uint index ) const
+{
+	const BVHNode &node = pool[index];
+	if ( node.count > 0 )
+		return node.count;
+	return SubtreeTriangles( node.firstleft ) + SubtreeTriangles( node.firstleft + 1 );
+}
+
+uint BVH::FirstTriangle( uint index ) const
+{
+	const BVHNode &node = pool[index];
+	if ( node.count > 0 )
+		return node.firstleft;
+	return FirstTriangle( node.firstleft );
+}
+
+void BVH::ConstructLinear( const aabb *triangle_bounds )
+{
+	// Quantize the centers to a grid inside their bounds. With more triangles a finer grid
+	// is worth the extra sort passes: 10 bits per axis (30 bit codes) or 21 (63 bit codes).
+	const uint bitsPerAxis = nr_triangles < (1 << 20) ? 10 : 21;
+	const float gridSize = (float)(1 << bitsPerAxis);
+	aabb centers = CenterBounds( this, triangle_bounds, 0, nr_triangles );
+	float scale[3];
+	for ( int a = 0; a < 3; a++ )
+	{
+		float extent = centers.bmax[a] - centers.bmin[a];
+		scale[a] = extent > 0 ? (gridSize - 1) / extent : 0;
+	}
+
+	uint64 *codes = new uint64[nr_triangles];
+	#pragma omp parallel for
+	for ( int t = 0; t < (int)nr_triangles; t++ )
+	{
+		uint64 code = 0;
+		for ( int a = 0; a < 3; a++ )
+		{
+			uint64 cell = (uint64)( (triangle_bounds[t].Center( a ) - centers.bmin[a]) * scale[a] );
+			code |= ExpandBits( cell ) << (2 - a);
+		}
+		codes[t] = code;
+	}
+
+	// The sorted order of the triangles is the order of the leaves
+	RadixSort( codes, indices, nr_triangles, 3 * bitsPerAxis );
+
+	#pragma omp parallel
+	#pragma omp single
+	{
+		build_threads = omp_get_num_threads();
+		root->Subdivide_Linear( this, triangle_bounds, codes );
+	}
+	delete[] codes;
 }
 
 void BVH::Print()
@@ -478,3 +1016,158 @@ void BVH::Print()
 	std::cout << "BVH:" << std::endl;
 	root->Print(this, 1);
 }
+
+float BVH::SAHCost() const
+{
+	const float rootArea = root->Bounds().Area();
+	float cost = 0;
+	std::vector<const BVHNode *> stack = {root};
+	while ( !stack.empty() )
+	{
+		const BVHNode *node = stack.back();
+		stack.pop_back();
+		// The chance that a ray hitting the root also hits this node
+		float p = node->Bounds().Area() / rootArea;
+		if ( node->count > 0 )
+			cost += p * node->count;
+		else
+		{
+			cost += p;
+			stack.push_back( &pool[node->firstleft] );
+			stack.push_back( &pool[node->firstleft + 1] );
+		}
+	}
+	return cost;
+}
+
+// Increase this when the layout of the cache file changes
+#define BVHCACHEVERSION 3
+
+struct BVHCacheHeader
+{
+	char magic[4];
+	uint version;
+	uint64 hash;
+	// Settings the BVH was built with, a cache made with other settings is rebuilt
+	uint bins;
+	uint leafSize;
+	uint spatialBudget;
+	uint nodeSize;
+	uint nr_triangles;
+	uint nr_indices;
+	uint nr_nodes;
+};
+
+#ifdef USESBVH
+#define BVHCACHESPATIAL SBVHBUDGET
+#else
+#define BVHCACHESPATIAL 0
+#endif
+
+// Triangles have a vtable, so only their data is stored
+struct BVHCacheTriangle
+{
+	vec3 p0, p1, p2, normal;
+	vec2 t0, t1, t2;
+	int material;
+};
+
+void BVH::SaveCache( const std::string &filename, uint64 hash ) const
+{
+	BVHCacheHeader header = {{'B', 'V', 'H', 'C'}, BVHCACHEVERSION, hash, BVHBINS, BVHLEAFSIZE, BVHCACHESPATIAL, sizeof( BVHNode ), nr_triangles, nr_indices, nr_nodes.load()};
+
+	std::vector<BVHCacheTriangle> data( nr_triangles );
+	for ( uint i = 0; i < nr_triangles; i++ )
+	{
+		const Triangle &tri = triangles[i];
+		data[i] = {tri.p0, tri.p1, tri.p2, tri.normal, tri.t0, tri.t1, tri.t2, tri.material};
+	}
+
+	std::ofstream f( filename, std::ios::binary );
+	f.write( (char *)&header, sizeof( header ) );
+	f.write( (char *)pool, header.nr_nodes * sizeof( BVHNode ) );
+	f.write( (char *)indices, nr_indices * sizeof( uint ) );
+	f.write( (char *)data.data(), nr_triangles * sizeof( BVHCacheTriangle ) );
+	f.close();
+	if ( f.fail() )
+		std::cerr << "Could not write BVH cache " << filename << std::endl;
+	else
+		printf( "Saved BVH to %s\n", filename.c_str() );
+}
+
+bool BVH::LoadCache( const std::string &filename, uint64 hash )
+{
+	std::ifstream f( filename, std::ios::binary );
+	if ( !f.good() )
+		return false;
+
+	BVHCacheHeader header;
+	f.read( (char *)&header, sizeof( header ) );
+	if ( !f.good() || memcmp( header.magic, "BVHC", 4 ) != 0 || header.version != BVHCACHEVERSION ||
+		 header.hash != hash || header.bins != BVHBINS || header.leafSize != BVHLEAFSIZE || header.spatialBudget != BVHCACHESPATIAL || header.nodeSize != sizeof( BVHNode ) )
+	{
+		printf( "BVH cache %s is outdated, rebuilding...\n", filename.c_str() );
+		return false;
+	}
+
+	// The sizes have to match the file, and fit in the buffers below, which are sized like
+	// those of ConstructBVH. Otherwise a corrupt cache would make the reads overrun them.
+	f.seekg( 0, std::ios::end );
+	const uint64 fileSize = (uint64)f.tellg();
+	f.seekg( sizeof( header ) );
+	const uint64 expectedSize = sizeof( header ) + (uint64)header.nr_nodes * sizeof( BVHNode ) +
+		(uint64)header.nr_indices * sizeof( uint ) + (uint64)header.nr_triangles * sizeof( BVHCacheTriangle );
+	if ( fileSize != expectedSize || header.nr_nodes < 2 || header.nr_nodes > (uint64)MaxIndices( header.nr_triangles ) * 2 ||
+		 header.nr_indices > MaxIndices( header.nr_triangles ) )
+	{
+		printf( "BVH cache %s is corrupt, rebuilding...\n", filename.c_str() );
+		return false;
+	}
+
+	printf( "Loading BVH from %s...\n", filename.c_str() );
+	nr_triangles = header.nr_triangles;
+	nr_indices = header.nr_indices;
+	nr_nodes = header.nr_nodes;
+	// Keep the allocation a multiple of the cache line size
+	// The same sizes as ConstructBVH, so the tree can be rebuilt by Refit
+	nr_nodes_max = MaxIndices( nr_triangles ) * 2;
+	pool = (BVHNode *)MALLOC64( nr_nodes_max * sizeof( BVHNode ) );
+	indices = new uint[MaxIndices( nr_triangles )];
+	std::vector<BVHCacheTriangle> data( nr_triangles );
+
+	f.read( (char *)pool, header.nr_nodes * sizeof( BVHNode ) );
+	f.read( (char *)indices, nr_indices * sizeof( uint ) );
+	f.read( (char *)data.data(), nr_triangles * sizeof( BVHCacheTriangle ) );
+	root = &pool[1];
+	if ( !f.good() || !IsConsistent() )
+	{
+		std::cerr << "BVH cache " << filename << " is incomplete or corrupt, rebuilding..." << std::endl;
+		FREE64( pool );
+		delete[] indices;
+		pool = nullptr;
+		indices = nullptr;
+		return false;
+	}
+
+	triangles = new Triangle[nr_triangles];
+	for ( uint i = 0; i < nr_triangles; i++ )
+	{
+		const BVHCacheTriangle &d = data[i];
+		triangles[i] = Triangle( d.p0, d.p1, d.p2, d.normal, d.material );
+		triangles[i].t0 = d.t0;
+		triangles[i].t1 = d.t1;
+		triangles[i].t2 = d.t2;
+	}
+	build_threads = 0;
+	node_costs = nullptr;
+	printf( "Used number of nodes: %i (%zu bytes per node, %zu KiB)\n", nr_nodes.load() - 1, sizeof( BVHNode ), nr_nodes * sizeof( BVHNode ) / 1024 );
+	printf( "SAH cost: %.2f\n", SAHCost() );
+	GatherLeaves();
+	RecordLevels();
+
+#if BVHWIDTH > 2
+	mbvh = new MBVH();
+	mbvh->Construct( this );
+#endif
+	return true;
+}
@@ -4,47 +4,115 @@
 #include "ray.h"
 #include "primitive.h"
 #include "vectors.h"
+#include "mbvh.h"
+#include "triangleblock.h"
+#include "packet.h"
+#include "traversalstats.h"
 
 namespace AdvancedGraphics
 {
 
 struct BVH; // forward declaration
+struct SBVHBuild;
+struct SBVHReference;
 
-struct BVHNode
+// Nodes are 32 bytes, so two siblings share a single 64 byte cache line.
+// The first index and triangle count are packed into the unused w lanes of the bounds.
+struct ALIGN( 32 ) BVHNode
 {
   public:
-	aabb bounds;
-	size_t firstleft; 
-	uint count; // number of triangles
-	bool Traverse( BVH *bvh, Ray *r, uint &depth, bool checkOcclusion );
-	void Subdivide( BVH *bvh, aabb* triangle_bounds );
-	void RecomputeBounds( const BVH *bvh, aabb* triangle_bounds );
-	bool AABBIntersection( const Ray *r, const aabb &bb, float &tmin, float &tmax );
+	union { __m128 bmin4; struct { float bmin[3]; uint firstleft; }; };
+	union { __m128 bmax4; struct { float bmax[3]; uint count; }; }; // count is the number of triangles
+
+	inline aabb Bounds() const { return aabb( bmin4, bmax4 ); }
+	// Overwrites the bounds, but keeps firstleft and count
+	inline void SetBounds( const aabb &bb )
+	{
+		uint f = firstleft, c = count;
+		bmin4 = bb.bmin4, bmax4 = bb.bmax4;
+		firstleft = f, count = c;
+	}
+
+	bool Traverse_Leaf( BVH *bvh, Ray *r, bool checkOcclusion ) const;
+	void Subdivide( BVH *bvh, const aabb* triangle_bounds );
+	// Top down split of Morton sorted triangles, used instead of Subdivide for the linear BVH
+	void Subdivide_Linear( BVH *bvh, const aabb *triangle_bounds, const uint64 *codes );
+	// Binned build that also considers spatial splits, used instead of Subdivide for the SBVH
+	void Subdivide_Spatial( BVH *bvh, SBVHBuild &build, std::vector<SBVHReference> &refs );
+	void RecomputeBounds( const BVH *bvh, const aabb* triangle_bounds );
+	bool AABBIntersection( const Ray *r, float &tmin, float &tmax ) const;
 	void Print(BVH* bvh, uint depth);
   private:
-	bool Traverse_Leaf(BVH *bvh, Ray *r, bool checkOcclusion);
-	bool Traverse_Node(BVH *bvh, Ray *r, uint &depth, bool checkOcclusion);
-	void Subdivide_Binned( BVH* bvh, aabb* triangle_bounds );
-	void Subdivide_Median( BVH *bvh, aabb* triangle_bounds );
-	void Subdivide_SAH( BVH *bvh, aabb* triangle_bounds );
+	void Subdivide_Binned( BVH* bvh, const aabb* triangle_bounds );
+	void Subdivide_Median( BVH *bvh, const aabb* triangle_bounds );
+	void Subdivide_SAH( BVH *bvh, const aabb* triangle_bounds );
 
-	bool SAH( BVH *bvh, aabb* triangle_bounds, int &bestAxis, float &bestSplitLocation );
-	void Divide( BVH *bvh, aabb* triangle_bounds, int &bestAxis, float &bestSplitLocation );
+	bool SAH( BVH *bvh, const aabb* triangle_bounds, int &bestAxis, float &bestSplitLocation );
+	void Divide( BVH *bvh, const aabb* triangle_bounds, int &bestAxis, float &bestSplitLocation );
 };
 
 struct BVH
 {
   public:
-	BVHNode *pool;
-	uint nr_nodes, nr_nodes_max;
+	BVHNode *pool = nullptr;
+	// Atomic, since the parallel build allocates nodes from multiple tasks
+	std::atomic<uint> nr_nodes;
+	uint nr_nodes_max;
 
 	BVHNode *root;
 	Triangle *triangles;
 	uint nr_triangles;
-	uint *indices;
+	uint *indices = nullptr;
+	// Spatial splits can reference a triangle from multiple leaves, so there may be more indices than triangles
+	uint nr_indices;
+#if BVHWIDTH > 2
+	// Wide BVH collapsed from this one, used for traversal
+	MBVH *mbvh = nullptr;
+#endif
+	// Number of levels of the tree, a leaf root is 1. The traversal stacks are sized from it.
+	uint nr_levels = 0;
+	// Number of threads used for the last ConstructBVH
+	int build_threads;
+	// SAH cost of the subtree of every node when it was built, see Refit
+	float *node_costs = nullptr;
+	// The triangles of all leaves, gathered for SIMD intersection.
+	// A leaf uses consecutive blocks, starting at leaf_blocks[firstleft].
+	TriangleBlock *blocks = nullptr;
+	uint nr_blocks;
+	uint *leaf_blocks = nullptr;
+
+	// Frees the tree, the triangles belong to the scene
+	~BVH();
 
 	void ConstructBVH( Triangle *triangles, uint triangleCount );
+	// Updates the bounds after the triangles moved, in parallel and bottom up.
+	// Subtrees whose SAH cost grew by more than BVHREBUILDFACTOR are rebuilt.
+	// Fast enough to call every frame, see ANIMATEMESH.
+	void Refit();
 	void Print();
+	// Expected cost of tracing a ray, relative to the root, with traversal steps and triangle tests being equally expensive
+	float SAHCost() const;
+
+	// Store the constructed BVH together with its triangles, hash identifies the mesh
+	void SaveCache( const std::string &filename, uint64 hash ) const;
+	// Replaces construction, the triangles are allocated and loaded as well.
+	// Fails if there is no cache, or if it was made from another mesh or with other settings.
+	bool LoadCache( const std::string &filename, uint64 hash );
+
+	// Reserve two consecutive nodes in the pool and return the index of the first in index.
+	// This is safe to call from multiple build tasks at once. Fails when the pool is full,
+	// then the node that was being split stays a leaf.
+	inline bool AllocateNodePair( uint &index )
+	{
+		uint n = nr_nodes.load();
+		do
+		{
+			if ( n + 2 > nr_nodes_max )
+				return false;
+		} while ( !nr_nodes.compare_exchange_weak( n, n + 2 ) );
+		index = n;
+		return true;
+	}
 
 	inline bool Occludes( Ray *r )
 	{
@@ -55,12 +123,39 @@ struct BVH
 	{
 		return Traverse(r, depth, false);
 	}
+	// Closest hit or occlusion for all rays of the packet, in the binary tree
+	void TraversePacket( RayPacket &packet, bool checkOcclusion );
   private:
-	inline bool Traverse( Ray *r, uint &depth, bool checkOcclusion )
+	// Spatial splits need room for the triangles they duplicate
+	static inline uint MaxIndices( uint triangleCount )
 	{
-		if ( nr_triangles <= 0 ) return false;
-		return root->Traverse( this, r, depth, checkOcclusion );
+#ifdef USESBVH
+		return triangleCount + (uint64)triangleCount * SBVHBUDGET / 100;
+#else
+		return triangleCount;
+#endif
 	}
+	void ComputeTriangleBounds( aabb *triangle_bounds ) const;
+	// Builds the tree over all triangles, into the allocated pool
+	void Build( const aabb *triangle_bounds );
+	// Computes the bounds and SAH cost of every node in the subtree, the bounds are only stored if update is set
+	aabb RefitSubtree( uint index, const aabb *triangle_bounds, float *cost, bool update, uint depth );
+	void RecordCosts( const aabb *triangle_bounds );
+	// Fills the blocks of all leaves, after the tree or the triangles changed
+	void GatherLeaves();
+	// Sets nr_levels, after the tree changed
+	void RecordLevels();
+	// Checks that the children and triangles of every node lie inside the pool and the indices,
+	// and that no node is reached twice. For trees that were not built here, see LoadCache.
+	bool IsConsistent() const;
+	uint SubtreeTriangles( uint index ) const;
+	uint FirstTriangle( uint index ) const;
+	// Builds the tree from the Morton codes of the triangle centers, much faster but of lower quality
+	void ConstructLinear( const aabb *triangle_bounds );
+	// Builds the tree with spatial splits, see sbvh.cpp
+	void ConstructSpatial( const aabb *triangle_bounds );
+	// Iterative traversal, nearest child first
+	bool Traverse( Ray *r, uint &depth, bool checkOcclusion );
 };
 
 }; // namespace AdvancedGraphics
\ No newline at end of file
@@ -25,41 +25,41 @@ bool Camera::KeyDown( int key, byte repeat )
     const float angle = 0.03;
     switch (key)
     {
-        case SDLK_w:
+        case KEY_W:
             position += speed * direction;
             return true;
-        case SDLK_a:
+        case KEY_A:
             position -= speed * right;
             return true;
-        case SDLK_s:
+        case KEY_S:
             position -= speed * direction;
             return true;
-        case SDLK_d:
+        case KEY_D:
             position += speed * right;
             return true;
-        case SDLK_e:
+        case KEY_E:
             position -= speed * down;
             return true;
-        case SDLK_r:
+        case KEY_R:
             fov += speed;
             return true;
-        case SDLK_f:
+        case KEY_F:
             fov -= speed;
             return true;
         // These do not re-trigger once pressed.
-        case SDLK_q:
+        case KEY_Q:
             position += speed * down;
             return true;
-        case SDLK_LEFT:
+        case KEY_LEFT:
             RotateAround(down, angle);
             return true;
-        case SDLK_RIGHT:
+        case KEY_RIGHT:
             RotateAround(down, -angle);
             return true;
-        case SDLK_UP:
+        case KEY_UP:
             RotateAround(right, -angle);
             return true;
-        case SDLK_DOWN:
+        case KEY_DOWN:
             RotateAround(right, angle);
             return true;
     }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "vectors.h"
+#include "keys.h"
 
 namespace AdvancedGraphics {
 
@@ -22,6 +23,7 @@ struct Camera
 	bool MouseDown( int button ) { return false; /* implement if you want to detect mouse button presses */ }
 	bool MouseMove( int x, int y ) { return false; /* implement if you want to detect mouse movement */ }
 	bool KeyUp( int key, byte repeat ) { return false; /* implement if you want to handle keys */ }
+	// key is one of the KEY_ values
 	bool KeyDown( int key, byte repeat );
 	private:
 	void RotateAround( vec3 axis, float angle );
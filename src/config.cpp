@@ -0,0 +1,168 @@
+#include "precomp.h" // include (only) this in every .cpp file
+#include "config.h"
+
+// Parses a number that has to fill the whole argument
+static bool ParseFloat( const char *s, float &value )
+{
+	char *end;
+	value = strtof( s, &end );
+	return end != s && *end == 0;
+}
+
+// A positive number up to max. Negative numbers and numbers that do not fit are rejected, strtoll
+// clamps those to LLONG_MIN or LLONG_MAX and sets errno.
+static bool ParseUInt( const char *s, uint &value, uint max = UINT_MAX )
+{
+	char *end;
+	errno = 0;
+	const long long v = strtoll( s, &end, 10 );
+	if ( end == s || *end != 0 || errno == ERANGE || v < 1 || v > (long long)max )
+		return false;
+	value = (uint)v;
+	return true;
+}
+
+// Keeps the pixel count times 4, such as the bytes of the screen, within an int
+static const uint maxResolution = 16384;
+
+// x,y,z
+static bool ParseVector( const char *s, vec3 &v )
+{
+	char end;
+	return sscanf( s, "%f,%f,%f%c", &v.x, &v.y, &v.z, &end ) == 3;
+}
+
+// A list of feature names separated by commas. Names with a + or - add or remove the feature
+// from the default features, without the first name the list replaces them.
+static bool ParseFeatures( const char *s, uint &features )
+{
+	std::istringstream list( s );
+	std::string name;
+	bool first = true;
+	while ( std::getline( list, name, ',' ) )
+	{
+		char sign = name.empty() ? 0 : name[0];
+		if ( sign == '+' || sign == '-' )
+			name = name.substr( 1 );
+		else
+		{
+			sign = 0;
+			if ( first )
+				features = 0;
+		}
+		first = false;
+		if ( name == "none" && sign == 0 )
+			continue;
+		const int count = sizeof( featureNames ) / sizeof( featureNames[0] );
+		int bit = 0;
+		while ( bit < count && name != featureNames[bit] )
+			bit++;
+		if ( bit == count )
+			return false;
+		if ( sign == '-' )
+			features &= ~(1u << bit);
+		else
+			features |= 1u << bit;
+	}
+	return true;
+}
+
+bool Config::Parse( int argc, char **argv )
+{
+	int positional = 0;
+	for ( int i = 1; i < argc; i++ )
+	{
+		const int first = i;
+		const std::string arg = argv[i];
+		// The value of an option, nullptr if it is missing
+		const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+		bool valid = true;
+		uint u;
+
+		if ( arg == "--help" || arg == "-h" )
+			valid = false;
+		else if ( arg == "--headless" )
+			headless = true;
+		else if ( arg[0] != '-' )
+		{
+			// The scene, and the number of copies of it
+			if ( positional == 0 )
+				scene = arg;
+			else if ( positional == 1 )
+				valid = ParseUInt( arg.c_str(), copies );
+			else
+				valid = false;
+			positional++;
+		}
+		else if ( value == nullptr )
+			valid = false;
+		else
+		{
+			i++;
+			if ( arg == "--output" || arg == "-o" )
+				output = value;
+			else if ( arg == "--width" )
+			{
+				valid = ParseUInt( value, u, maxResolution );
+				width = (int)u;
+			}
+			else if ( arg == "--height" )
+			{
+				valid = ParseUInt( value, u, maxResolution );
+				height = (int)u;
+			}
+			else if ( arg == "--spp" )
+				valid = ParseUInt( value, spp );
+			else if ( arg == "--time" )
+				valid = ParseFloat( value, seconds ) && seconds > 0;
+			else if ( arg == "--position" )
+				valid = hasPosition = ParseVector( value, position );
+			else if ( arg == "--direction" )
+				valid = hasDirection = ParseVector( value, direction ) && direction.length() > 0;
+			else if ( arg == "--fov" )
+				valid = ParseFloat( value, fov ) && fov > 0;
+			else if ( arg == "--features" )
+				valid = ParseFeatures( value, features );
+			else if ( arg == "--threads" )
+				valid = ParseUInt( value, threads );
+			else if ( arg == "--benchmark" )
+				benchmark = value;
+			else if ( arg == "--runs" )
+				valid = ParseUInt( value, runs );
+			else if ( arg == "--trace" )
+				trace = value;
+			else
+				valid = false;
+		}
+
+		if ( !valid )
+		{
+			if ( arg != "--help" && arg != "-h" )
+				std::cerr << "Invalid argument: " << arg << (i > first ? std::string( " " ) + argv[i] : "") << std::endl;
+			PrintUsage( argv[0] );
+			return false;
+		}
+	}
+	return true;
+}
+
+void Config::PrintUsage( const char *program )
+{
+	std::cout << "Usage: " << program << " [options] [file.obj [copies]]" << std::endl
+		<< "  --headless          Render without a window and write the image to the output" << std::endl
+		<< "  --output, -o FILE   Image of the headless mode, .png, .exr or any other format of FreeImage (render.png)" << std::endl
+		<< "  --width N           Width of the window or image (" << SCRWIDTH << ")" << std::endl
+		<< "  --height N          Height of the window or image (" << SCRHEIGHT << ")" << std::endl
+		<< "  --spp N             Samples per pixel of the headless mode (16)" << std::endl
+		<< "  --time SECONDS      Render for this long instead of a number of samples" << std::endl
+		<< "  --position X,Y,Z    Position of the camera" << std::endl
+		<< "  --direction X,Y,Z   Direction of the camera" << std::endl
+		<< "  --fov F             Distance of the screen to the camera, at a width of 1" << std::endl
+		<< "  --features LIST     Features of the renderer: none or nee,mis,rr,ssaa,filter. With +name or -name" << std::endl
+		<< "                      the default features are changed instead. F1 to F5 switch them in the window." << std::endl
+		<< "  --threads N         Render threads (all hardware threads)" << std::endl
+		<< "  --benchmark FILE    Measure the renderer on the bundled scenes, or on the given scene, and write the" << std::endl
+		<< "                      results as JSON" << std::endl
+		<< "  --runs N            Runs of the benchmark, the results are averaged (5)" << std::endl
+		<< "  --trace FILE        Write the stages of the last frames as Chrome trace-event JSON at exit" << std::endl;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "vectors.h"
+#include "renderfeatures.h"
+
+namespace AdvancedGraphics
+{
+
+// Options of the command line:
+//   AdvancedGraphics [options] [file.obj [copies]]
+// Without an .obj file the default scene is rendered.
+struct Config
+{
+  public:
+	// The .obj file of the scene, empty for the default scene, and the number of copies of it
+	std::string scene;
+	uint copies = 1;
+
+	// Render without a window, and write the image to output. PNG and the other 8 bit formats get the
+	// tone mapped image, EXR and HDR the linear radiance.
+	bool headless = false;
+	std::string output = "render.png";
+	// Resolution of the window or of the headless image
+	int width = SCRWIDTH, height = SCRHEIGHT;
+	// The headless mode stops after spp samples per pixel, or when seconds is set, after that many seconds
+	uint spp = 16;
+	float seconds = 0;
+
+	// Override the camera of the scene, when set
+	bool hasPosition = false, hasDirection = false;
+	vec3 position, direction;
+	// 0 keeps the field of view of the camera
+	float fov = 0;
+
+	// Mask of FEATURE_ values
+	uint features = DEFAULT_FEATURES;
+	// Render threads, 0 uses all hardware threads
+	uint threads = NR_THREADS;
+
+	// Run the benchmark instead, and write its results as JSON to this file, see benchmark.h.
+	// Every scene is measured runs times.
+	std::string benchmark;
+	uint runs = 5;
+	// Write the zones of the profiler to this file at exit, as Chrome trace-event JSON
+	std::string trace;
+
+	// Returns false if an argument is invalid or --help is given, after printing the usage
+	bool Parse( int argc, char **argv );
+	static void PrintUsage( const char *program );
+};
+
+}; // namespace AdvancedGraphics
@@ -21,6 +21,20 @@
 
 const int KERNEL_CENTER = KERNEL_SIZE / 2;
 
+// Rays traced by this thread. RenderTile adds its share to Game::nr_rays, so the
+// threads do not have to share a counter for every ray.
+static thread_local uint64 rays_traced = 0;
+
+// The names of the features in a mask
+static std::string FeatureList( uint features )
+{
+	std::string list;
+	for ( uint bit = 0; bit < sizeof( featureNames ) / sizeof( featureNames[0] ); bit++ )
+		if ( features & (1 << bit) )
+			list += (list.empty() ? "" : " ") + std::string( featureNames[bit] );
+	return list.empty() ? "none" : list;
+}
+
 void Game::InitDefaultScene()
 {
 	// materials
@@ -79,6 +93,35 @@ void Game::InitDefaultScene()
 	};
 }
 
+#if defined( USEBVH ) && defined( USEBVHCACHE )
+// Hash of the .obj file and the .mtl files it uses, so the BVH cache
+// is rebuilt when the mesh or its materials change.
+static uint64 HashObjFile( const std::string &filename, const std::string &basedir, std::vector<std::string> &mtlfiles )
+{
+	std::ifstream f( filename, std::ios::binary );
+	std::string content( ( std::istreambuf_iterator<char>( f ) ), std::istreambuf_iterator<char>() );
+	uint64 hash = HashBytes( content.data(), content.size() );
+
+	std::istringstream lines( content );
+	std::string line;
+	while ( std::getline( lines, line ) )
+	{
+		if ( line.compare( 0, 7, "mtllib " ) != 0 )
+			continue;
+		std::istringstream names( line.substr( 7 ) );
+		std::string name;
+		while ( names >> name )
+		{
+			mtlfiles.push_back( name );
+			std::ifstream mtl( basedir + name, std::ios::binary );
+			std::string mtlcontent( ( std::istreambuf_iterator<char>( mtl ) ), std::istreambuf_iterator<char>() );
+			hash = HashBytes( mtlcontent.data(), mtlcontent.size(), hash );
+		}
+	}
+	return hash;
+}
+#endif
+
 void Game::InitFromTinyObj( const std::string filename )
 {
 	view = new Camera( vec3( -18, -15, -0.1 ), vec3( 1, 0.25f, 0 ) );
@@ -108,7 +151,38 @@ void Game::InitFromTinyObj( const std::string filename )
 		basedir = filename.substr(0,found + 1);
 	}
 
-	bool ret = tinyobj::LoadObj( &attrib, &shapes, &obj_materials, &warn, &err, filename.c_str(), basedir.c_str(), true, false );
+	bool cached = false;
+	#if defined( USEBVH ) && defined( USEBVHCACHE )
+	std::vector<std::string> mtlfiles;
+	meshHash = HashObjFile( filename, basedir, mtlfiles );
+	bvhCacheFile = filename.substr( 0, filename.find_last_of( '.' ) ) + ".bvh";
+
+	timer::TimePoint t = timer::get();
+	bvh = new BVH();
+	cached = bvh->LoadCache( bvhCacheFile, meshHash );
+	if ( cached )
+	{
+		std::cout << "Loading time: " << timer::elapsed( t ) << " ms." << std::endl;
+		// The cache contains the triangles, so only the materials are left to load.
+		// Like tinyobj, use the first .mtl file that exists.
+		for ( const std::string &mtlfile : mtlfiles )
+		{
+			std::ifstream f( basedir + mtlfile );
+			if ( !f.good() )
+				continue;
+			std::map<std::string, int> material_map;
+			tinyobj::LoadMtl( &material_map, &obj_materials, &f, &warn, &err );
+			break;
+		}
+	}
+	else
+	{
+		delete bvh;
+		bvh = nullptr;
+	}
+	#endif
+
+	bool ret = cached || tinyobj::LoadObj( &attrib, &shapes, &obj_materials, &warn, &err, filename.c_str(), basedir.c_str(), true, false );
 	if ( !warn.empty() )
 		std::cout << warn << std::endl;
 	if ( !err.empty() )
@@ -129,6 +203,15 @@ void Game::InitFromTinyObj( const std::string filename )
 	}
 
 	nr_spheres = 0;
+	#if defined( USEBVH ) && defined( USEBVHCACHE )
+	if ( cached )
+	{
+		triangles = bvh->triangles;
+		nr_triangles = bvh->nr_triangles;
+		return;
+	}
+	#endif
+
 	nr_triangles = 0;
     for (size_t s = 0; s < shapes.size(); s++)
 		nr_triangles += shapes[s].mesh.indices.size() / 3;
@@ -152,94 +235,279 @@ void Game::InitFromTinyObj( const std::string filename )
 void Game::SetTarget( Surface* surface )
 { 
 	screen = surface;
-	if (pixelData != nullptr)
-		free(pixelData);
+	delete[] pixelData;
 	pixelData = new PixelData[screen->GetWidth() * screen->GetHeight()];
+	#ifdef ADAPTIVESAMPLING
+	delete[] adaptiveTiles;
+	const int tilesX = (screen->GetWidth() + TILESIZE - 1) / TILESIZE;
+	const int tilesY = (screen->GetHeight() + TILESIZE - 1) / TILESIZE;
+	adaptiveTiles = new AdaptiveTile[tilesX * tilesY];
+	#endif
 	CameraChanged();
 }
 
-void Game::Init(int argc, char **argv)
+void Game::Init( const Config &config )
 {
 	printf("Initializing Game\n");
 	default_material = new Material();
+	overlay = !config.headless;
+	SetFeatures( config.features );
+	std::cout << "Features: " << FeatureList( features ) << std::endl;
 
 	// load model
-	switch (argc)
+	if ( config.scene.empty() )
+		InitDefaultScene();
+	else
 	{
-		case 1: // No arguments
-			InitDefaultScene();
-			break;
-		case 2: // An obj file
-			InitFromTinyObj(std::string(argv[1]));
-			break;
-		default:
-			std::cout << argc << " arguments not accepted!" << std::endl;
-			exit(1);
-			break;
+		#ifdef USEBVH
+		nr_instances = config.copies;
+		#endif
+		InitFromTinyObj( config.scene );
+	}
+
+	if ( config.hasPosition )
+		view->position = config.position;
+	if ( config.hasDirection )
+		*view = Camera( view->position, config.direction );
+	if ( config.fov > 0 )
+	{
+		view->fov = config.fov;
+		view->UpdateTopLeft();
 	}
 
 	#ifdef USEBVH 
-	std::cout << "Creating BVH" << std::endl;
-	if ( nr_triangles > 0 )
+	// The BVH may already be loaded from the cache
+	if ( nr_triangles > 0 && bvh == nullptr )
 	{
+		std::cout << "Creating BVH" << std::endl;
 		bvh = new BVH();
 
 		timer::TimePoint t = timer::get();
 		bvh->ConstructBVH( triangles, nr_triangles );
-		std::cout << "Construction time: " << timer::elapsed(t) << " ms." << std::endl;
+		std::cout << "Construction time: " << timer::elapsed(t) << " ms (" << bvh->build_threads << " threads)." << std::endl;
+
+		#ifdef USEBVHCACHE
+		if ( !bvhCacheFile.empty() )
+			bvh->SaveCache( bvhCacheFile, meshHash );
+		#endif
 
 		if (bvh->nr_nodes < 100 && nr_triangles < 100)
 			bvh->Print();
 	}
+
+	if ( nr_triangles == 0 )
+		nr_instances = 0;
+	if ( nr_instances > 0 )
+	{
+		// Place the copies in a grid, with some space between them
+		const aabb b = bvh->root->Bounds();
+		const vec3 spacing = vec3( b.Extend( 0 ), 0, b.Extend( 2 ) ) * 1.2f;
+		const uint columns = (uint)ceilf( sqrtf( (float)nr_instances ) );
+		instances = new Instance[nr_instances];
+		for ( uint i = 0; i < nr_instances; i++ )
+		{
+			vec3 offset( spacing.x * (i % columns), 0, spacing.z * (i / columns) );
+			instances[i] = Instance( bvh, mat4::translate( offset ) );
+		}
+		std::cout << "Instances: " << nr_instances << " (" << (uint64)nr_instances * nr_triangles << " triangles)" << std::endl;
+	}
+	tlas = new TLAS( instances, nr_instances, spheres, nr_spheres, lights, nr_lights );
+	tlas->Build();
+	#endif
+
+	threadPool = new ThreadPool( config.threads );
+	std::cout << "Render threads: " << threadPool->Size() << std::endl;
+	Sampler::Init();
+	#ifdef RENDERWAVEFRONT
+	wavefront = new Wavefront( this );
 	#endif
 
 	GenerateGaussianKernel( 10.0f );
 	std::cout << "Done initializing" << std::endl;
 }
 
+void Game::KeyDown( int key, byte repeat )
+{
+	if ( key >= KEY_F1 && key <= KEY_F5 )
+	{
+		if ( !repeat )
+			SetFeatures( features ^ (1 << (key - KEY_F1)) );
+		return;
+	}
+	if ( view->KeyDown( key, repeat ) )
+		CameraChanged();
+}
+
+void Game::SetFeatures( uint features )
+{
+	// Without a kernel there is nothing to filter with
+	this->features = features & (KERNEL_SIZE > 0 ? ~0u : ~FEATURE_FILTER);
+	CameraChanged();
+}
+
 // -----------------------------------------------------------
 // Close down application
 // -----------------------------------------------------------
 void Game::Shutdown()
 {
 	printf("Shutting down Game\n");
+	#ifdef RENDERWAVEFRONT
+	delete wavefront;
+	wavefront = nullptr;
+	#endif
+	delete threadPool;
+	threadPool = nullptr;
+	#ifdef USEBVH
+	delete tlas;
+	delete[] instances;
+	delete bvh;
+	delete[] restTriangles;
+	tlas = nullptr;
+	instances = nullptr;
+	bvh = nullptr;
+	restTriangles = nullptr;
+	#endif
+	#ifdef ADAPTIVESAMPLING
+	delete[] adaptiveTiles;
+	adaptiveTiles = nullptr;
+	#endif
+	delete[] kernel;
+	delete[] pixelData;
+	delete view;
+	delete sky;
+	kernel = nullptr;
+	pixelData = nullptr;
+	view = nullptr;
+	sky = nullptr;
+
+	// The scene
+	for ( uint i = 0; i < nr_materials; i++ )
+		materials[i].FreeTexture();
+	delete[] materials;
+	delete default_material;
+	for ( uint i = 0; i < nr_lights; i++ )
+		delete lights[i];
+	delete[] lights;
+	delete[] spheres;
+	delete[] triangles;
+	materials = default_material = nullptr;
+	lights = nullptr;
+	spheres = nullptr;
+	triangles = nullptr;
+	nr_materials = nr_lights = nr_spheres = nr_triangles = 0;
 }
 
-bool Game::CheckOcclusion( Ray *r )
+#ifdef USEBVH
+// Sways a point of the mesh, more the higher it is, like a plant in the wind
+static vec3 Sway( const vec3 &p, const aabb &bounds, float time )
 {
-	// If any intersection found, return, don't need to know location
-	// Check Spheres
-	for ( uint i = 0; i < nr_spheres; i++ )
-	{
-		if (spheres[i].Occludes( r ))
-			return true;
-	}
-	// Check triangles
-	bvh->Occludes(r);
-	// Check lights
-	for ( size_t i = 0; i < nr_lights; i++ )
+	const float height = (p.y - bounds.bmin[1]) / std::max( bounds.Extend( 1 ), 1e-6f );
+	const float amplitude = ANIMATIONAMPLITUDE * std::max( bounds.Extend( 0 ), bounds.Extend( 2 ) ) * height * height;
+	return p + vec3( sinf( time ), 0, cosf( 0.7f * time ) ) * amplitude;
+}
+
+void Game::MoveMesh( float time )
+{
+	if ( restTriangles == nullptr )
 	{
-		if ( lights[i]->Occludes( r ) )
-			return true;
+		restTriangles = new Triangle[nr_triangles];
+		std::copy( triangles, triangles + nr_triangles, restTriangles );
+		restBounds.Reset();
+		for ( uint i = 0; i < nr_triangles; i++ )
+		{
+			restBounds.Grow( triangles[i].p0 );
+			restBounds.Grow( triangles[i].p1 );
+			restBounds.Grow( triangles[i].p2 );
+		}
 	}
-	return false;
+
+	const uint chunk = 4096;
+	threadPool->ParallelFor( (nr_triangles + chunk - 1) / chunk, [&]( uint task ) {
+		for ( uint i = task * chunk; i < std::min( nr_triangles, (task + 1) * chunk ); i++ )
+		{
+			const Triangle &rest = restTriangles[i];
+			Triangle &tri = triangles[i];
+			tri.p0 = Sway( rest.p0, restBounds, time );
+			tri.p1 = Sway( rest.p1, restBounds, time );
+			tri.p2 = Sway( rest.p2, restBounds, time );
+			tri.normal = Triangle::ComputeNormal( tri.p0, tri.p1, tri.p2 );
+		}
+	} );
 }
 
-bool Game::Intersect( Ray* r, uint &depth )
+void Game::RefitScene()
 {
-	bool found = false; 
-	
-	for (uint i = 0; i < nr_spheres; i++)
-		found |= spheres[i].Intersect(r);
+	bvh->Refit();
+	// The instances share the BVH, their bounds follow its new root
+	for ( uint i = 0; i < nr_instances; i++ )
+		instances[i].SetTransform( instances[i].transform );
+	tlas->Build();
+	CameraChanged();
+}
+#endif
 
+bool Game::CheckOcclusion( Ray *r )
+{
+	rays_traced++;
+	TRAVERSAL_STATS( TraversalStats &stats = TraversalStats::Local() );
+	TRAVERSAL_STATS( stats.rays[RAY_SHADOW]++ );
+	// If any intersection found, return, don't need to know location
+	#ifdef USEBVH
+		// Spheres, triangles and lights are all in the TLAS
+		return tlas->Occludes( r );
+	#else
+		// Check Spheres
+		for ( uint i = 0; i < nr_spheres; i++ )
+		{
+			if (spheres[i].Occludes( r ))
+			{
+				TRAVERSAL_STATS( stats.earlyOuts++ );
+				return true;
+			}
+		}
+		// Check triangles
+		for ( uint i = 0; i < nr_triangles; i++ )
+		{
+			TRAVERSAL_STATS( stats.triangleTests++ );
+			if ( triangles[i].Occludes( r ) )
+			{
+				TRAVERSAL_STATS( stats.earlyOuts++ );
+				return true;
+			}
+		}
+		// Check lights
+		for ( size_t i = 0; i < nr_lights; i++ )
+		{
+			if ( lights[i]->Occludes( r ) )
+			{
+				TRAVERSAL_STATS( stats.earlyOuts++ );
+				return true;
+			}
+		}
+		return false;
+	#endif
+}
+
+bool Game::Intersect( Ray* r, uint &depth )
+{
+	rays_traced++;
 	#ifdef USEBVH 
-		found |= bvh->Intersect(r, depth);
+		const bool found = tlas->Intersect( r, depth );
+		TRAVERSAL_STATS( TraversalStats::Local().lightHits += found && r->light != nullptr );
+		return found && r->light == nullptr;
 	#else
+		TRAVERSAL_STATS( TraversalStats &stats = TraversalStats::Local() );
+		TRAVERSAL_STATS( stats.triangleTests += nr_triangles );
+		IntersectLights( r );
+
+		bool found = false; 
+		for (uint i = 0; i < nr_spheres; i++)
+			found |= spheres[i].Intersect(r);
 		for (uint i = 0; i < nr_triangles; i++)
 			found |= triangles[i].Intersect(r);
+		TRAVERSAL_STATS( stats.lightHits += !found && r->light != nullptr );
+		return found;
 	#endif
-
-	return found;
 }
 
 Light* Game::IntersectLights( Ray* r )
@@ -252,10 +520,16 @@ Light* Game::IntersectLights( Ray* r )
 			found = lights[i];
 	}
 
+	if ( found != nullptr )
+	{
+		r->obj = nullptr;
+		r->light = found;
+	}
 	return found;
 }
 
-Color Game::Sample(Ray r, uint pixelId)
+template <uint F>
+Color Game::Sample(Ray r, uint pixelId, Sampler &sampler, bool traced, DeferredShadowRay *shadow)
 {
 	bool specularRay = true;
 	uint depth = 0;
@@ -263,17 +537,14 @@ Color Game::Sample(Ray r, uint pixelId)
 	Color E(0.0f, 0.0f, 0.0f);
 	float pdf_brdf, pdf_angle;
 
-	#ifdef USERUSSIANROULETTE
-	for (; true; depth++)
-	#else
-	for (; depth < MAX_NR_ITERATIONS; depth++)
-	#endif
+	for (; (F & FEATURE_RUSSIANROULETTE) || depth < MAX_NR_ITERATIONS; depth++)
 	{
 
-	Light* light = IntersectLights( &r );
-
 	uint bvhDepth = 0;
-	bool found = Intersect( &r, bvhDepth );
+	// The primary rays of a packet were counted by SampleTile
+	TRAVERSAL_STATS( TraversalStats::Local().rays[depth == 0 ? RAY_PRIMARY : RAY_BOUNCE] += !(depth == 0 && traced) );
+	bool found = depth == 0 && traced ? r.obj != nullptr : Intersect( &r, bvhDepth );
+	Light* light = r.light;
 
 	#ifdef VISUALIZEBVH
 		return Color( 0, std::min( 0.02f * bvhDepth, 1.0f ), 0 );
@@ -289,23 +560,17 @@ Color Game::Sample(Ray r, uint pixelId)
 		{
 			interPoint = r.origin + r.t * r.direction;
 			interNormal = light->NormalAt( interPoint );
-			#ifdef USENEE
-				if (specularRay)
-					nohitcolor = light->color;
-				else
-				{
-					#ifdef USEMIS
-					float solidAngle = (pdf_angle * light->Area()) / (r.t * r.t);
-					float pdf_light = 1 / solidAngle;
-					float pdf_mis = pdf_brdf + pdf_light;
-					nohitcolor = light->color * (1.0f / pdf_mis);
-					#else
-					nohitcolor = Color(0, 0, 0);
-					#endif
-				}
-			#else
+			if (!(F & FEATURE_NEE) || specularRay)
 				nohitcolor = light->color;
-			#endif
+			else if (F & FEATURE_MIS)
+			{
+				float solidAngle = (pdf_angle * light->Area()) / (r.t * r.t);
+				float pdf_light = 1 / solidAngle;
+				float pdf_mis = pdf_brdf + pdf_light;
+				nohitcolor = light->color * (1.0f / pdf_mis);
+			}
+			else
+				nohitcolor = Color(0, 0, 0);
 		}
 		else if (sky != nullptr)
 		{
@@ -338,9 +603,13 @@ Color Game::Sample(Ray r, uint pixelId)
 
 	// intersection point found
 	vec3 interPoint = r.origin + r.t * r.direction;
-	vec3 interNormal = r.obj->NormalAt( interPoint );
+	// Instanced meshes are shaded in object space
+	vec3 objectPoint = r.instance != nullptr ? r.instance->ToObject( interPoint ) : interPoint;
+	vec3 interNormal = r.obj->NormalAt( objectPoint );
+	if ( r.instance != nullptr )
+		interNormal = r.instance->NormalToWorld( interNormal );
 
-	Color albedo = r.obj->ColorAt( materials, interPoint );
+	Color albedo = r.obj->ColorAt( materials, objectPoint );
 	Color BRDF = albedo * INVPI;
 	float angle = -dot( r.direction, interNormal );
 	bool backfacing = angle < 0.0f;
@@ -371,9 +640,9 @@ Color Game::Sample(Ray r, uint pixelId)
 	bool refract = false;
 
 	if (mat->HasRefraction())
-		refract = RandomFloat() < mat->GetRefraction();
+		refract = sampler.Get1D( depth, SAMPLE_SPECULAR ) < mat->GetRefraction();
 	else if (mat->HasReflection())
-		reflect = RandomFloat() < mat->GetReflection();
+		reflect = sampler.Get1D( depth, SAMPLE_SPECULAR ) < mat->GetReflection();
 
 	if (refract) {
 		float n = mat->GetIoR();
@@ -406,7 +675,7 @@ Color Game::Sample(Ray r, uint pixelId)
 	}
 
 	// Random bounce
-	r = Ray( interPoint, CosineWeightedDiffuseReflection( interNormal ) );
+	r = Ray( interPoint, CosineWeightedDiffuseReflection( interNormal, sampler.Get2D( depth, SAMPLE_BRDF ) ) );
 	r.Offset(1e-3);
 
 	// irradiance
@@ -414,10 +683,11 @@ Color Game::Sample(Ray r, uint pixelId)
 	pdf_brdf = pdf_angle * INVPI;
 	float pdf_mis = pdf_brdf;
 
-	#ifdef USENEE
+	if (F & FEATURE_NEE)
+	{
 	// Direct light for NEE
-	Light *rLight = lights[RandomIndex( nr_lights )];
-	vec3 rLightPoint = rLight->PointOnLight();
+	Light *rLight = lights[sampler.GetIndex( depth, SAMPLE_LIGHT, nr_lights )];
+	vec3 rLightPoint = rLight->PointOnLight( sampler.Get2D( depth, SAMPLE_LIGHTPOINT ) );
 	vec3 rLightNormal = rLight->NormalAt(rLightPoint);
 	vec3 rLightDir = rLightPoint - interPoint;
 	float rLightDist = rLightDir.length();
@@ -428,29 +698,39 @@ Color Game::Sample(Ray r, uint pixelId)
 	if (cos_i > 0 && cos_o > 0)
 	{
 		Ray rLightRay = Ray( interPoint, rLightDir );
-		rLightRay.t = rLightDist;
-		if (!CheckOcclusion(&rLightRay))
+		// Stop short of the light, or it can occlude its own shadow ray by the rounding of the intersection
+		rLightRay.t = rLightDist * (1 - 1e-4f);
+		float rLightArea = rLight->Area();
+		float solidAngle = (cos_o * rLightArea) / (rLightDist * rLightDist);
+		float pdf_light = 1 / solidAngle;
+		if (depth == 0 && shadow != nullptr)
+		{
+			shadow->ray = rLightRay;
+			shadow->light = rLight;
+			shadow->contribution = T * (cos_i / pdf_light) * BRDF * rLight->color;
+			shadow->valid = true;
+		}
+		else if (!CheckOcclusion(&rLightRay))
 		{
-			float rLightArea = rLight->Area();
-			float solidAngle = (cos_o * rLightArea) / (rLightDist * rLightDist);
-			float pdf_light = 1 / solidAngle;
-			#ifdef USEMIS
-			pdf_mis += pdf_light;
-			pdf_light = pdf_mis;
-			#endif
+			if (F & FEATURE_MIS)
+			{
+				pdf_mis += pdf_light;
+				pdf_light = pdf_mis;
+			}
 			E += T * (cos_i / pdf_light) * BRDF * rLight->color;
 		}
 	}
-	#endif
+	}
 
-	#ifdef USERUSSIANROULETTE
+	if (F & FEATURE_RUSSIANROULETTE)
+	{
 	// Russian Roulette
 	float survival = albedo.Max();
 	clamp( survival, 0.1f, 1.0f );
-	if (RandomFloat() > survival)
+	if (sampler.Get1D( depth, SAMPLE_ROULETTE ) > survival)
 		break;
 	T *= (1 / survival);
-	#endif
+	}
 
 	T *= pdf_angle / pdf_mis * BRDF;
 	}
@@ -460,8 +740,7 @@ Color Game::Sample(Ray r, uint pixelId)
 void Game::GenerateGaussianKernel( float sigma )
 {
 	std::cout << "Generating 1D kernel with size " << KERNEL_SIZE << "..." << std::endl;
-	if (kernel != nullptr)
-		free(kernel);
+	delete[] kernel;
 	kernel = new float[KERNEL_CENTER + 1];
 	//float sigma = 10.0;
 	float r, s = 2.0 * sigma * sigma;
@@ -523,8 +802,8 @@ float ComputeWeight_Total(PixelData &centerPixel, PixelData &otherPixel, bool fi
 
 	return weight;
 }
-#if KERNEL_SIZE > 0
-void Game::Filter( int pixelX, int pixelY, bool firstPass )
+template <bool firstPass>
+void Game::Filter( int pixelX, int pixelY )
 {
 	PixelData &centerPixel = pixelData[pixelX + pixelY * screen->GetWidth()];
 
@@ -568,8 +847,10 @@ void Game::Filter( int pixelX, int pixelY, bool firstPass )
 		y += (int)!firstPass;
 	}
 }
-#endif
+
 void Game::Print(size_t buflen, uint yline, const char *fmt, ...) {
+	if ( !overlay )
+		return;
 	char buf[128];
 	va_list va;
     va_start(va, fmt);
@@ -578,16 +859,78 @@ void Game::Print(size_t buflen, uint yline, const char *fmt, ...) {
 	screen->Print(buf, 2, 2 + yline * 7, 0xffff00);
 }
 
-Ray ComputePrimaryRay(Surface* screen, Camera* view, int x, int y, float offset, float pixel_size)
+void Game::SetCamera( const vec3 &position, const vec3 &direction, float fov )
+{
+	*view = Camera( position, direction );
+	view->fov = fov;
+	view->UpdateTopLeft();
+	CameraChanged();
+}
+
+void Game::ReadImage( float *rgb ) const
+{
+	const int pixels = screen->GetWidth() * screen->GetHeight();
+	for ( int id = 0; id < pixels; id++ )
+	{
+		const Color c = pixelData[id].illumination * pixelData[id].albedo;
+		rgb[id * 3] = c.r, rgb[id * 3 + 1] = c.g, rgb[id * 3 + 2] = c.b;
+	}
+}
+
+bool Game::SaveImage( const std::string &filename )
+{
+	const int width = screen->GetWidth(), height = screen->GetHeight();
+	FREE_IMAGE_FORMAT fif = FreeImage_GetFIFFromFilename( filename.c_str() );
+	if ( fif == FIF_UNKNOWN )
+	{
+		std::cerr << "Unknown image format: " << filename << std::endl;
+		return false;
+	}
+
+	FIBITMAP *dib;
+	if ( fif == FIF_EXR || fif == FIF_HDR )
+	{
+		// The linear radiance, the rows of FreeImage go up
+		std::vector<float> rgb( (size_t)width * height * 3 );
+		ReadImage( rgb.data() );
+		dib = FreeImage_AllocateT( FIT_RGBF, width, height );
+		for ( int y = 0; y < height; y++ )
+			memcpy( FreeImage_GetScanLine( dib, height - 1 - y ), rgb.data() + y * width * 3, width * sizeof( FIRGBF ) );
+	}
+	else
+	{
+		// The screen without its unused alpha channel, which would make the image transparent
+		FIBITMAP *screenDib = FreeImage_ConvertFromRawBits( (BYTE *)screen->GetBuffer(), width, height, screen->GetPitch() * sizeof( Pixel ),
+			32, REDMASK, GREENMASK, BLUEMASK, TRUE );
+		dib = FreeImage_ConvertTo24Bits( screenDib );
+		FreeImage_Unload( screenDib );
+	}
+
+	const bool saved = FreeImage_Save( fif, dib, filename.c_str() );
+	FreeImage_Unload( dib );
+	if ( !saved )
+		std::cerr << "Could not write " << filename << std::endl;
+	return saved;
+}
+
+template <uint F>
+Ray Game::ComputePrimaryRay(int x, int y, float offset, float pixel_size, Sampler &sampler)
 {
 	float u = x, v = y;
 	u += offset;
 	y += offset;
 
-#if defined(SSAA) || defined(USESTRATIFICATION)
-	u += Rand(pixel_size);
-	v += Rand(pixel_size);
+#ifdef USESTRATIFICATION
+	const bool jittered = true;
+#else
+	const bool jittered = F & FEATURE_SSAA;
 #endif
+	if (jittered)
+	{
+		vec2 jitter = sampler.Get2D( 0, SAMPLE_PIXEL );
+		u += jitter.x * pixel_size;
+		v += jitter.y * pixel_size;
+	}
 
 	u /= screen->GetWidth();
 	v /= screen->GetHeight();
@@ -596,140 +939,365 @@ Ray ComputePrimaryRay(Surface* screen, Camera* view, int x, int y, float offset,
 	return Ray( view->position, dir );
 }
 
+#ifdef USEBVH
+template <uint F>
+uint Game::SampleTile( int x0, int y0 )
+{
+	Ray rays[MAXPACKETRAYS];
+	uint ids[MAXPACKETRAYS];
+	Sampler samplers[MAXPACKETRAYS];
+	uint n = 0;
+	for ( int y = y0; y < std::min( y0 + PACKETSIZE, screen->GetHeight() ); y++ )
+		for ( int x = x0; x < std::min( x0 + PACKETSIZE, screen->GetWidth() ); x++ )
+		{
+			ids[n] = x + y * screen->GetWidth();
+			if ( !NeedsSample( ids[n] ) )
+				continue;
+			samplers[n] = Sampler( samplerType, x, y, pixelData[ids[n]].samples, samplerSeed );
+			rays[n] = ComputePrimaryRay<F>( x, y, 0.0f, 1.0f, samplers[n] );
+			n++;
+		}
+	if ( n == 0 )
+		return 0;
+	tlas->IntersectPacket( rays, n );
+	rays_traced += n;
+	TRAVERSAL_STATS( TraversalStats::Local().rays[RAY_PRIMARY] += n );
+
+	Color colors[MAXPACKETRAYS];
+	DeferredShadowRay shadows[MAXPACKETRAYS];
+	for ( uint i = 0; i < n; i++ )
+	{
+		shadows[i].valid = false;
+		// With MIS the rest of the path depends on whether the light is visible, so its shadow ray cannot wait
+		colors[i] = Sample<F>( rays[i], ids[i], samplers[i], true, (F & FEATURE_MIS) ? nullptr : &shadows[i] );
+	}
+
+	// Shadow rays towards the same light are coherent as well, so trace them as one packet per light
+	Ray shadowRays[MAXPACKETRAYS];
+	uint pixels[MAXPACKETRAYS];
+	bool occluded[MAXPACKETRAYS];
+	for ( uint i = 0; i < n; i++ )
+	{
+		if ( !shadows[i].valid )
+			continue;
+		Light *light = shadows[i].light;
+		uint m = 0;
+		for ( uint j = i; j < n; j++ )
+		{
+			if ( shadows[j].valid && shadows[j].light == light )
+			{
+				shadowRays[m] = shadows[j].ray;
+				pixels[m++] = j;
+				shadows[j].valid = false;
+			}
+		}
+		tlas->OccludesPacket( shadowRays, m, occluded );
+		rays_traced += m;
+		TRAVERSAL_STATS( TraversalStats::Local().rays[RAY_SHADOW] += m );
+		for ( uint j = 0; j < m; j++ )
+		{
+			if ( !occluded[j] )
+				colors[pixels[j]] += shadows[pixels[j]].contribution;
+		}
+	}
+
+	for ( uint i = 0; i < n; i++ )
+		AddSample( ids[i], colors[i] );
+	return n;
+}
+#endif
+
 // -----------------------------------------------------------
 // Main application tick function
 // -----------------------------------------------------------
-void Game::Tick()
+void Game::AddSample( uint id, const Color &color )
 {
-	timer::TimePoint dt = timer::get();
+	PixelData &pixel = pixelData[id];
+	pixel.accumulated += color;
+	// The variance is of what is displayed, including the albedo of the first hit. The mean of the channels
+	// weighs them like the error of the image does, the luminance would hide the noise of red and blue pixels.
+	const Color displayed = color * pixel.albedo;
+	const float brightness = (displayed.r + displayed.g + displayed.b) * (1.0f / 3);
+	pixel.accumulatedSq += brightness * brightness;
+	pixel.samples++;
+	pixel.illumination = pixel.accumulated * (1.0f / pixel.samples);
+}
 
-	#ifdef USEVIGNETTING
-		int dist_x_max = screen->GetWidth() / 2;
-		int dist_y_max = screen->GetHeight() / 2;
-		float dist_total_max = 1 / sqrtf(dist_x_max * dist_x_max + dist_y_max * dist_y_max);
+bool Game::NeedsSample( uint id ) const
+{
+	#ifdef ADAPTIVESAMPLING
+	return pixelData[id].samples < ADAPTIVEMINSAMPLES || PixelError( id ) > ADAPTIVETHRESHOLD;
+	#else
+	(void)id;
+	return true;
 	#endif
-	
-	unmoved_frames++;
-	// uncomment to limit amount of max frames rendered 
-	//if (unmoved_frames > 1) return;
+}
+
+#ifdef ADAPTIVESAMPLING
+float Game::PixelError( uint id ) const
+{
+	const PixelData &pixel = pixelData[id];
+	if ( pixel.samples < 2 )
+		return INFINITY;
+	// One virtual white sample, so a dark pixel that has not seen a rare light path yet is not converged
+	const float n = (float)pixel.samples + 1;
+	const Color displayed = pixel.accumulated * pixel.albedo;
+	const float mean = ((displayed.r + displayed.g + displayed.b) * (1.0f / 3) + 1) / n;
+	const float variance = std::max( 0.0f, (pixel.accumulatedSq + 1) / n - mean * mean ) * n / (n - 1);
+	// The error after gamma correction, which takes the square root
+	return sqrtf( variance / n ) / (2 * sqrtf( std::max( mean, 0.01f ) ));
+}
+
+void Game::PlanAdaptiveSampling( uint nr_tiles )
+{
+	float total = 0;
+	for ( uint tile = 0; tile < nr_tiles; tile++ )
+		total += adaptiveTiles[tile].error;
+	const float budget = ADAPTIVEBUDGET * screen->GetWidth() * screen->GetHeight();
+	for ( uint tile = 0; tile < nr_tiles; tile++ )
+	{
+		AdaptiveTile &t = adaptiveTiles[tile];
+		t.extra = 0;
+		if ( total > 0 && t.active > 0 )
+			t.extra = std::min( (uint)(budget * (t.error / total) / t.active + 0.5f), (uint)ADAPTIVEMAXEXTRA );
+	}
+}
+#endif
 
-	#pragma omp parallel for schedule( dynamic ) num_threads(8)
-	for (int y = 0; y < screen->GetHeight(); y++)
-	for (int x = 0; x < screen->GetWidth(); x++)
+template <uint F>
+void Game::RenderTile( uint tile )
+{
+	PROFILE_ZONE( "Tile" );
+	const int tilesX = (screen->GetWidth() + TILESIZE - 1) / TILESIZE;
+	const int x0 = (tile % tilesX) * TILESIZE, y0 = (tile / tilesX) * TILESIZE;
+	const int x1 = std::min( x0 + TILESIZE, screen->GetWidth() );
+	const int y1 = std::min( y0 + TILESIZE, screen->GetHeight() );
+
+	// With adaptive sampling the tiles with the most noise get extra passes
+	#ifdef ADAPTIVESAMPLING
+	const uint passes = 1 + adaptiveTiles[tile].extra;
+	#else
+	const uint passes = 1;
+	#endif
+	uint samples = 0;
+	const uint64 rays_before = rays_traced;
+
+	#if PACKETSIZE > 0 && defined( USEBVH ) && !defined( VISUALIZEBVH )
+	// Without SSAA, the primary rays of a tile are traced as packets
+	if (!(F & FEATURE_SSAA))
+	{
+	for (uint pass = 0; pass < passes; pass++)
+	for (int y = y0; y < y1; y += PACKETSIZE)
+	for (int x = x0; x < x1; x += PACKETSIZE)
+		samples += SampleTile<F>( x, y );
+	}
+	else
+	#endif
+	{
+	for (uint pass = 0; pass < passes; pass++)
+	for (int y = y0; y < y1; y++)
+	for (int x = x0; x < x1; x++)
 	{
 		uint id = x + y * screen->GetWidth();
+		if ( !NeedsSample( id ) )
+			continue;
+		const uint index = pixelData[id].samples;
 
-		#ifdef SSAA
+		Color color(0, 0, 0);
+		if (F & FEATURE_SSAA)
+		{
 			// 4 rays with random offsett, then compute average
-			Color color(0, 0, 0);
 			for ( size_t i = 0; i < 4; i++ )
 			{
-				Ray r = ComputePrimaryRay(screen, view, x, y, i * 0.25f, 0.25f);
-				Color rayColor = Sample( r, id );
+				Sampler sampler( samplerType, x, y, index * 4 + i, samplerSeed );
+				Ray r = ComputePrimaryRay<F>(x, y, i * 0.25f, 0.25f, sampler);
+				Color rayColor = Sample<F>( r, id, sampler );
 				color += rayColor;
 			}
 			color *= 0.25;
-		#else
-			Ray r = ComputePrimaryRay(screen, view, x, y, 0.0f, 1.0f);
-			Color color = Sample( r, id );
-		#endif
+		}
+		else
+		{
+			Sampler sampler( samplerType, x, y, index, samplerSeed );
+			Ray r = ComputePrimaryRay<F>(x, y, 0.0f, 1.0f, sampler);
+			color = Sample<F>( r, id, sampler );
+		}
 
-		pixelData[id].accumulated += color;
-		pixelData[id].illumination = pixelData[id].accumulated * (1.0f / unmoved_frames);
+		AddSample( id, color );
+		samples++;
+	}
 	}
 
-	// Apply filter technique
-#if KERNEL_SIZE > 0
-	#pragma omp parallel for schedule( dynamic ) num_threads(8)
-	for (int y = 0; y < screen->GetHeight(); y++)
-	{
-		for (int x = 0; x < screen->GetWidth(); x++)
-		{
-			uint id = x + y * screen->GetWidth();
-			pixelData[id].totalWeight = 0.0f;
-			pixelData[id].filtered = Color(0, 0, 0);
+	nr_rays += rays_traced - rays_before;
 
-#ifdef SIGMA_FIREFLY
-			// If the illumination is a firefly, then let's scale it, so we still have a color to work with.
-			if (pixelData[id].illumination.ToVec().sqrLength() > SIGMA_FIREFLY * SIGMA_FIREFLY * 3.0f)
-				pixelData[id].illumination *= (1 / SIGMA_FIREFLY);
-#endif
-		}
-		for (int x = 0; x < screen->GetWidth(); x++)
+	#ifdef ADAPTIVESAMPLING
+	AdaptiveTile &t = adaptiveTiles[tile];
+	t.error = 0;
+	t.active = 0;
+	t.samples = samples;
+	for (int y = y0; y < y1; y++)
+	for (int x = x0; x < x1; x++)
+	{
+		uint id = x + y * screen->GetWidth();
+		// The filter overwrites the illumination, a pixel without new samples would be filtered again
+		if (F & FEATURE_FILTER)
+			pixelData[id].illumination = pixelData[id].accumulated * (1.0f / pixelData[id].samples);
+		if ( NeedsSample( id ) )
 		{
-			Filter( x, y, true );
-
-			// Since we are going towards the right only we know that pixel[x,y] will never be touched.
-			// Hence we can safely compute and reset the data for the vertical filtering.
-			uint id = x + y * screen->GetWidth();
-			pixelData[id].filtered *= (1 / pixelData[id].totalWeight);
-			pixelData[id].totalWeight = 0.0f;
-			pixelData[id].illumination = Color(0, 0, 0);
+			// Another sample reduces the squared error the most, so that is what the extra samples follow
+			const float error = std::min( PixelError( id ), 1.0f );
+			t.error += error * error;
+			t.active++;
 		}
 	}
-	#pragma omp parallel for schedule( dynamic ) num_threads(8)
-	for (int x = 0; x < screen->GetWidth(); x++)
-	for (int y = 0; y < screen->GetHeight(); y++)
+	#endif
+
+	// Without the filter, the pixels of the tile are final
+	if (!(F & FEATURE_FILTER))
 	{
-		Filter( x, y, false );
-		// To only horizontal blur, comment the line above and uncomment below
-		// uint id = x + y * screen->GetWidth();
-		// pixelData[id].illumination = pixelData[id].filtered;
-		// pixelData[id].totalWeight = 1.0f;
+	for (int y = y0; y < y1; y++)
+	for (int x = x0; x < x1; x++)
+		ToneMap<F>( x, y );
 	}
-#endif
+}
 
-	#pragma omp parallel for schedule( dynamic ) num_threads(8)
-	for (int y = 0; y < screen->GetHeight(); y++)
-	for (int x = 0; x < screen->GetWidth(); x++)
-	{
-		uint id = x + y * screen->GetWidth();
+template <uint F>
+void Game::ToneMap( int x, int y )
+{
+	uint id = x + y * screen->GetWidth();
 
-#if KERNEL_SIZE > 0
+	if (F & FEATURE_FILTER)
 		pixelData[id].illumination *= (1 / pixelData[id].totalWeight);
-#endif
 
-		Color result = pixelData[id].illumination * pixelData[id].albedo;
+	Color result = pixelData[id].illumination * pixelData[id].albedo;
 
-		result.GammaCorrect();
-		//color.ChromaticAbberation( { u, v } );
+	result.GammaCorrect();
+	//color.ChromaticAbberation( { u, v } );
 
-		#ifdef USEVIGNETTING
-			result.Vignetting( ( x - screen->GetWidth() / 2 ), ( y - screen->GetHeight() / 2 ), dist_total_max );
-		#endif
+	#ifdef USEVIGNETTING
+		int dist_x_max = screen->GetWidth() / 2;
+		int dist_y_max = screen->GetHeight() / 2;
+		float dist_total_max = 1 / sqrtf(dist_x_max * dist_x_max + dist_y_max * dist_y_max);
+		result.Vignetting( ( x - screen->GetWidth() / 2 ), ( y - screen->GetHeight() / 2 ), dist_total_max );
+	#endif
+
+	screen->GetBuffer()[id] = result.ToPixel();
+}
+
+// Every variant of RenderTile, indexed by the mask of features
+template <size_t... F>
+static std::array<void (Game::*)( uint ), sizeof...( F )> RenderTileVariants( std::index_sequence<F...> )
+{
+	return {{&Game::RenderTile<CanonicalFeatures( F )>...}};
+}
+static const auto renderTileVariants = RenderTileVariants( std::make_index_sequence<FEATURE_VARIANTS>() );
+
+// The wavefront renderer only uses the primary rays
+template Ray Game::ComputePrimaryRay<0>( int x, int y, float offset, float pixel_size, Sampler &sampler );
+
+// -----------------------------------------------------------
+// Main application tick function
+// -----------------------------------------------------------
+void Game::Tick()
+{
+	timer::TimePoint dt = timer::get();
+	#ifdef PROFILER
+	Profiler::NextFrame();
+	#endif
+	PROFILE_ZONE( "Frame" );
+	#ifdef TRAVERSALSTATS
+	const TraversalStats statsBefore = TraversalStats::Total();
+	#endif
 
-		screen->GetBuffer()[id] = result.ToPixel();
+	#if defined( USEBVH ) && defined( ANIMATEMESH )
+	if ( nr_triangles > 0 )
+	{
+		PROFILE_ZONE( "Animation" );
+		MoveMesh( animationFrame++ * ANIMATIONSTEP );
+		RefitScene();
 	}
+	#endif
 
-	#ifdef OPENCV2
-	cv::Mat inputImage = cv::Mat( screen->GetWidth(), screen->GetHeight(), CV_32FC3 );
-	//#pragma omp parallel for schedule( dynamic ) num_threads(8)
-	for ( int y = 0; y < screen->GetHeight(); y++ )
-		for ( int x = 0; x < screen->GetWidth(); x++ )
-		{
-			cv::Vec3f &color = inputImage.at<cv::Vec3f>( y, x );
-			uint id = x + y * screen->GetWidth();
-			Color fullColor = pixelData[id].illumination * pixelData[id].albedo;
-			color[0] = fullColor.r;
-			color[1] = fullColor.g;
-			color[2] = fullColor.b;
-		}
-	cv::Mat outputImage = cv::Mat( screen->GetWidth(), screen->GetHeight(), CV_32FC3 );
-	cv::bilateralFilter( inputImage, outputImage, 65, 25, 1 );
+	unmoved_frames++;
+	// uncomment to limit amount of max frames rendered 
+	//if (unmoved_frames > 1) return;
 
-	for ( int y = 0; y < screen->GetHeight(); y++ )
-		for ( int x = 0; x < screen->GetWidth(); x++ )
+	nr_rays = 0;
+	const int tilesX = (screen->GetWidth() + TILESIZE - 1) / TILESIZE;
+	const int tilesY = (screen->GetHeight() + TILESIZE - 1) / TILESIZE;
+	#ifdef RENDERWAVEFRONT
+	// The wavefront renderer does not do SSAA
+	if (!(features & FEATURE_SSAA))
+	{
+		wavefront->Render();
+		nr_rays = wavefront->nr_rays + wavefront->nr_shadow_rays;
+		if (!(features & FEATURE_FILTER))
 		{
-			cv::Vec3f color = outputImage.at<cv::Vec3f>( y, x );
-			Color result;
-			result.r = color[0];
-			result.g = color[1];
-			result.b = color[2];
-			screen->GetBuffer()[x + y * screen->GetWidth()] = result.ToPixel();
+			PROFILE_ZONE( "Tone map" );
+			threadPool->ParallelFor( screen->GetHeight(), [&]( uint y ) {
+				for (int x = 0; x < screen->GetWidth(); x++)
+					ToneMap<0>( x, y );
+			} );
 		}
+	}
+	else
+	#endif
+	{
+		// Sampling, accumulation and, without the filter, tone mapping, per tile
+		PROFILE_ZONE( "Path tracing" );
+		#ifdef ADAPTIVESAMPLING
+		PlanAdaptiveSampling( tilesX * tilesY );
+		#endif
+		void (Game::*renderTile)( uint ) = renderTileVariants[features];
+		threadPool->ParallelFor( tilesX * tilesY, [&]( uint tile ) {
+			(this->*renderTile)( tile );
+		} );
+	}
+
+	// Apply filter technique
+	if (features & FEATURE_FILTER)
+	{
+		PROFILE_ZONE( "Filter" );
+		FilterFrame();
+	}
+
+	#ifdef OPENCV2
+	{
+		PROFILE_ZONE( "OpenCV filter" );
+		cv::Mat inputImage = cv::Mat( screen->GetWidth(), screen->GetHeight(), CV_32FC3 );
+		//#pragma omp parallel for schedule( dynamic ) num_threads(8)
+		for ( int y = 0; y < screen->GetHeight(); y++ )
+			for ( int x = 0; x < screen->GetWidth(); x++ )
+			{
+				cv::Vec3f &color = inputImage.at<cv::Vec3f>( y, x );
+				uint id = x + y * screen->GetWidth();
+				Color fullColor = pixelData[id].illumination * pixelData[id].albedo;
+				color[0] = fullColor.r;
+				color[1] = fullColor.g;
+				color[2] = fullColor.b;
+			}
+		cv::Mat outputImage = cv::Mat( screen->GetWidth(), screen->GetHeight(), CV_32FC3 );
+		cv::bilateralFilter( inputImage, outputImage, 65, 25, 1 );
+
+		for ( int y = 0; y < screen->GetHeight(); y++ )
+			for ( int x = 0; x < screen->GetWidth(); x++ )
+			{
+				cv::Vec3f color = outputImage.at<cv::Vec3f>( y, x );
+				Color result;
+				result.r = color[0];
+				result.g = color[1];
+				result.b = color[2];
+				screen->GetBuffer()[x + y * screen->GetWidth()] = result.ToPixel();
+			}
+	}
+	#endif
+
+	#ifdef TRAVERSALSTATS
+	traversalStats = TraversalStats::Total() - statsBefore;
 	#endif
 
 	// Write debug output
+	PROFILE_ZONE( "Overlay" );
 	Print(32, 0, "Pos: %f %f %f", view->position.x, view->position.y, view->position.z);
 	
 	Print(32, 1, "Dir: %f %f %f", view->direction.x, view->direction.y, view->direction.z);
@@ -745,15 +1313,175 @@ void Game::Tick()
 		frames_fps = 1000.0f / elapsed;
 		frames_time = 0;
 		std::cout << "FPS: " << frames_fps << std::endl;
+		#ifdef RENDERWAVEFRONT
+		const float secondary = std::max( 1.0f, (float)wavefront->nr_secondary_rays );
+		std::cout << "Secondary rays: " << wavefront->nr_node_visits / secondary << " node visits per ray, "
+			<< 100 * wavefront->nr_hit_switches / secondary << "% hit switches ("
+			<< 100 * wavefront->nr_hit_switches_unsorted / secondary << "% unsorted)" << std::endl;
+		#endif
+		#ifdef TRAVERSALSTATS
+		std::cout << "Traversal:" << std::endl;
+		traversalStats.Print( "  " );
+		#endif
 	}
 
 	Print(32, 4, "FPS: %f", frames_fps);
+	Print(32, 5, "Rays: %.1f M/s", nr_rays * 1e-3f / elapsed);
+	Print(32, 6, "Features: %s", FeatureList( features ).c_str());
+	#ifdef ADAPTIVESAMPLING
+	uint64 samples = 0, active = 0;
+	for ( int tile = 0; tile < tilesX * tilesY; tile++ )
+		samples += adaptiveTiles[tile].samples, active += adaptiveTiles[tile].active;
+	const float pixels = (float)(screen->GetWidth() * screen->GetHeight());
+	Print(32, 7, "Samples: %.2f per pixel, %.1f%% converged", samples / pixels, 100 * (1 - active / pixels));
+	#endif
+	#ifdef PROFILER
+	// The stages of the last frame, this one is not done yet, as far as they fit on the screen
+	uint line = 8;
+	if ( overlay )
+		for ( const ProfileStage &stage : Profiler::Breakdown( Profiler::Frame() - 1 ) )
+		{
+			if ( (int)(2 + line * 7 + 6) > screen->GetHeight() )
+				break;
+			Print(32, line++, "%-20s %7.2f ms", stage.name, stage.time);
+		}
+	#endif
 }
 
+// The horizontal pass needs whole rows, the vertical pass whole columns.
+// A pixel is final once the vertical pass has reached it, so a column is tone mapped right after it.
+void Game::FilterFrame()
+{
+	threadPool->ParallelFor( screen->GetHeight(), [&]( uint y ) {
+		{
+		PROFILE_ZONE( "Firefly clamp" );
+		for (int x = 0; x < screen->GetWidth(); x++)
+		{
+			uint id = x + y * screen->GetWidth();
+			pixelData[id].totalWeight = 0.0f;
+			pixelData[id].filtered = Color(0, 0, 0);
+
+#ifdef SIGMA_FIREFLY
+			// If the illumination is a firefly, then let's scale it, so we still have a color to work with.
+			if (pixelData[id].illumination.ToVec().sqrLength() > SIGMA_FIREFLY * SIGMA_FIREFLY * 3.0f)
+				pixelData[id].illumination *= (1 / SIGMA_FIREFLY);
+#endif
+		}
+		}
+		PROFILE_ZONE( "Bilateral horizontal" );
+		for (int x = 0; x < screen->GetWidth(); x++)
+		{
+			Filter<true>( x, y );
+
+			// Since we are going towards the right only we know that pixel[x,y] will never be touched.
+			// Hence we can safely compute and reset the data for the vertical filtering.
+			uint id = x + y * screen->GetWidth();
+			pixelData[id].filtered *= (1 / pixelData[id].totalWeight);
+			pixelData[id].totalWeight = 0.0f;
+			pixelData[id].illumination = Color(0, 0, 0);
+		}
+	} );
+	threadPool->ParallelFor( screen->GetWidth(), [&]( uint x ) {
+		{
+		PROFILE_ZONE( "Bilateral vertical" );
+		for (int y = 0; y < screen->GetHeight(); y++)
+		{
+			Filter<false>( x, y );
+			// To only horizontal blur, comment the line above and uncomment below
+			// uint id = x + y * screen->GetWidth();
+			// pixelData[id].illumination = pixelData[id].filtered;
+			// pixelData[id].totalWeight = 1.0f;
+		}
+		}
+		PROFILE_ZONE( "Tone map" );
+		for (int y = 0; y < screen->GetHeight(); y++)
+			ToneMap<FEATURE_FILTER>( x, y );
+	} );
+}
+
+#ifdef CONVERGENCEBENCHMARK
+void Game::ConvergenceBenchmark()
+{
+	const int pixels = screen->GetWidth() * screen->GetHeight();
+	// Radiance per pixel without the filter, clamped to the displayed range so that a few fireflies do not dominate
+	auto Radiance = [&]( int id ) {
+		Color c = pixelData[id].accumulated * (1.0f / pixelData[id].samples) * pixelData[id].albedo;
+		return Color( std::min( c.r, 1.0f ), std::min( c.g, 1.0f ), std::min( c.b, 1.0f ) );
+	};
+
+	// The reference uses another seed, so its error is independent of the error of the samplers
+	std::cout << "Rendering the reference with " << CONVERGENCEREFERENCESPP << " spp" << std::endl;
+	samplerType = SAMPLER_RANDOM;
+	samplerSeed = 1;
+	CameraChanged();
+	for ( int i = 0; i < CONVERGENCEREFERENCESPP; i++ )
+		Tick();
+	Color *reference = new Color[pixels];
+	for ( int id = 0; id < pixels; id++ )
+		reference[id] = Radiance( id );
+
+	const char *names[] = {"random", "sobol", "bluenoise"};
+	const int nr_samplers = sizeof( names ) / sizeof( names[0] );
+	std::vector<float> rmse;
+	samplerSeed = 0;
+	for ( int s = 0; s < nr_samplers; s++ )
+	{
+		samplerType = s;
+		CameraChanged();
+		for ( int spp = 1; spp <= CONVERGENCEMAXSPP; spp++ )
+		{
+			Tick();
+			if ( (spp & (spp - 1)) != 0 )
+				continue;
+			double sum = 0;
+			for ( int id = 0; id < pixels; id++ )
+			{
+				Color c = Radiance( id );
+				sum += (c.r - reference[id].r) * (c.r - reference[id].r) +
+					(c.g - reference[id].g) * (c.g - reference[id].g) +
+					(c.b - reference[id].b) * (c.b - reference[id].b);
+			}
+			rmse.push_back( (float)sqrt( sum / (3.0 * pixels) ) );
+		}
+	}
+	delete[] reference;
+
+	const int rows = (int)rmse.size() / nr_samplers;
+	printf( "RMSE against the reference\n%6s", "spp" );
+	for ( int s = 0; s < nr_samplers; s++ )
+		printf( " %12s", names[s] );
+	for ( int row = 0; row < rows; row++ )
+	{
+		printf( "\n%6d", 1 << row );
+		for ( int s = 0; s < nr_samplers; s++ )
+			printf( " %12.6f", rmse[s * rows + row] );
+	}
+	// The RMSE of independent samples falls with the square root of the number of samples
+	printf( "\nSamples per pixel random needs for the RMSE at %d spp:", 1 << (rows - 1) );
+	for ( int s = 0; s < nr_samplers; s++ )
+	{
+		const float ratio = rmse[rows - 1] / rmse[s * rows + rows - 1];
+		printf( " %s %.1f", names[s], (1 << (rows - 1)) * ratio * ratio );
+	}
+	printf( "\n" );
+	samplerType = SAMPLER;
+	CameraChanged();
+}
+#endif
+
 void Game::CameraChanged()
 {
 	unmoved_frames = 0;
 	int max = screen->GetWidth() * screen->GetHeight();
 	for ( int i = 0; i < max; i++ )
+	{
 		pixelData[i].accumulated = Color(0.0f, 0.0f, 0.0f);
+		pixelData[i].accumulatedSq = 0;
+		pixelData[i].samples = 0;
+	}
+	#ifdef ADAPTIVESAMPLING
+	const int tiles = ((screen->GetWidth() + TILESIZE - 1) / TILESIZE) * ((screen->GetHeight() + TILESIZE - 1) / TILESIZE);
+	for ( int tile = 0; tile < tiles; tile++ )
+		adaptiveTiles[tile] = {0, 0, 0, 0};
+	#endif
 }
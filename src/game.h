@@ -2,12 +2,18 @@
 
 #include <map>
 
+#include "config.h"
 #include "surface.h"
 #include "camera.h"
 #include "primitive.h"
 #include "light.h"
 #include "skydome.h"
 #include "bvh.h"
+#include "tlas.h"
+#include "sampler.h"
+#include "wavefront.h"
+#include "threadpool.h"
+#include "profiler.h"
 #include "tiny_obj_loader.h"
 
 namespace AdvancedGraphics {
@@ -18,21 +24,46 @@ struct PixelData
 	vec3 firstIntersect;
 	uint materialIndex;
 	Color accumulated;
+	// Sum of the squared brightness of the samples, and their number, for the variance of the pixel
+	float accumulatedSq;
+	uint samples;
 	Color albedo;
 	Color illumination;
-#if KERNEL_SIZE > 0
+	// Of the filter
 	Color filtered;
 	float totalWeight;
-#endif
 
 	inline PixelData() = default;
 };
 
+// A shadow ray that is traced later, together with those of the other pixels in a tile.
+// The contribution is added if it is not occluded.
+struct DeferredShadowRay
+{
+	Ray ray;
+	Light *light;
+	Color contribution;
+	bool valid;
+};
+
+#ifdef ADAPTIVESAMPLING
+// Sampling state of a tile of TILESIZE x TILESIZE pixels
+struct AdaptiveTile
+{
+	// Summed squared error and number of the pixels that are not converged yet, after the last frame
+	float error;
+	uint active;
+	// Extra samples per active pixel in this frame, and the number of samples taken
+	uint extra, samples;
+};
+#endif
+
 class Game
 {
 public:
 	void SetTarget( Surface* surface );
-	void Init(int argc, char **argv);
+	void Init( const Config &config );
+	// Frees the scene and everything Init allocated
 	void Shutdown();
 	void Tick();
 	
@@ -40,48 +71,143 @@ public:
 	void MouseDown( int button ) { if (view->MouseDown(button)) CameraChanged(); }
 	void MouseMove( int x, int y ) { if (view->MouseMove(x, y)) CameraChanged(); }
 	void KeyUp( int key, byte repeat ) { if (view->KeyUp(key, repeat)) CameraChanged(); }
-	void KeyDown( int key, byte repeat ) { if (view->KeyDown(key, repeat)) CameraChanged(); }
+	// key is one of the KEY_ values, F1 to F5 switch the features of the renderer
+	void KeyDown( int key, byte repeat );
+
+	// Selects the features of the renderer, a mask of FEATURE_ values, and restarts the accumulation
+	void SetFeatures( uint features );
+	uint Features() const { return features; }
 
 	bool CheckOcclusion( Ray *r );
+	// Returns whether the closest hit is an object, if it is a light r->light is set instead
 	bool Intersect( Ray* r, uint &depth );
 	Light* IntersectLights( Ray* r );
-	Color Sample( Ray r, uint pixelId );
+	// If traced is set, r already holds the closest hit. If shadow is set, the first shadow ray is stored
+	// there instead of being traced. F is the mask of features.
+	template <uint F>
+	Color Sample( Ray r, uint pixelId, Sampler &sampler, bool traced = false, DeferredShadowRay *shadow = nullptr );
+	#ifdef USEBVH
+	// Samples a tile of pixels, with the primary and first shadow rays traced as packets. Returns the number of samples.
+	template <uint F>
+	uint SampleTile( int x0, int y0 );
+	#endif
+	// Samples and accumulates a tile of TILESIZE x TILESIZE pixels, without the filter the tile is also tone mapped
+	template <uint F>
+	void RenderTile( uint tile );
+	// Adds a sample to the running sums of a pixel
+	void AddSample( uint id, const Color &color );
+	// With adaptive sampling, converged pixels get no more samples
+	bool NeedsSample( uint id ) const;
+	#ifdef ADAPTIVESAMPLING
+	// Standard error of the mean of a pixel, after gamma correction
+	float PixelError( uint id ) const;
+	// Distributes the extra samples of this frame over the tiles, by their error in the last frame
+	void PlanAdaptiveSampling( uint nr_tiles );
+	#endif
+	// Writes the final color of a pixel to the screen
+	template <uint F>
+	void ToneMap( int x, int y );
+	template <uint F>
+	Ray ComputePrimaryRay( int x, int y, float offset, float pixel_size, Sampler &sampler );
 	void GenerateGaussianKernel( float sigma );
-	void Filter( int pixelX, int pixelY, bool firstPass );
+	// The horizontal pass filters the illumination into filtered, the vertical pass filtered back into the illumination
+	template <bool firstPass>
+	void Filter( int pixelX, int pixelY );
+	// Filters the illumination of the whole frame and tone maps it
+	void FilterFrame();
 	void Print(size_t buflen, uint yline, const char *fmt, ...);
+	// Places the camera, fov is the distance of the screen at a width of 1. Restarts the accumulation.
+	void SetCamera( const vec3 &position, const vec3 &direction, float fov );
+	// Writes the linear radiance of the last frame, as it is before tone mapping, to rgb:
+	// 3 floats per pixel, row by row from the top
+	void ReadImage( float *rgb ) const;
+	// Writes the last frame to an image file, returns false if that fails
+	bool SaveImage( const std::string &filename );
+	// Rays traced in the last frame, primary, bounce and shadow rays
+	uint64 RaysTraced() const { return nr_rays; }
+	#ifdef TRAVERSALSTATS
+	// What tracing the rays of the last frame cost, summed over the threads
+	const TraversalStats &FrameTraversalStats() const { return traversalStats; }
+	#endif
+	#ifdef CONVERGENCEBENCHMARK
+	// Prints the RMSE of every sampler against a reference, after 1, 2, 4 ... CONVERGENCEMAXSPP samples per pixel
+	void ConvergenceBenchmark();
+	#endif
 
   private:
+	// The wavefront renderer runs the stages of Sample itself, on the scene of the game
+	friend class Wavefront;
+	// The benchmark traces rays and builds BVHs on the scene of the game
+	friend class Benchmark;
+	#ifdef RENDERWAVEFRONT
+	Wavefront* wavefront = nullptr;
+	#endif
+
+	ThreadPool* threadPool = nullptr;
+	#ifdef TRAVERSALSTATS
+	TraversalStats traversalStats;
+	#endif
+	#ifdef ADAPTIVESAMPLING
+	AdaptiveTile* adaptiveTiles = nullptr;
+	#endif
 	float *kernel = nullptr;
 
 	PixelData* pixelData = nullptr;
 	Surface* screen;
-	Camera* view;
-	SkyDome* sky;
+	Camera* view = nullptr;
+	SkyDome* sky = nullptr;
 
 	#ifdef USEBVH 
-		BVH* bvh;
+		BVH* bvh = nullptr;
+		// Copies of the mesh, all sharing bvh
+		Instance* instances = nullptr;
+		uint nr_instances = 1;
+		TLAS* tlas = nullptr;
+		// Of the animation, the triangles as they were loaded and their bounds
+		Triangle* restTriangles = nullptr;
+		aabb restBounds;
+		uint animationFrame = 0;
+		#ifdef USEBVHCACHE
+		// Empty for the default scene, which is not cached
+		std::string bvhCacheFile;
+		uint64 meshHash = 0;
+		#endif
 	#endif
 
-	Material* default_material;
-	Material* materials;
-	uint nr_materials;
+	Material* default_material = nullptr;
+	Material* materials = nullptr;
+	uint nr_materials = 0;
 
-	Light** lights;
-	uint nr_lights;
+	Light** lights = nullptr;
+	uint nr_lights = 0;
 
-	Sphere* spheres;
-	uint nr_spheres;
+	Sphere* spheres = nullptr;
+	uint nr_spheres = 0;
 
-	Triangle* triangles;
-	uint nr_triangles;
+	Triangle* triangles = nullptr;
+	uint nr_triangles = 0;
+
+	#ifdef USEBVH
+	// Moves the vertices of the mesh to where the animation is at time, from where they were loaded
+	void MoveMesh( float time );
+	// Refits the BVH of the mesh after its triangles moved, and updates the instances and the TLAS
+	void RefitScene();
+	#endif
 
 	void InitDefaultScene();
   	void InitFromTinyObj( std::string filename );
 	void InitSkyBox();
 
 	uint unmoved_frames = 0;
+	// SAMPLER value of the paths, and the seed of their samplers
+	uint samplerType = SAMPLER;
+	uint samplerSeed = 0;
+	uint features = DEFAULT_FEATURES;
 	float frames_time = 0;
 	float frames_fps = 0;
+	std::atomic<uint64> nr_rays{ 0 };
+	// Whether Print draws on the screen, the headless mode keeps the image clean
+	bool overlay = true;
 	void CameraChanged();
 };
 
@@ -0,0 +1,72 @@
+#include "precomp.h" // include (only) this in every .cpp file
+#include "headless.h"
+#include "renderer.h"
+#include "benchmark.h"
+#include "timer.h"
+
+namespace AdvancedGraphics
+{
+
+int RenderHeadless( const Config &config )
+{
+	timer::TimePoint start = timer::get();
+	Renderer renderer( config.width, config.height );
+	if ( !renderer.Load( config ) )
+		return 1;
+	const float loadTime = timer::elapsed( start );
+
+	timer::TimePoint renderStart = timer::get();
+	if ( config.seconds > 0 )
+	{
+		while ( timer::elapsed( renderStart ) < config.seconds * 1000 )
+			renderer.Frame();
+	}
+	else
+		renderer.Render( config.spp );
+	const float renderTime = timer::elapsed( renderStart );
+
+	const uint frames = renderer.Frames();
+	const uint64 rays = renderer.RaysTraced();
+	printf( "Resolution: %dx%d\n", config.width, config.height );
+	printf( "Samples: %u per pixel in %u frames\n", frames * renderer.SamplesPerFrame(), frames );
+	printf( "Rays: %" PRIu64 ", %.2f M/s\n", rays, rays * 1e-3f / renderTime );
+	printf( "Load time: %.1f ms\n", loadTime );
+	printf( "Render time: %.1f ms, %.2f ms per frame\n", renderTime, renderTime / std::max( frames, 1u ) );
+	printf( "Total time: %.1f ms\n", timer::elapsed( start ) );
+	#ifdef PROFILER
+	printf( "Stages of the last frame, in ms per thread:\n" );
+	for ( const ProfileStage &stage : Profiler::Breakdown( Profiler::Frame() ) )
+		printf( "  %-20s %8.2f (%u threads)\n", stage.name, stage.time, stage.threads );
+	#endif
+	#ifdef TRAVERSALSTATS
+	printf( "Traversal of the last frame:\n" );
+	renderer.FrameTraversalStats().Print( "  " );
+	#endif
+
+	const bool saved = renderer.SaveImage( config.output );
+	if ( saved )
+		printf( "Written to %s\n", config.output.c_str() );
+	WriteTrace( config );
+	return saved ? 0 : 1;
+}
+
+int RunBenchmark( const Config &config )
+{
+	Benchmark benchmark( config );
+	const bool written = benchmark.Run() && benchmark.WriteJSON( config.benchmark );
+	WriteTrace( config );
+	return written ? 0 : 1;
+}
+
+void WriteTrace( const Config &config )
+{
+	if ( config.trace.empty() )
+		return;
+	#ifdef PROFILER
+	Profiler::WriteTrace( config.trace );
+	#else
+	printf( "Not writing %s, the profiler is disabled (PROFILER in precomp.h)\n", config.trace.c_str() );
+	#endif
+}
+
+}; // namespace AdvancedGraphics
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "config.h"
+
+namespace AdvancedGraphics
+{
+
+// The modes of the command line that need no window, for the window front end in main.cpp and for
+// the headless tool. They return the exit code of the program.
+
+// Renders config.spp samples per pixel, or for config.seconds, prints the performance and writes
+// the image to config.output
+int RenderHeadless( const Config &config );
+// Measures the renderer and writes the results to config.benchmark, see benchmark.h
+int RunBenchmark( const Config &config );
+// Writes the zones of the profiler to config.trace, if it is set
+void WriteTrace( const Config &config );
+
+}; // namespace AdvancedGraphics
@@ -0,0 +1,34 @@
+#pragma once
+
+namespace AdvancedGraphics
+{
+
+// The keys the renderer responds to. The render core does not depend on the window system,
+// the front end translates its keys to these, see main.cpp.
+enum Key
+{
+	KEY_NONE = 0,
+	// Moving the camera
+	KEY_W,
+	KEY_A,
+	KEY_S,
+	KEY_D,
+	KEY_Q,
+	KEY_E,
+	// Field of view
+	KEY_R,
+	KEY_F,
+	// Turning the camera
+	KEY_LEFT,
+	KEY_RIGHT,
+	KEY_UP,
+	KEY_DOWN,
+	// Switching the features, in the order of the FEATURE_ bits
+	KEY_F1,
+	KEY_F2,
+	KEY_F3,
+	KEY_F4,
+	KEY_F5
+};
+
+}; // namespace AdvancedGraphics
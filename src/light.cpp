@@ -35,7 +35,7 @@ bool SphereLight::Occludes( Ray *r )
 	vec3 Q = C - t * r->direction;
 	float p2 = dot( Q, Q );
 	float r2 = radius * radius;
-	if ( p2 > r2 ) return -1;
+	if ( p2 > r2 ) return false;
 	t -= sqrt( r2 - p2 );
 
 	if ( t <= 0 || t >= r->t ) return false;
@@ -43,9 +43,9 @@ bool SphereLight::Occludes( Ray *r )
 	return true;
 }
 
-vec3 SphereLight::PointOnLight()
+vec3 SphereLight::PointOnLight( const vec2 &sample )
 {
-	return RandomPointOnSphere(radius) + position;
+	return RandomPointOnSphere(radius, sample) + position;
 }
 
 vec3 SphereLight::NormalAt( vec3 point )
@@ -56,4 +56,9 @@ vec3 SphereLight::NormalAt( vec3 point )
 float SphereLight::Area()
 {
 	return PI * radius * radius;
-}
\ No newline at end of file
+}
+
+aabb SphereLight::Bounds()
+{
+	return aabb( position - vec3( radius, radius, radius ), position + vec3( radius, radius, radius ) );
+}
@@ -12,12 +12,15 @@ struct Light
 	Color color;
 
 	inline Light(Color c) : color(c) {}
+	virtual ~Light() = default;
 
     virtual bool Intersect( Ray *r ) = 0;
 	virtual bool Occludes( Ray *r ) = 0;
-	virtual vec3 PointOnLight() = 0;
+	// Maps a sample in [0, 1)^2 to a point on the light
+	virtual vec3 PointOnLight( const vec2 &sample ) = 0;
 	virtual vec3 NormalAt( vec3 point ) = 0;
 	virtual float Area() = 0;
+	virtual aabb Bounds() = 0;
 };
 
 struct SphereLight : Light 
@@ -29,9 +32,10 @@ struct SphereLight : Light
 
     bool Intersect( Ray *r );
 	bool Occludes( Ray *r );
-	vec3 PointOnLight();
+	vec3 PointOnLight( const vec2 &sample );
 	vec3 NormalAt( vec3 point );
 	float Area();
+	aabb Bounds();
 };
 
 }; // namespace AdvancedGraphics
\ No newline at end of file
@@ -12,7 +12,22 @@
 #endif
 
 #include "precomp.h"
-#include "game.h"
+
+// Glew should be included first
+#include <GL/glew.h>
+// Comment for autoformatters: prevent reordering these two.
+#include <GL/gl.h>
+
+#ifdef _WIN32
+// Then import wglext: This library tries to include the Windows
+// header WIN32_LEAN_AND_MEAN, unless it was already imported.
+#include <GL/wglext.h>
+#endif
+
+#include <SDL.h>
+
+#include "renderer.h"
+#include "headless.h"
 
 using namespace AdvancedGraphics;
 using namespace std;
@@ -32,10 +47,11 @@ unsigned char* framedata = 0;
 
 #endif
 
+// Resolution of the window, set on the command line
 int ACTWIDTH, ACTHEIGHT;
 
 Surface* surface = 0;
-Game* game = 0;
+Renderer* renderer = 0;
 SDL_Window* window = 0;
 
 #ifdef _MSC_VER
@@ -76,11 +92,11 @@ bool createFBtexture()
 		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
 		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP );
 		glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP );
-		glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA, SCRWIDTH, SCRHEIGHT, 0, GL_BGRA, GL_UNSIGNED_BYTE, NULL );
+		glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA, ACTWIDTH, ACTHEIGHT, 0, GL_BGRA, GL_UNSIGNED_BYTE, NULL );
 		glBindTexture(GL_TEXTURE_2D, 0);
 		if (glGetError()) return false;
 	}
-	const int sizeMemory = 4 * SCRWIDTH * SCRHEIGHT;
+	const size_t sizeMemory = (size_t)4 * ACTWIDTH * ACTHEIGHT;
 	glGenBuffers( 2, fbPBO );
 	glBindBuffer( GL_PIXEL_UNPACK_BUFFER_ARB, fbPBO[0] );
 	glBufferData( GL_PIXEL_UNPACK_BUFFER_ARB, sizeMemory, NULL, GL_STREAM_DRAW_ARB );
@@ -91,7 +107,7 @@ bool createFBtexture()
 	glBindBuffer( GL_PIXEL_UNPACK_BUFFER_ARB, fbPBO[0] );
 	framedata = (unsigned char*)glMapBuffer( GL_PIXEL_UNPACK_BUFFER_ARB, GL_WRITE_ONLY_ARB );
 	if (!framedata) return false;
-	memset( framedata, 0, SCRWIDTH * SCRHEIGHT * 4 );
+	memset( framedata, 0, sizeMemory );
 	return (glGetError() == 0);
 }
 
@@ -106,7 +122,7 @@ bool init()
 	wglSwapIntervalEXT = (PFNWGLSWAPINTERVALFARPROC)wglGetProcAddress( "wglSwapIntervalEXT" );
 	if ((!glGenBuffers) || (!glBindBuffer) || (!glBufferData) || (!glMapBuffer) || (!glUnmapBuffer)) return false;
 	if (glGetError()) return false;
-	glViewport( 0, 0, SCRWIDTH, SCRHEIGHT );
+	glViewport( 0, 0, ACTWIDTH, ACTHEIGHT );
 	glMatrixMode( GL_PROJECTION );
 	glLoadIdentity();
 	glOrtho( 0, 1, 0, 1, -1, 1 );
@@ -120,7 +136,7 @@ bool init()
 	glHint( GL_PERSPECTIVE_CORRECTION_HINT, GL_NICEST );
 	glBlendFunc(GL_SRC_ALPHA,GL_ONE);
 	if (wglSwapIntervalEXT) wglSwapIntervalEXT( 0 );
-	surface = new Surface( SCRWIDTH, SCRHEIGHT, 0, SCRWIDTH );
+	surface = new Surface( ACTWIDTH, ACTHEIGHT, 0, ACTWIDTH );
 	return true;
 }
 
@@ -131,7 +147,7 @@ void swap()
 	glUnmapBuffer( GL_PIXEL_UNPACK_BUFFER_ARB );
 	glBindTexture( GL_TEXTURE_2D, framebufferTexID[index] );
 	glBindBuffer( GL_PIXEL_UNPACK_BUFFER_ARB, fbPBO[index] );
-	glTexSubImage2D( GL_TEXTURE_2D, 0, 0, 0, SCRWIDTH, SCRHEIGHT, GL_BGRA, GL_UNSIGNED_BYTE, 0 );
+	glTexSubImage2D( GL_TEXTURE_2D, 0, 0, 0, ACTWIDTH, ACTHEIGHT, GL_BGRA, GL_UNSIGNED_BYTE, 0 );
 	nextindex = (index + 1) % 2;
 	index = (index + 1) % 2;
 	glBindBuffer( GL_PIXEL_UNPACK_BUFFER_ARB, fbPBO[nextindex] );
@@ -154,21 +170,57 @@ void swap()
 
 #endif
 
+// The key of the renderer for a key of SDL, KEY_NONE if it does not use it
+Key translateKey( SDL_Keycode key )
+{
+	switch (key)
+	{
+	case SDLK_w: return KEY_W;
+	case SDLK_a: return KEY_A;
+	case SDLK_s: return KEY_S;
+	case SDLK_d: return KEY_D;
+	case SDLK_q: return KEY_Q;
+	case SDLK_e: return KEY_E;
+	case SDLK_r: return KEY_R;
+	case SDLK_f: return KEY_F;
+	case SDLK_LEFT: return KEY_LEFT;
+	case SDLK_RIGHT: return KEY_RIGHT;
+	case SDLK_UP: return KEY_UP;
+	case SDLK_DOWN: return KEY_DOWN;
+	case SDLK_F1: return KEY_F1;
+	case SDLK_F2: return KEY_F2;
+	case SDLK_F3: return KEY_F3;
+	case SDLK_F4: return KEY_F4;
+	case SDLK_F5: return KEY_F5;
+	default: return KEY_NONE;
+	}
+}
+
 int main( int argc, char **argv )
 {
 #ifdef _MSC_VER
 	redirectIO();
 #endif
 
+	Config config;
+	if (!config.Parse( argc, argv ))
+		return 1;
+	if (!config.benchmark.empty())
+		return RunBenchmark( config );
+	if (config.headless)
+		return RenderHeadless( config );
+	ACTWIDTH = config.width;
+	ACTHEIGHT = config.height;
+
 	printf( "application started.\n" );
 	SDL_Init( SDL_INIT_VIDEO );
 
 #ifdef ADVANCEDGL
 
 #ifdef FULLSCREEN
-	window = SDL_CreateWindow( WINDOW_TITLE, 100, 100, SCRWIDTH, SCRHEIGHT, SDL_WINDOW_FULLSCREEN|SDL_WINDOW_OPENGL );
+	window = SDL_CreateWindow( WINDOW_TITLE, 100, 100, ACTWIDTH, ACTHEIGHT, SDL_WINDOW_FULLSCREEN|SDL_WINDOW_OPENGL );
 #else
-	window = SDL_CreateWindow( WINDOW_TITLE, 100, 100, SCRWIDTH, SCRHEIGHT, SDL_WINDOW_SHOWN|SDL_WINDOW_OPENGL );
+	window = SDL_CreateWindow( WINDOW_TITLE, 100, 100, ACTWIDTH, ACTHEIGHT, SDL_WINDOW_SHOWN|SDL_WINDOW_OPENGL );
 #endif
 	SDL_GLContext glContext = SDL_GL_CreateContext( window);
 	init();
@@ -177,21 +229,28 @@ int main( int argc, char **argv )
 #else
 
 #ifdef FULLSCREEN
-	window = SDL_CreateWindow( WINDOW_TITLE, 100, 100, SCRWIDTH, SCRHEIGHT, SDL_WINDOW_FULLSCREEN );
+	window = SDL_CreateWindow( WINDOW_TITLE, 100, 100, ACTWIDTH, ACTHEIGHT, SDL_WINDOW_FULLSCREEN );
 #else
-	window = SDL_CreateWindow( WINDOW_TITLE, 100, 100, SCRWIDTH, SCRHEIGHT, SDL_WINDOW_SHOWN );
+	window = SDL_CreateWindow( WINDOW_TITLE, 100, 100, ACTWIDTH, ACTHEIGHT, SDL_WINDOW_SHOWN );
 #endif
-	surface = new Surface( SCRWIDTH, SCRHEIGHT );
+	surface = new Surface( ACTWIDTH, ACTHEIGHT );
 	surface->Clear( 0 );
-	SDL_Renderer* renderer = SDL_CreateRenderer( window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC );
-	SDL_Texture* frameBuffer = SDL_CreateTexture( renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, SCRWIDTH, SCRHEIGHT );
+	SDL_Renderer* sdlRenderer = SDL_CreateRenderer( window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC );
+	SDL_Texture* frameBuffer = SDL_CreateTexture( sdlRenderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, ACTWIDTH, ACTHEIGHT );
 
 #endif
 
 	int exitapp = 0;
-	game = new Game();
-	game->SetTarget( surface );
-	game->Init(argc, argv);
+	renderer = new Renderer( surface );
+	if (!renderer->Load( config ))
+	{
+		SDL_Quit();
+		return 1;
+	}
+#ifdef CONVERGENCEBENCHMARK
+	renderer->ConvergenceBenchmark();
+	exitapp = 1;
+#endif
 
 	while (!exitapp)
 	{
@@ -204,20 +263,20 @@ int main( int argc, char **argv )
 		SDL_LockTexture( frameBuffer, NULL, &target, &pitch );
 		if (pitch == (surface->GetWidth() * 4))
 		{
-			memcpy( target, surface->GetBuffer(), SCRWIDTH * SCRHEIGHT * 4 );
+			memcpy( target, surface->GetBuffer(), (size_t)ACTWIDTH * ACTHEIGHT * 4 );
 		}
 		else
 		{
 			unsigned char* t = (unsigned char*)target;
-			for( int i = 0; i < SCRHEIGHT; i++ )
+			for( int i = 0; i < ACTHEIGHT; i++ )
 			{
-				memcpy( t, surface->GetBuffer() + i * SCRWIDTH, SCRWIDTH * 4 );
+				memcpy( t, surface->GetBuffer() + i * ACTWIDTH, ACTWIDTH * 4 );
 				t += pitch;
 			}
 		}
 		SDL_UnlockTexture( frameBuffer );
-		SDL_RenderCopy( renderer, frameBuffer, NULL, NULL );
-		SDL_RenderPresent( renderer );
+		SDL_RenderCopy( sdlRenderer, frameBuffer, NULL, NULL );
+		SDL_RenderPresent( sdlRenderer );
 	#endif
 		// event loop
 		SDL_Event event;
@@ -232,27 +291,28 @@ int main( int argc, char **argv )
 				// find other keys here: http://sdl.beuc.net/sdl.wiki/SDLKey
 				if (event.key.keysym.sym == SDLK_ESCAPE)
 					exitapp = 1;
-				game->KeyDown( event.key.keysym.sym, event.key.repeat );
+				renderer->KeyDown( translateKey( event.key.keysym.sym ), event.key.repeat );
 				break;
 			case SDL_KEYUP:
-				game->KeyUp( event.key.keysym.sym, event.key.repeat );
+				renderer->KeyUp( translateKey( event.key.keysym.sym ), event.key.repeat );
 				break;
 			case SDL_MOUSEMOTION:
-				game->MouseMove( event.motion.x, event.motion.y );
+				renderer->MouseMove( event.motion.x, event.motion.y );
 				break;
 			case SDL_MOUSEBUTTONUP:
-				game->MouseUp( event.button.button );
+				renderer->MouseUp( event.button.button );
 				break;
 			case SDL_MOUSEBUTTONDOWN:
-				game->MouseDown( event.button.button );
+				renderer->MouseDown( event.button.button );
 				break;
 			default:
 				break;
 			}
 		}
-		game->Tick();
+		renderer->Frame();
 	}
-	game->Shutdown();
+	delete renderer;
+	WriteTrace( config );
 	SDL_Quit();
 	return 0;
 }
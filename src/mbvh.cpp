@@ -0,0 +1,234 @@
+#include "precomp.h" // include (only) this in every .cpp file
+#include "mbvh.h"
+#include "bvh.h"
+
+#if BVHWIDTH > 2
+
+#if BVHWIDTH == 8
+#define LOADW( x ) _mm256_load_ps( x )
+#define STOREW( x, v ) _mm256_storeu_ps( x, v )
+#define SETW( x ) _mm256_set1_ps( x )
+#define SUBW( a, b ) _mm256_sub_ps( a, b )
+#define MULW( a, b ) _mm256_mul_ps( a, b )
+#define MINW( a, b ) _mm256_min_ps( a, b )
+#define MAXW( a, b ) _mm256_max_ps( a, b )
+#define LEMASKW( a, b ) _mm256_movemask_ps( _mm256_cmp_ps( a, b, _CMP_LE_OQ ) )
+#else
+#define LOADW( x ) _mm_load_ps( x )
+#define STOREW( x, v ) _mm_storeu_ps( x, v )
+#define SETW( x ) _mm_set1_ps( x )
+#define SUBW( a, b ) _mm_sub_ps( a, b )
+#define MULW( a, b ) _mm_mul_ps( a, b )
+#define MINW( a, b ) _mm_min_ps( a, b )
+#define MAXW( a, b ) _mm_max_ps( a, b )
+#define LEMASKW( a, b ) _mm_movemask_ps( _mm_cmple_ps( a, b ) )
+#endif
+
+// Every level of the tree can push at most BVHWIDTH - 1 extra nodes.
+// Deeper trees get a stack on the heap.
+#define MBVHSTACKSIZE 256
+
+MBVHRay::MBVHRay( const Ray *r )
+{
+	for ( int a = 0; a < 3; a++ )
+	{
+		origin[a] = SETW( r->origin[a] );
+		invdir[a] = SETW( r->invdir[a] );
+	}
+}
+
+void MBVHNode::Reset()
+{
+	for ( uint i = 0; i < BVHWIDTH; i++ )
+	{
+		bminx[i] = bminy[i] = bminz[i] = 1e34f;
+		bmaxx[i] = bmaxy[i] = bmaxz[i] = -1e34f;
+		child[i] = 0;
+		count[i] = 0;
+	}
+}
+
+void MBVHNode::SetChild( uint slot, const aabb &bounds, uint index, uint nr_triangles )
+{
+	bminx[slot] = bounds.bmin[0];
+	bminy[slot] = bounds.bmin[1];
+	bminz[slot] = bounds.bmin[2];
+	bmaxx[slot] = bounds.bmax[0];
+	bmaxy[slot] = bounds.bmax[1];
+	bmaxz[slot] = bounds.bmax[2];
+	child[slot] = index;
+	count[slot] = nr_triangles;
+}
+
+int MBVHNode::Intersect( const MBVHRay &ray, float tmax, float tmin[BVHWIDTH] ) const
+{
+	// Slab test for all children at once
+	floatw t1x = MULW( SUBW( LOADW( bminx ), ray.origin[0] ), ray.invdir[0] );
+	floatw t2x = MULW( SUBW( LOADW( bmaxx ), ray.origin[0] ), ray.invdir[0] );
+	floatw t1y = MULW( SUBW( LOADW( bminy ), ray.origin[1] ), ray.invdir[1] );
+	floatw t2y = MULW( SUBW( LOADW( bmaxy ), ray.origin[1] ), ray.invdir[1] );
+	floatw t1z = MULW( SUBW( LOADW( bminz ), ray.origin[2] ), ray.invdir[2] );
+	floatw t2z = MULW( SUBW( LOADW( bmaxz ), ray.origin[2] ), ray.invdir[2] );
+
+	floatw vmin = MAXW( MAXW( MINW( t1x, t2x ), MINW( t1y, t2y ) ), MINW( t1z, t2z ) );
+	floatw vmax = MINW( MINW( MAXW( t1x, t2x ), MAXW( t1y, t2y ) ), MAXW( t1z, t2z ) );
+	// Only intersections in front of the ray and before the closest hit so far count
+	vmin = MAXW( vmin, SETW( 0.0f ) );
+	vmax = MINW( vmax, SETW( tmax ) );
+
+	STOREW( tmin, vmin );
+	return LEMASKW( vmin, vmax );
+}
+
+uint MBVH::Collapse( BVH *bvh, uint binaryNode, uint level )
+{
+	uint idx = nr_nodes++;
+	assert( idx < nr_nodes_max );
+	nr_levels = std::max( nr_levels, level );
+
+	// Start with the children of the binary node, then keep opening the
+	// intermediate child with the largest surface area until all slots are used.
+	uint children[BVHWIDTH];
+	uint nr_children = 0;
+	const BVHNode &node = bvh->pool[binaryNode];
+	if ( node.count > 0 )
+	{
+		// Only happens for a root that is a leaf
+		children[nr_children++] = binaryNode;
+	}
+	else
+	{
+		children[nr_children++] = node.firstleft;
+		children[nr_children++] = node.firstleft + 1;
+	}
+
+	while ( nr_children < BVHWIDTH )
+	{
+		int best = -1;
+		float bestArea = -1;
+		for ( uint i = 0; i < nr_children; i++ )
+		{
+			const BVHNode &c = bvh->pool[children[i]];
+			if ( c.count == 0 && c.Bounds().Area() > bestArea )
+			{
+				best = i;
+				bestArea = c.Bounds().Area();
+			}
+		}
+		// Only leaves left
+		if ( best < 0 )
+			break;
+
+		uint open = children[best];
+		children[best] = bvh->pool[open].firstleft;
+		children[nr_children++] = bvh->pool[open].firstleft + 1;
+	}
+
+	pool[idx].Reset();
+	for ( uint i = 0; i < nr_children; i++ )
+	{
+		const BVHNode &c = bvh->pool[children[i]];
+		if ( c.count > 0 )
+			pool[idx].SetChild( i, c.Bounds(), c.firstleft, c.count );
+		else
+			pool[idx].SetChild( i, c.Bounds(), Collapse( bvh, children[i], level + 1 ), 0 );
+	}
+	return idx;
+}
+
+void MBVH::Construct( BVH *bvh, bool verbose )
+{
+	if ( verbose )
+		printf( "Collapsing BVH into a %i-wide BVH...\n", BVHWIDTH );
+	// Every MBVH node replaces at least one intermediate binary node
+	if ( pool != nullptr )
+		FREE64( pool );
+	nr_nodes_max = bvh->nr_nodes;
+	pool = (MBVHNode *)MALLOC64( nr_nodes_max * sizeof( MBVHNode ) );
+	nr_nodes = 0;
+	nr_levels = 0;
+
+	Collapse( bvh, bvh->root - bvh->pool, 1 );
+	if ( verbose )
+		printf( "Used number of %i-wide nodes: %i (%zu bytes), %u levels\n", BVHWIDTH, nr_nodes, nr_nodes * sizeof( MBVHNode ), nr_levels );
+}
+
+bool MBVH::Traverse( BVH *bvh, Ray *r, uint &depth, bool checkOcclusion )
+{
+	// Entries are either a node in the pool or a leaf, with the distance at which the ray enters it
+	struct StackEntry
+	{
+		uint index, count;
+		float tmin;
+	};
+	// Every node on the way down leaves at most BVHWIDTH - 1 siblings on the stack
+	TraversalStack<StackEntry, MBVHSTACKSIZE> stack( (BVHWIDTH - 1) * nr_levels + 1 );
+	uint stackPtr = 0;
+	stack[stackPtr++] = {0, 0, 0.0f};
+
+	const MBVHRay ray( r );
+	TRAVERSAL_STATS( TraversalStats &stats = TraversalStats::Local() );
+	bool found = false;
+	while ( stackPtr > 0 )
+	{
+		const StackEntry entry = stack[--stackPtr];
+		// A closer intersection has been found since this entry was pushed
+		if ( entry.tmin > r->t )
+		{
+			TRAVERSAL_STATS( stats.culledNodes++ );
+			continue;
+		}
+		depth++;
+
+		if ( entry.count > 0 )
+		{
+			TRAVERSAL_STATS( stats.leafVisits++ );
+			TRAVERSAL_STATS( stats.triangleTests += entry.count );
+			const TriangleBlock *block = bvh->blocks + bvh->leaf_blocks[entry.index];
+			for ( uint i = 0; i < entry.count; i += TRIANGLEBLOCKWIDTH, block++ )
+			{
+				if ( block->Intersect( bvh->triangles, r, checkOcclusion ) )
+				{
+					if ( checkOcclusion )
+					{
+						TRAVERSAL_STATS( stats.earlyOuts++ );
+						return true;
+					}
+					found = true;
+				}
+			}
+			continue;
+		}
+
+		const MBVHNode &node = pool[entry.index];
+		float tmin[BVHWIDTH];
+		TRAVERSAL_STATS( stats.aabbTests += BVHWIDTH );
+		const int mask = node.Intersect( ray, r->t, tmin );
+		if ( mask == 0 )
+			continue;
+
+		// Sort the children that were hit from far to near,
+		// so the nearest one ends up on top of the stack.
+		uint order[BVHWIDTH];
+		uint nr_hits = 0;
+		for ( uint i = 0; i < BVHWIDTH; i++ )
+		{
+			if ( !(mask & (1 << i)) || node.IsEmpty( i ) )
+				continue;
+			uint j = nr_hits++;
+			for ( ; j > 0 && tmin[order[j - 1]] < tmin[i]; j-- )
+				order[j] = order[j - 1];
+			order[j] = i;
+		}
+
+		assert( stackPtr + nr_hits <= stack.size );
+		for ( uint j = 0; j < nr_hits; j++ )
+		{
+			uint i = order[j];
+			stack[stackPtr++] = {node.child[i], node.count[i], tmin[i]};
+		}
+	}
+	return found;
+}
+
+#endif
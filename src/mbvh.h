@@ -0,0 +1,74 @@
+#pragma once
+
+#include "vectors.h"
+#include "ray.h"
+#include "utils.h"
+
+#if BVHWIDTH > 2
+
+#if BVHWIDTH == 8 && !defined( __AVX__ )
+#error "An 8-wide BVH requires AVX, enable it in the compiler flags (e.g. -mavx2)"
+#endif
+
+namespace AdvancedGraphics
+{
+
+struct BVH; // forward declaration
+
+#if BVHWIDTH == 8
+typedef __m256 floatw;
+#else
+typedef __m128 floatw;
+#endif
+
+// Ray data broadcasted over all lanes, computed once per traversal
+struct MBVHRay
+{
+	floatw origin[3];
+	floatw invdir[3];
+
+	MBVHRay( const Ray *r );
+};
+
+// Node of a BVH with BVHWIDTH children per node, collapsed from the binary BVH.
+// The child bounds are stored per axis, so a single SIMD slab test covers all of them.
+struct ALIGN( 64 ) MBVHNode
+{
+  public:
+	float bminx[BVHWIDTH], bminy[BVHWIDTH], bminz[BVHWIDTH];
+	float bmaxx[BVHWIDTH], bmaxy[BVHWIDTH], bmaxz[BVHWIDTH];
+	// For intermediate children the index of the child in the MBVH pool,
+	// for leaves the first index into BVH::indices.
+	uint child[BVHWIDTH];
+	// Number of triangles of leaf children, 0 for intermediate or empty children.
+	uint count[BVHWIDTH];
+
+	void Reset();
+	void SetChild( uint slot, const aabb &bounds, uint index, uint count );
+	inline bool IsEmpty( uint slot ) const { return child[slot] == 0 && count[slot] == 0; }
+	// Returns a bitmask of the children hit before tmax, and their entry distances in tmin
+	int Intersect( const MBVHRay &ray, float tmax, float tmin[BVHWIDTH] ) const;
+};
+
+struct MBVH
+{
+  public:
+	MBVHNode *pool = nullptr;
+	uint nr_nodes, nr_nodes_max;
+	// Number of levels of the tree, the traversal stack is sized from it
+	uint nr_levels;
+
+	~MBVH() { FREE64( pool ); }
+
+	// Collapses the binary BVH, again after it was refitted. Verbose prints the size of the result.
+	void Construct( BVH *bvh, bool verbose = true );
+
+	bool Traverse( BVH *bvh, Ray *r, uint &depth, bool checkOcclusion );
+
+  private:
+	uint Collapse( BVH *bvh, uint binaryNode, uint level );
+};
+
+}; // namespace AdvancedGraphics
+
+#endif
@@ -0,0 +1,82 @@
+#include "precomp.h" // include (only) this in every .cpp file
+#include "packet.h"
+#include "bvh.h"
+
+RayPacket::RayPacket( Ray *rays, uint count, bool *occluded ) :
+	rays( rays ),
+	count( count ),
+	occluded( occluded ),
+	coherent( count > 0 )
+{
+	assert( count <= MAXPACKETRAYS );
+	for ( int a = 0; a < 3; a++ )
+	{
+		omin[a] = imin[a] = 1e34f;
+		omax[a] = imax[a] = -1e34f;
+	}
+	for ( uint i = 0; i < count; i++ )
+	{
+		const Ray &r = rays[i];
+		for ( int a = 0; a < 3; a++ )
+		{
+			omin[a] = std::min( omin[a], r.origin[a] ), omax[a] = std::max( omax[a], r.origin[a] );
+			imin[a] = std::min( imin[a], r.invdir[a] ), imax[a] = std::max( imax[a], r.invdir[a] );
+			// Axis aligned rays have an infinite inverse, which the intervals cannot handle
+			if ( r.sign[a] != rays[0].sign[a] || !std::isfinite( r.invdir[a] ) )
+				coherent = false;
+		}
+	}
+
+	// Rays with origins far apart, like shadow rays from a tile that spans a large depth range,
+	// have little traversal in common
+	float tmin = 1e34f;
+	for ( uint i = 0; i < count; i++ )
+		tmin = std::min( tmin, rays[i].t );
+	for ( int a = 0; a < 3; a++ )
+		if ( omax[a] - omin[a] > PACKETSPREAD * tmin )
+			coherent = false;
+}
+
+bool RayPacket::IntersectsInterval( const BVHNode &node ) const
+{
+	if ( !coherent )
+		return true;
+	// Bounds on the entry and exit distance over all rays, per axis. Every ray
+	// enters the node after the largest lower bound, and leaves it before the smallest upper bound.
+	float tnear = 0, tfar = 1e34f;
+	for ( int a = 0; a < 3; a++ )
+	{
+		const float nearPlane = rays[0].sign[a] ? node.bmax[a] : node.bmin[a];
+		const float farPlane = rays[0].sign[a] ? node.bmin[a] : node.bmax[a];
+		const float n0 = (nearPlane - omax[a]) * imin[a], n1 = (nearPlane - omax[a]) * imax[a];
+		const float n2 = (nearPlane - omin[a]) * imin[a], n3 = (nearPlane - omin[a]) * imax[a];
+		const float f0 = (farPlane - omax[a]) * imin[a], f1 = (farPlane - omax[a]) * imax[a];
+		const float f2 = (farPlane - omin[a]) * imin[a], f3 = (farPlane - omin[a]) * imax[a];
+		tnear = std::max( tnear, std::min( std::min( n0, n1 ), std::min( n2, n3 ) ) );
+		tfar = std::min( tfar, std::max( std::max( f0, f1 ), std::max( f2, f3 ) ) );
+	}
+	return tnear <= tfar;
+}
+
+bool RayPacket::Active( const BVHNode &node, uint &first, uint &last ) const
+{
+	float tmin, tmax;
+	TRAVERSAL_STATS( TraversalStats &stats = TraversalStats::Local() );
+	while ( first < last && (Done( first ) || !node.AABBIntersection( rays + first, tmin, tmax )) )
+	{
+		TRAVERSAL_STATS( stats.aabbTests += !Done( first ) );
+		first++;
+	}
+	if ( first == last )
+		return false;
+	// The test that found the first active ray
+	TRAVERSAL_STATS( stats.aabbTests++ );
+	while ( Done( last - 1 ) || !node.AABBIntersection( rays + last - 1, tmin, tmax ) )
+	{
+		TRAVERSAL_STATS( stats.aabbTests += !Done( last - 1 ) );
+		last--;
+	}
+	// And the last, which is the same ray if only one is left
+	TRAVERSAL_STATS( stats.aabbTests++ );
+	return true;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "vectors.h"
+#include "ray.h"
+
+namespace AdvancedGraphics
+{
+
+struct BVHNode; // forward declaration
+
+#if PACKETSIZE > 0 && TILESIZE % PACKETSIZE != 0
+#error "TILESIZE must be a multiple of PACKETSIZE"
+#endif
+
+// Maximum number of rays in a packet, a tile of PACKETSIZE x PACKETSIZE pixels
+#define MAXPACKETRAYS (PACKETSIZE > 0 ? PACKETSIZE * PACKETSIZE : 1)
+// Packets whose origins are spread over more than this fraction of the shortest ray are traced one ray at a time
+#define PACKETSPREAD 0.1f
+
+// Rays that are traced together, such as the primary rays of a tile of pixels.
+// Traversal keeps the range of rays that are still active for a node, and culls nodes for
+// the whole packet with an interval test on the origins and directions of the rays.
+struct RayPacket
+{
+  public:
+	Ray *rays;
+	uint count;
+	// Only for occlusion queries, set for the rays that are blocked
+	bool *occluded;
+	// The interval test needs all directions to have the same signs,
+	// otherwise the rays are traced one by one.
+	bool coherent;
+	// Intervals of the origins and the inverse directions per axis
+	float omin[3], omax[3], imin[3], imax[3];
+
+	RayPacket( Ray *rays, uint count, bool *occluded = nullptr );
+
+	// False if no ray of the packet can hit the node
+	bool IntersectsInterval( const BVHNode &node ) const;
+	// Narrows the range [first, last) to the first and last ray that hit the node, false if none does
+	bool Active( const BVHNode &node, uint &first, uint &last ) const;
+	inline bool Done( uint i ) const { return occluded != nullptr && occluded[i]; }
+};
+
+}; // namespace AdvancedGraphics
@@ -10,19 +10,12 @@
 // #define FULLSCREEN
 // #define ADVANCEDGL	// faster if your system supports it
 
-// Glew should be included first
-#include <GL/glew.h>
-// Comment for autoformatters: prevent reordering these two.
-#include <GL/gl.h>
+// OpenGL and SDL are only used by the window, main.cpp includes them itself,
+// so the render core builds without them.
 
 #ifdef _WIN32
-// Followed by the Windows header
 #include <Windows.h>
 
-// Then import wglext: This library tries to include the Windows
-// header WIN32_LEAN_AND_MEAN, unless it was already imported.
-#include <GL/wglext.h>
-
 // Extra definitions for redirectIO
 #include <fcntl.h>
 #include <io.h>
@@ -30,19 +23,35 @@
 
 // External dependencies:
 #include <FreeImage.h>
-#include <SDL.h>
 
 // C++ headers
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <utility>
+#include <vector>
 
 // Namespaced C headers:
 #include <cassert>
+#include <cerrno>
 #include <cinttypes>
+#include <climits>
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+
+// OpenMP, used for multithreading the BVH construction
+#include <omp.h>
 
 // Header for AVX, and every technology before it.
 // If your CPU does not support this, include the appropriate header instead.
@@ -50,6 +59,7 @@
 #include <immintrin.h>
 
 #define WINDOW_TITLE "Advanced Graphics"
+// Default resolution, --width and --height select another one
 #define SCRWIDTH 512
 #define SCRHEIGHT 512
 
@@ -57,6 +67,8 @@
 #define MAX_NR_ITERATIONS 4
 #define NR_LIGHT_SAMPLES 1
 
+// SSAA, USENEE, USERUSSIANROULETTE, USEMIS and the filter only set the default features, see
+// renderfeatures.h. --features and F1 to F5 switch them at runtime.
 // Anti-aliasing 4x
 //#define SSAA
 //#define USESTRATIFICATION
@@ -68,12 +80,81 @@
 //#define VISUALIZEBVH
 // Number of bins to use for BVH
 //  - For full SAH use 0
+//  - For a linear BVH (sorted Morton codes) use 1
 //  - For median split use 2
 //  - For any other amount of bins use n
 #define BVHBINS 8
+// Number of children per node used for traversal
+//  - For the binary BVH use 2
+//  - For a 4-wide BVH (SSE) use 4
+//  - For an 8-wide BVH (AVX) use 8, this requires AVX support, see CMakeLists.txt
+#define BVHWIDTH 2
+// Nodes with at most this many triangles are not split further. The triangles of a leaf are
+// intersected together with SIMD: up to 4 uses SSE, up to 8 uses AVX (see CMakeLists.txt).
+#define BVHLEAFSIZE 4
+// Nodes with more triangles than this are subdivided as separate OpenMP tasks,
+// smaller subtrees are finished by the thread that created them.
+#define BVHTASKSIZE 1024
+// Nodes with more triangles than this are also binned in parallel.
+#define BVHPARALLELBINS 65536
+// Spatial splits (SBVH) for the binned build: triangles that straddle a split plane are
+// referenced from both sides. This is limited to SBVHBUDGET percent extra references.
+//#define USESBVH
+#define SBVHBUDGET 30
+// BVH::Refit rebuilds subtrees whose SAH cost grew by more than this factor since they were built.
+#define BVHREBUILDFACTOR 2.0f
+// Animate the loaded mesh: every frame its vertices sway by ANIMATIONAMPLITUDE times its width at the
+// top, BVH::Refit updates the tree and the instances and the TLAS follow. The accumulation restarts every frame.
+//#define ANIMATEMESH
+#define ANIMATIONSTEP 0.05f
+#define ANIMATIONAMPLITUDE 0.1f
+// Store the BVH of an .obj file in a .bvh file next to it, and load it on the next start.
+#define USEBVHCACHE
+// Number of render threads, 0 uses all hardware threads.
+#define NR_THREADS 0
+// The screen is rendered in tasks of TILESIZE x TILESIZE pixels, a multiple of PACKETSIZE.
+#define TILESIZE 16
+// Primary rays and their first shadow rays are traced as packets, per tile of PACKETSIZE x PACKETSIZE pixels.
+// Use 0 to trace every ray on its own.
+#define PACKETSIZE 8
+// Render with the wavefront path tracer: all paths of a frame advance one bounce at a time,
+// in separate stages for intersection, shading and shadow rays. Not used while SSAA is on.
+//#define USEWAVEFRONT
+// With the wavefront path tracer, sort the rays of every bounce after the first by the octant of
+// their direction and the Morton code of their origin, so neighbouring rays traverse the same nodes.
+//#define RAYSORTING
+// Sampler of the random decisions of the paths, see sampler.h
+//  - For independent random numbers use 0
+//  - For Owen-scrambled Sobol points use 1
+//  - For Sobol points dithered with a blue-noise mask use 2
+#define SAMPLER 1
+// Instead of showing the scene, render it with every sampler and print the RMSE against a reference
+// of CONVERGENCEREFERENCESPP independent samples per pixel, then exit.
+//#define CONVERGENCEBENCHMARK
+#define CONVERGENCEREFERENCESPP 1024
+#define CONVERGENCEMAXSPP 64
+// Record the time of the stages of a frame, shown on screen and written by --trace, see profiler.h.
+// Every thread keeps the last PROFILERCAPACITY zones, a power of 2.
+#define PROFILER
+#define PROFILERCAPACITY 65536
+// Count the rays by kind and the box and triangle tests, leaves and early-outs of their traversal,
+// printed per frame and written by --benchmark, see traversalstats.h. When off, none of the counting is compiled in.
+//#define TRAVERSALSTATS
+// Frames per run of --benchmark, and the seed of its rays
+#define BENCHMARKFRAMES 4
+#define BENCHMARKSEED 1
+// Adaptive sampling: a pixel stops taking samples once it has ADAPTIVEMINSAMPLES and the standard
+// error of its mean is below ADAPTIVETHRESHOLD, after gamma correction. Every frame ADAPTIVEBUDGET extra samples
+// per pixel of the screen go to the tiles with the most error, at most ADAPTIVEMAXEXTRA per pixel.
+// Not used by the wavefront renderer.
+//#define ADAPTIVESAMPLING
+#define ADAPTIVETHRESHOLD 0.02f
+#define ADAPTIVEMINSAMPLES 8
+#define ADAPTIVEBUDGET 0.5f
+#define ADAPTIVEMAXEXTRA 8
 
 // Kernel size for filtering
-// If this is 0 then no filter is applied.
+// If this is 0 then no filter is applied, whatever the features are.
 #define KERNEL_SIZE 65
 #define SIGMA_ILLUMINATION 50.0f
 #define SIGMA_FIREFLY 25.0f
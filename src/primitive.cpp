@@ -24,6 +24,8 @@ bool Primitive::Intersect(Ray* r)
     if (t <= 0 || t >= r->t) return false;
     r->t = t;
     r->obj = this;
+    r->instance = nullptr;
+    r->light = nullptr;
     return true;
 }
 
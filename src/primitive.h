@@ -44,6 +44,8 @@ public:
     }
 
 	static void FromTinyObj( Material *res, std::string basedir, tinyobj::material_t mat );
+    // Materials are copied by value, so the scene frees their textures when it is done with them
+    inline void FreeTexture() { delete texture; texture = nullptr; }
 private:
     Color color;
     Surface* texture;
@@ -94,6 +96,8 @@ class Sphere : public Primitive
     float IntersectionDistance(Ray* r);
     vec3 NormalAt( vec3 point );
     vec2 TextureAt ( vec3 point );
+
+    inline aabb Bounds() const { return aabb( position - vec3( radius, radius, radius ), position + vec3( radius, radius, radius ) ); }
 };
 
 class Triangle : public Primitive
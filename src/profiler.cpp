@@ -0,0 +1,137 @@
+#include "precomp.h" // include (only) this in every .cpp file
+#include "profiler.h"
+
+#ifdef PROFILER
+
+using namespace AdvancedGraphics;
+
+static_assert( (PROFILERCAPACITY & (PROFILERCAPACITY - 1)) == 0, "PROFILERCAPACITY has to be a power of 2" );
+
+struct ProfileEvent
+{
+	const char *name;
+	uint64 start, end;
+	uint frame;
+};
+
+// The ring buffer of a thread. The buffers are never freed, so they outlive the threads of a thread pool.
+struct ProfileThread
+{
+	uint index;
+	// Zones written so far, the next one goes to count % PROFILERCAPACITY
+	uint64 count = 0;
+	std::vector<ProfileEvent> events;
+};
+
+static std::mutex threadsMutex;
+static std::vector<std::unique_ptr<ProfileThread>> threads;
+static thread_local ProfileThread *currentThread = nullptr;
+static const std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+static ProfileThread *RegisterThread()
+{
+	std::lock_guard<std::mutex> lock( threadsMutex );
+	threads.emplace_back( new ProfileThread() );
+	ProfileThread *thread = threads.back().get();
+	thread->index = (uint)threads.size() - 1;
+	thread->events.resize( PROFILERCAPACITY );
+	return thread;
+}
+
+std::atomic<uint> Profiler::currentFrame{ 0 };
+
+void Profiler::NextFrame()
+{
+	currentFrame++;
+}
+
+uint64 Profiler::Now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - epoch ).count();
+}
+
+void Profiler::Record( const char *name, uint64 start, uint64 end )
+{
+	if ( currentThread == nullptr )
+		currentThread = RegisterThread();
+	currentThread->events[currentThread->count & (PROFILERCAPACITY - 1)] = {name, start, end, Frame()};
+	currentThread->count++;
+}
+
+std::vector<ProfileStage> Profiler::Breakdown( uint frame )
+{
+	std::vector<ProfileStage> stages;
+	std::lock_guard<std::mutex> lock( threadsMutex );
+	for ( const auto &thread : threads )
+	{
+		// Stages this thread has been counted for
+		std::vector<bool> counted( stages.size(), false );
+		// The zones are stored in the order they ended, so the frames only go up
+		const uint64 first = thread->count > PROFILERCAPACITY ? thread->count - PROFILERCAPACITY : 0;
+		for ( uint64 i = thread->count; i > first; i-- )
+		{
+			const ProfileEvent &e = thread->events[(i - 1) & (PROFILERCAPACITY - 1)];
+			if ( e.frame > frame )
+				continue;
+			if ( e.frame < frame )
+				break;
+			// The same literal can have another address in another file
+			size_t s = 0;
+			while ( s < stages.size() && strcmp( stages[s].name, e.name ) != 0 )
+				s++;
+			if ( s == stages.size() )
+			{
+				stages.push_back( {e.name, 0, 0, e.start} );
+				counted.push_back( false );
+			}
+			ProfileStage &stage = stages[s];
+			stage.time += (e.end - e.start) * 1e-6f;
+			stage.start = std::min( stage.start, e.start );
+			if ( !counted[s] )
+			{
+				stage.threads++;
+				counted[s] = true;
+			}
+		}
+	}
+	for ( ProfileStage &stage : stages )
+		stage.time /= stage.threads;
+	std::sort( stages.begin(), stages.end(), []( const ProfileStage &a, const ProfileStage &b ) { return a.start < b.start; } );
+	return stages;
+}
+
+bool Profiler::WriteTrace( const std::string &filename )
+{
+	std::ofstream f( filename );
+	f << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+	std::lock_guard<std::mutex> lock( threadsMutex );
+	uint64 zones = 0;
+	char line[256];
+	for ( const auto &thread : threads )
+	{
+		snprintf( line, sizeof( line ), "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u, \"args\": {\"name\": \"Thread %u\"}}",
+			thread->index, thread->index );
+		f << (thread->index > 0 ? ",\n" : "") << line;
+		const uint64 first = thread->count > PROFILERCAPACITY ? thread->count - PROFILERCAPACITY : 0;
+		for ( uint64 i = first; i < thread->count; i++ )
+		{
+			// Complete events, in microseconds
+			const ProfileEvent &e = thread->events[i & (PROFILERCAPACITY - 1)];
+			snprintf( line, sizeof( line ), "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %u, \"ts\": %.3f, \"dur\": %.3f, \"args\": {\"frame\": %u}}",
+				e.name, thread->index, e.start * 1e-3, (e.end - e.start) * 1e-3, e.frame );
+			f << ",\n" << line;
+		}
+		zones += thread->count - first;
+	}
+	f << "\n]}\n";
+	f.close();
+	if ( f.fail() )
+	{
+		std::cerr << "Could not write " << filename << std::endl;
+		return false;
+	}
+	printf( "Written %" PRIu64 " zones of %zu threads to %s\n", zones, threads.size(), filename.c_str() );
+	return true;
+}
+
+#endif
@@ -0,0 +1,65 @@
+#pragma once
+
+namespace AdvancedGraphics
+{
+
+// Time spent in a zone during one frame, see Profiler::Breakdown
+struct ProfileStage
+{
+	const char *name;
+	// Summed over the threads that ran the zone, divided by their number, in ms.
+	// For a zone of the main thread that is its wall-clock time.
+	float time;
+	uint threads;
+	// Of the first time the zone was entered, to order the stages
+	uint64 start;
+};
+
+#ifdef PROFILER
+
+// Records scoped zones per thread: every thread writes the zones it leaves into a ring buffer of
+// its own, so recording needs no locks. The last PROFILERCAPACITY zones of every thread are kept.
+class Profiler
+{
+  public:
+	// Starts the next frame, the zones that end after this belong to it
+	static void NextFrame();
+	static uint Frame() { return currentFrame.load( std::memory_order_relaxed ); }
+
+	// Nanoseconds since the start of the program
+	static uint64 Now();
+	static void Record( const char *name, uint64 start, uint64 end );
+
+	// The zones of a frame, in the order they were first entered. Only call this while no other
+	// thread records zones, between frames.
+	static std::vector<ProfileStage> Breakdown( uint frame );
+	// Writes all zones that are kept as Chrome trace-event JSON, for chrome://tracing or Perfetto.
+	// Returns false if that fails.
+	static bool WriteTrace( const std::string &filename );
+
+  private:
+	static std::atomic<uint> currentFrame;
+};
+
+// Records the time from its construction to the end of the scope
+struct ProfileZone
+{
+	const char *name;
+	uint64 start;
+
+	ProfileZone( const char *name ) : name( name ), start( Profiler::Now() ) {}
+	~ProfileZone() { Profiler::Record( name, start, Profiler::Now() ); }
+};
+
+#define PROFILE_CONCAT2( a, b ) a##b
+#define PROFILE_CONCAT( a, b ) PROFILE_CONCAT2( a, b )
+// Records the rest of the scope as a zone, name has to be a string literal
+#define PROFILE_ZONE( name ) ProfileZone PROFILE_CONCAT( profileZone, __LINE__ )( name )
+
+#else
+
+#define PROFILE_ZONE( name )
+
+#endif
+
+}; // namespace AdvancedGraphics
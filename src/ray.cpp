@@ -7,8 +7,21 @@
 Ray::Ray( vec3 o, vec3 d ) :
     origin(o), 
     direction(d),
-    t(INFINITY)
+    t(INFINITY),
+    obj(nullptr),
+    instance(nullptr),
+    light(nullptr)
 {
+    UpdateInverse();
+}
+
+void Ray::UpdateInverse()
+{
+    invdir = vec3(1 / direction.x, 1 / direction.y, 1 / direction.z);
+    // 1 if the ray travels in the negative direction, so the far plane comes first
+    sign[0] = invdir.x < 0;
+    sign[1] = invdir.y < 0;
+    sign[2] = invdir.z < 0;
 }
 
 void Ray::Reflect(vec3 i, vec3 n)
@@ -21,6 +34,7 @@ void Ray::Reflect(vec3 i, vec3 n, float angle)
 	origin = i;
     direction -= 2 * angle * n;
 	t = INFINITY;
+    UpdateInverse();
 }
 
 vec3 Ray::CalculateOffset(float epsilon)
@@ -7,13 +7,25 @@ class Primitive; // Forward declaration
 
 namespace AdvancedGraphics {
 
+struct Instance; // Forward declarations
+struct Light;
+
 struct Ray
 {
 	vec3 origin, direction;
     float t;
     Primitive *obj;
-
+    // Instance of the mesh obj belongs to, nullptr for objects placed directly in the scene
+    Instance *instance;
+    // Set instead of obj when the closest hit is a light
+    Light *light;
+    // Cached for the slab tests in BVH traversal, kept up to date with direction.
+    vec3 invdir;
+    uint sign[3];
+
+    Ray() = default;
     Ray( vec3 o, vec3 d );
+    void UpdateInverse();
 
     void Reflect(vec3 i, vec3 n);
     void Reflect(vec3 i, vec3 n, float angle);
@@ -0,0 +1,55 @@
+#include "precomp.h" // include (only) this in every .cpp file
+#include "renderer.h"
+
+using namespace AdvancedGraphics;
+
+Renderer::Renderer( int width, int height ) :
+	width( width ),
+	height( height ),
+	ownSurface( new Surface( width, height ) ),
+	surface( ownSurface.get() )
+{
+	surface->Clear( 0 );
+}
+
+Renderer::Renderer( Surface *target ) :
+	width( target->GetWidth() ),
+	height( target->GetHeight() ),
+	surface( target )
+{
+}
+
+Renderer::~Renderer()
+{
+	if ( loaded )
+		game.Shutdown();
+}
+
+bool Renderer::Load( const Config &config )
+{
+	assert( !loaded );
+	// Loading a missing scene would exit
+	if ( !config.scene.empty() && !std::ifstream( config.scene ).good() )
+	{
+		std::cerr << "Could not open " << config.scene << std::endl;
+		return false;
+	}
+	game.SetTarget( surface );
+	game.Init( config );
+	loaded = true;
+	return true;
+}
+
+void Renderer::Render( uint samples )
+{
+	for ( uint done = 0; done < samples; done += SamplesPerFrame() )
+		Frame();
+}
+
+void Renderer::Frame()
+{
+	assert( loaded );
+	game.Tick();
+	rays += game.RaysTraced();
+	frames++;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "game.h"
+
+namespace AdvancedGraphics
+{
+
+// The render core without a window or an event loop, to embed the path tracer and for batch jobs:
+//
+//   Renderer renderer( 640, 480 );
+//   if ( !renderer.Load( config ) )
+//       return 1;
+//   renderer.SetCamera( vec3( 0, 1, -5 ), vec3( 0, 0, 1 ), 1.0f );
+//   renderer.Render( 64 );
+//   std::vector<float> rgb( 640 * 480 * 3 );
+//   renderer.ReadImage( rgb.data() );
+//
+// Depends on neither SDL nor OpenGL, the window of main.cpp is a client of it like the headless tool.
+class Renderer
+{
+  public:
+	// Renders into a surface of its own
+	Renderer( int width, int height );
+	// Renders into the surface of a window, which has to outlive the renderer
+	Renderer( Surface *target );
+	~Renderer();
+
+	// Loads the scene of the config, or the default scene if it has none, with its camera, features and
+	// copies. Only call this once. Returns false if the .obj file does not exist.
+	bool Load( const Config &config );
+
+	// Every call restarts the accumulation, fov is the distance of the screen at a width of 1
+	void SetCamera( const vec3 &position, const vec3 &direction, float fov ) { game.SetCamera( position, direction, fov ); }
+	void SetFeatures( uint features ) { game.SetFeatures( features ); }
+	uint Features() const { return game.Features(); }
+
+	// Renders whole frames until every pixel has at least samples more samples
+	void Render( uint samples );
+	// Renders one frame, for a front end that shows every frame
+	void Frame();
+	// With SSAA every frame takes 4 samples per pixel
+	uint SamplesPerFrame() const { return (game.Features() & FEATURE_SSAA) ? 4 : 1; }
+	// Since Load
+	uint Frames() const { return frames; }
+	uint64 RaysTraced() const { return rays; }
+
+	// The linear radiance, 3 floats per pixel, row by row from the top. Filtered with FEATURE_FILTER.
+	void ReadImage( float *rgb ) const { game.ReadImage( rgb ); }
+	// PNG and the other 8 bit formats get the tone mapped image, EXR and HDR the linear radiance
+	bool SaveImage( const std::string &filename ) { return game.SaveImage( filename ); }
+	// The tone mapped image, with the overlay in the window
+	Surface &Screen() { return *surface; }
+	int Width() const { return width; }
+	int Height() const { return height; }
+
+	// The input of a window moves the camera, keys are the KEY_ values of the game
+	void KeyDown( int key, byte repeat ) { game.KeyDown( key, repeat ); }
+	void KeyUp( int key, byte repeat ) { game.KeyUp( key, repeat ); }
+	void MouseMove( int x, int y ) { game.MouseMove( x, y ); }
+	void MouseUp( int button ) { game.MouseUp( button ); }
+	void MouseDown( int button ) { game.MouseDown( button ); }
+
+	#ifdef TRAVERSALSTATS
+	// What tracing the rays of the last frame cost, summed over the threads
+	const TraversalStats &FrameTraversalStats() const { return game.FrameTraversalStats(); }
+	#endif
+	#ifdef CONVERGENCEBENCHMARK
+	// Prints the RMSE of every sampler against a reference, see Game::ConvergenceBenchmark
+	void ConvergenceBenchmark() { game.ConvergenceBenchmark(); }
+	#endif
+
+  private:
+	int width, height;
+	// Set if the surface is our own
+	std::unique_ptr<Surface> ownSurface;
+	Surface *surface;
+	Game game;
+	bool loaded = false;
+	uint frames = 0;
+	uint64 rays = 0;
+};
+
+}; // namespace AdvancedGraphics
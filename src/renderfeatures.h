@@ -0,0 +1,45 @@
+#pragma once
+
+namespace AdvancedGraphics
+{
+
+// Features of the renderer that can be switched at runtime. Game::Sample, the functions that call
+// it and the filter are templates on a mask of these, every combination is compiled and the mask
+// selects a variant once per tile or frame, so a feature costs nothing per ray when it is off.
+#define FEATURE_NEE 1
+#define FEATURE_MIS 2 // Only with FEATURE_NEE
+#define FEATURE_RUSSIANROULETTE 4
+#define FEATURE_SSAA 8
+#define FEATURE_FILTER 16 // Only with KERNEL_SIZE > 0
+// Number of masks
+#define FEATURE_VARIANTS 32
+
+// The features that are defined in precomp.h
+constexpr uint DEFAULT_FEATURES = 0
+#ifdef USENEE
+	| FEATURE_NEE
+#endif
+#ifdef USEMIS
+	| FEATURE_MIS
+#endif
+#ifdef USERUSSIANROULETTE
+	| FEATURE_RUSSIANROULETTE
+#endif
+#ifdef SSAA
+	| FEATURE_SSAA
+#endif
+#if KERNEL_SIZE > 0
+	| FEATURE_FILTER
+#endif
+	;
+
+// The mask without the features that have no effect, so those variants are not compiled twice
+constexpr uint CanonicalFeatures( uint features )
+{
+	return features & ~((features & FEATURE_NEE) ? 0 : FEATURE_MIS) & ~(KERNEL_SIZE > 0 ? 0 : FEATURE_FILTER);
+}
+
+// Names of the features on the command line and in the overlay, in the order of their bits
+static const char *const featureNames[] = {"nee", "mis", "rr", "ssaa", "filter"};
+
+}; // namespace AdvancedGraphics
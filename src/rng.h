@@ -0,0 +1,49 @@
+#pragma once
+
+namespace AdvancedGraphics
+{
+
+// PCG32 random number generator (pcg-random.org). Every path gets its own generator, seeded
+// from its pixel and frame, so the image does not depend on which thread renders a pixel
+// and a frame can be reproduced exactly.
+struct RNG
+{
+  public:
+	uint64 state, inc;
+
+	RNG() = default;
+	// Every pixel has its own stream, the frame selects where in the stream it starts
+	inline RNG( uint pixel, uint frame )
+	{
+		inc = ((uint64)pixel << 1) | 1;
+		state = 0;
+		UInt();
+		state += Hash( frame );
+		UInt();
+	}
+
+	inline uint UInt()
+	{
+		const uint64 old = state;
+		state = old * 6364136223846793005ull + inc;
+		const uint xorshifted = (uint)(((old >> 18) ^ old) >> 27);
+		const uint rot = (uint)(old >> 59);
+		return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+	}
+	// In (0, 1), a bounce with a sample of 0 would have a pdf of 0
+	inline float Float() { return ((UInt() >> 8) + 0.5f) * (1.0f / 16777216.0f); }
+	inline float Range( float range ) { return Float() * range; }
+	// In [0, range)
+	inline uint Index( uint range ) { return std::min( (uint)(Float() * range), range - 1 ); }
+
+  private:
+	// Finalizer of splitmix64, spreads consecutive frame numbers over the whole state
+	static inline uint64 Hash( uint64 x )
+	{
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+		return x ^ (x >> 31);
+	}
+};
+
+}; // namespace AdvancedGraphics
@@ -0,0 +1,132 @@
+#include "precomp.h" // include (only) this in every .cpp file
+#include "sampler.h"
+
+float Sampler::blueNoise[BLUENOISESIZE * BLUENOISESIZE];
+uint Sampler::sobolTable[4][256];
+
+Sampler::Sampler( uint type, uint x, uint y, uint index, uint seed ) :
+	type( type ), x( x ), y( y ), reversedIndex( ReverseBits( index ) )
+{
+	const uint pixel = Hash( x + Hash( y + Hash( seed ) ) );
+	// The blue-noise mask decorrelates the pixels, so they all use the same points
+	scramble = type == SAMPLER_BLUENOISE ? Hash( seed ) : pixel;
+	if ( type == SAMPLER_RANDOM )
+		rng = RNG( pixel, index );
+}
+
+void Sampler::Init()
+{
+	// Bit k of the index flips the direction number d_k, with d_0 = 1 and d_k+1 = d_k ^ (d_k << 1) when reversed
+	uint directions[32];
+	directions[0] = 1;
+	for ( int k = 1; k < 32; k++ )
+		directions[k] = directions[k - 1] ^ (directions[k - 1] << 1);
+	for ( int byte = 0; byte < 4; byte++ )
+		for ( uint i = 0; i < 256; i++ )
+		{
+			uint v = 0;
+			for ( int k = 0; k < 8; k++ )
+				if ( i & (1 << k) )
+					v ^= directions[byte * 8 + k];
+			sobolTable[byte][i] = v;
+		}
+
+	GenerateBlueNoise();
+}
+
+void Sampler::GenerateBlueNoise()
+{
+	const int n = BLUENOISESIZE * BLUENOISESIZE;
+	const float sigma = 1.5f;
+
+	// Gaussian of the toroidal distance, per offset
+	float *kernel = new float[n];
+	for ( int dy = 0; dy < BLUENOISESIZE; dy++ )
+		for ( int dx = 0; dx < BLUENOISESIZE; dx++ )
+		{
+			const int ex = std::min( dx, BLUENOISESIZE - dx ), ey = std::min( dy, BLUENOISESIZE - dy );
+			kernel[dy * BLUENOISESIZE + dx] = expf( -(ex * ex + ey * ey) / (2 * sigma * sigma) );
+		}
+
+	// The energy of a pixel is the sum of the kernel over the set pixels
+	bool *pattern = new bool[n], *prototype = new bool[n];
+	float *energy = new float[n], *prototypeEnergy = new float[n];
+	uint *ranks = new uint[n];
+	auto Splat = [&]( int p, float sign ) {
+		const int px = p % BLUENOISESIZE, py = p / BLUENOISESIZE;
+		for ( int q = 0; q < n; q++ )
+		{
+			const int dx = (q % BLUENOISESIZE - px) & (BLUENOISESIZE - 1);
+			const int dy = (q / BLUENOISESIZE - py) & (BLUENOISESIZE - 1);
+			energy[q] += sign * kernel[dy * BLUENOISESIZE + dx];
+		}
+		pattern[p] = sign > 0;
+	};
+	// The set pixel with the highest energy, or the empty pixel with the lowest
+	auto TightestCluster = [&]() {
+		int best = -1;
+		for ( int p = 0; p < n; p++ )
+			if ( pattern[p] && (best < 0 || energy[p] > energy[best]) )
+				best = p;
+		return best;
+	};
+	auto LargestVoid = [&]() {
+		int best = -1;
+		for ( int p = 0; p < n; p++ )
+			if ( !pattern[p] && (best < 0 || energy[p] < energy[best]) )
+				best = p;
+		return best;
+	};
+
+	// Initial pattern: a tenth of the pixels at random, spread out until it is stable
+	for ( int p = 0; p < n; p++ )
+		pattern[p] = false, energy[p] = 0;
+	RNG rng( 0, 0 );
+	int ones = 0;
+	while ( ones < n / 10 )
+	{
+		const int p = rng.Index( n );
+		if ( !pattern[p] )
+			Splat( p, 1 ), ones++;
+	}
+	while ( true )
+	{
+		const int cluster = TightestCluster();
+		Splat( cluster, -1 );
+		const int hole = LargestVoid();
+		Splat( hole, 1 );
+		if ( hole == cluster )
+			break;
+	}
+	memcpy( prototype, pattern, n * sizeof( bool ) );
+	memcpy( prototypeEnergy, energy, n * sizeof( float ) );
+
+	// Rank the pixels of the initial pattern by removing the tightest clusters first
+	for ( int rank = ones - 1; rank >= 0; rank-- )
+	{
+		const int cluster = TightestCluster();
+		Splat( cluster, -1 );
+		ranks[cluster] = rank;
+	}
+
+	// Rank the others by filling the largest voids. Once more than half is set, the tightest cluster of empty
+	// pixels is the one with the lowest energy as well, as the energies of the set and empty pixels add up to a constant.
+	memcpy( pattern, prototype, n * sizeof( bool ) );
+	memcpy( energy, prototypeEnergy, n * sizeof( float ) );
+	for ( int rank = ones; rank < n; rank++ )
+	{
+		const int hole = LargestVoid();
+		Splat( hole, 1 );
+		ranks[hole] = rank;
+	}
+
+	for ( int p = 0; p < n; p++ )
+		blueNoise[p] = (ranks[p] + 0.5f) * (1.0f / n);
+
+	delete[] kernel;
+	delete[] pattern;
+	delete[] prototype;
+	delete[] energy;
+	delete[] prototypeEnergy;
+	delete[] ranks;
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include "vectors.h"
+#include "rng.h"
+
+namespace AdvancedGraphics
+{
+
+// Values of SAMPLER, see precomp.h
+#define SAMPLER_RANDOM 0
+#define SAMPLER_SOBOL 1
+#define SAMPLER_BLUENOISE 2
+
+// Dimensions of the samples of one bounce. Dimensions 2n and 2n + 1 form a stratified 2D pattern.
+#define SAMPLE_PIXEL 0 // 2D, only used by the primary ray
+#define SAMPLE_BRDF 2 // 2D
+#define SAMPLE_LIGHTPOINT 4 // 2D
+#define SAMPLE_SPECULAR 6
+#define SAMPLE_LIGHT 7
+#define SAMPLE_ROULETTE 8
+#define SAMPLE_DIMENSIONS 10
+
+// Width and height of the blue-noise mask, a power of 2. The mask is tiled over the screen.
+#define BLUENOISESIZE 64
+
+// The random numbers of one path. Every random decision of a bounce has a dimension of its own,
+// so sample n of a pixel gets point n of every dimension, whichever branches the path took.
+//  - SAMPLER_RANDOM: independent random numbers of an RNG
+//  - SAMPLER_SOBOL: Owen-scrambled Sobol points (Burley 2020, "Practical Hash-based Owen
+//    Scrambling"), every pair of dimensions and every pixel is scrambled independently
+//  - SAMPLER_BLUENOISE: the same scrambled Sobol points for every pixel, shifted per pixel by a
+//    blue-noise mask (Georgiev and Fajardo 2016, "Blue-noise Dithered Sampling"), so the error
+//    of neighbouring pixels is spread as blue noise
+struct Sampler
+{
+  public:
+	Sampler() = default;
+	// Sample index of pixel (x, y). Samplers with a different seed are independent of each other.
+	Sampler( uint type, uint x, uint y, uint index, uint seed = 0 );
+
+	inline float Get1D( uint depth, uint dimension )
+	{
+		if ( type == SAMPLER_RANDOM )
+			return rng.Float();
+		const uint pair = depth * SAMPLE_DIMENSIONS + (dimension & ~1u);
+		const uint seed = Hash( scramble ^ (pair * 0x9e3779b9u) );
+		return Component( ShuffledIndex( seed ), seed, pair + (dimension & 1) );
+	}
+	inline vec2 Get2D( uint depth, uint dimension )
+	{
+		if ( type == SAMPLER_RANDOM )
+		{
+			const float u = rng.Float();
+			return vec2( u, rng.Float() );
+		}
+		const uint pair = depth * SAMPLE_DIMENSIONS + dimension;
+		const uint seed = Hash( scramble ^ (pair * 0x9e3779b9u) );
+		// Both dimensions use the same shuffled index, that keeps them stratified together
+		const uint i = ShuffledIndex( seed );
+		return vec2( Component( i, seed, pair ), Component( i, seed, pair + 1 ) );
+	}
+	// In [0, range)
+	inline uint GetIndex( uint depth, uint dimension, uint range )
+	{
+		return std::min( (uint)(Get1D( depth, dimension ) * range), range - 1 );
+	}
+
+	// Generates the tables of the samplers, call this once before sampling
+	static void Init();
+
+  private:
+	uint type, x, y;
+	// Sample index, bit reversed
+	uint reversedIndex;
+	// Seed of the scrambling, per pixel for SAMPLER_SOBOL
+	uint scramble;
+	RNG rng;
+
+	// Ranks of the blue-noise mask, in [0, 1)
+	static float blueNoise[BLUENOISESIZE * BLUENOISESIZE];
+	// The second Sobol dimension in reversed bit order, per byte of the index
+	static uint sobolTable[4][256];
+
+	// Generates the mask of SAMPLER_BLUENOISE with void-and-cluster (Ulichney 1993)
+	static void GenerateBlueNoise();
+
+	// Nested uniform scramble of the sample index, so every pair of dimensions visits the points in another order
+	inline uint ShuffledIndex( uint seed ) const { return ReverseBits( LaineKarras( reversedIndex, seed ) ); }
+
+	// Scrambled coordinate of the Sobol point with the shuffled index i, dimension is the global one
+	inline float Component( uint i, uint seed, uint dimension ) const
+	{
+		// The first two Sobol dimensions: the van der Corput sequence and its (0, 2) partner.
+		// Both are in reversed bit order here, which is the order the scrambling works in.
+		uint v = i;
+		if ( dimension & 1 )
+			v = sobolTable[0][i & 255] ^ sobolTable[1][(i >> 8) & 255] ^ sobolTable[2][(i >> 16) & 255] ^ sobolTable[3][i >> 24];
+		v = ReverseBits( LaineKarras( v, Hash( seed + 1 + (dimension & 1) ) ) );
+		float u = ((v >> 8) + 0.5f) * (1.0f / 16777216.0f);
+		if ( type == SAMPLER_BLUENOISE )
+		{
+			// Every dimension uses the mask at another offset
+			const uint offset = Hash( dimension );
+			u += blueNoise[((y + (offset >> 8)) & (BLUENOISESIZE - 1)) * BLUENOISESIZE + ((x + offset) & (BLUENOISESIZE - 1))];
+			if ( u >= 1.0f )
+				u -= 1.0f;
+			u = std::max( u, 0.5f / 16777216.0f );
+		}
+		return u;
+	}
+
+	static inline uint Hash( uint x )
+	{
+		x = (x ^ (x >> 16)) * 0x7feb352du;
+		x = (x ^ (x >> 15)) * 0x846ca68bu;
+		return x ^ (x >> 16);
+	}
+	static inline uint ReverseBits( uint x )
+	{
+		x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+		x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+		x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+		#ifdef _MSC_VER
+		return _byteswap_ulong( x );
+		#else
+		return __builtin_bswap32( x );
+		#endif
+	}
+	// Permutes x such that every bit only depends on the bits below it (Laine and Karras 2011)
+	static inline uint LaineKarras( uint x, uint seed )
+	{
+		x += seed;
+		x ^= x * 0x6c50b47cu;
+		x ^= x * 0xb82f1e52u;
+		x ^= x * 0xc7afe638u;
+		x ^= x * 0x8d22f6e6u;
+		return x;
+	}
+};
+
+}; // namespace AdvancedGraphics
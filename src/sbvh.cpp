@@ -0,0 +1,343 @@
+#include "precomp.h" // include (only) this in every .cpp file
+#include "bvh.h"
+
+#ifdef USESBVH
+
+#if BVHBINS < 3
+#error "Spatial splits extend the binned build, use BVHBINS > 2"
+#endif
+
+// Spatial splits are only tried when the children of the best object split
+// overlap by more than this fraction of the surface area of the root.
+#define SBVHALPHA 1e-5f
+// Spatial splits are binned on all three axes, with more bins than object splits,
+// since clipping makes the bin boundaries the actual split planes.
+#define SBVHBINS 32
+
+namespace AdvancedGraphics
+{
+
+// A triangle, or the part of it that is left after spatial splits
+struct SBVHReference
+{
+	aabb bounds;
+	uint triangle;
+};
+
+struct SBVHBuild
+{
+	float rootArea;
+	// References in the tree so far, this may not exceed max_references
+	std::atomic<uint> nr_references;
+	uint max_references;
+	// Next free entry in BVH::indices
+	std::atomic<uint> nr_indices;
+};
+
+}; // namespace AdvancedGraphics
+
+struct SBVHSplit
+{
+	float cost;
+	bool spatial = false;
+	int axis, bin = -1; // split after this bin
+	float edgeMin, binLength;
+	aabb left, right;
+};
+
+inline int ClampBin( int bin, int nr_bins )
+{
+	return std::min( std::max( bin, 0 ), nr_bins - 1 );
+}
+
+inline bool IsEmpty( const aabb &bb )
+{
+	return bb.bmin[0] > bb.bmax[0] || bb.bmin[1] > bb.bmax[1] || bb.bmin[2] > bb.bmax[2];
+}
+
+// Bounds of the part of a triangle between the planes lo and hi on the given axis
+aabb ClipTriangle( const Triangle *tri, int axis, float lo, float hi )
+{
+	aabb bb;
+	bb.Reset();
+	const vec3 v[3] = {tri->p0, tri->p1, tri->p2};
+	for ( int i = 0; i < 3; i++ )
+	{
+		const vec3 &a = v[i], &b = v[(i + 1) % 3];
+		float pa = a.cell[axis], pb = b.cell[axis];
+		if ( pa >= lo && pa <= hi )
+			bb.Grow( a );
+		// Points where the edge crosses the planes
+		const float planes[2] = {lo, hi};
+		for ( float plane : planes )
+		{
+			if ( (pa < plane && plane < pb) || (pb < plane && plane < pa) )
+			{
+				vec3 p = a + (b - a) * ((plane - pa) / (pb - pa));
+				p.cell[axis] = plane;
+				bb.Grow( p );
+			}
+		}
+	}
+	return bb;
+}
+
+// Binned SAH over the reference centers on the longest axis, like Subdivide_Binned
+void FindObjectSplit( const std::vector<SBVHReference> &refs, SBVHSplit &split )
+{
+	aabb centers;
+	centers.Reset();
+	for ( const SBVHReference &ref : refs )
+		centers.Grow( ref.bounds.Center() );
+	int axis = centers.LongestAxis();
+	float edgeMin = centers.bmin[axis];
+	float binLength = centers.Extend( axis ) / BVHBINS;
+	if ( binLength <= 1e-3 )
+		return;
+
+	uint counts[BVHBINS] = {};
+	aabb boxes[BVHBINS];
+	for ( int b = 0; b < BVHBINS; b++ )
+		boxes[b].Reset();
+	for ( const SBVHReference &ref : refs )
+	{
+		int bin = ClampBin( (ref.bounds.Center( axis ) - edgeMin) / binLength, BVHBINS );
+		counts[bin]++;
+		boxes[bin].Grow( ref.bounds );
+	}
+
+	// Sweep from the right first, so the left sweep can evaluate every split plane
+	aabb rightBoxes[BVHBINS];
+	uint rightCounts[BVHBINS];
+	rightBoxes[BVHBINS - 1] = boxes[BVHBINS - 1];
+	rightCounts[BVHBINS - 1] = counts[BVHBINS - 1];
+	for ( int b = BVHBINS - 2; b > 0; b-- )
+	{
+		rightBoxes[b] = aabb::Union( rightBoxes[b + 1], boxes[b] );
+		rightCounts[b] = rightCounts[b + 1] + counts[b];
+	}
+
+	aabb leftBox;
+	leftBox.Reset();
+	uint leftCount = 0;
+	for ( int b = 0; b < BVHBINS - 1; b++ )
+	{
+		leftBox.Grow( boxes[b] );
+		leftCount += counts[b];
+		if ( leftCount == 0 || rightCounts[b + 1] == 0 )
+			continue;
+		float cost = leftBox.Area() * leftCount + rightBoxes[b + 1].Area() * rightCounts[b + 1];
+		if ( cost < split.cost )
+		{
+			split.cost = cost;
+			split.spatial = false;
+			split.axis = axis, split.bin = b;
+			split.edgeMin = edgeMin, split.binLength = binLength;
+			split.left = leftBox, split.right = rightBoxes[b + 1];
+		}
+	}
+}
+
+// Binned SAH over planes that cut through the references
+void FindSpatialSplit( const Triangle *triangles, const aabb &bounds, const std::vector<SBVHReference> &refs, SBVHSplit &split )
+{
+	for ( int axis = 0; axis < 3; axis++ )
+	{
+		float edgeMin = bounds.bmin[axis];
+		float binLength = bounds.Extend( axis ) / SBVHBINS;
+		if ( binLength <= 1e-3 )
+			continue;
+
+		// A reference enters the bin of its minimum and exits the bin of its maximum,
+		// it is clipped to every bin in between.
+		uint entries[SBVHBINS] = {}, exits[SBVHBINS] = {};
+		aabb boxes[SBVHBINS];
+		for ( int b = 0; b < SBVHBINS; b++ )
+			boxes[b].Reset();
+		for ( const SBVHReference &ref : refs )
+		{
+			int first = ClampBin( (ref.bounds.bmin[axis] - edgeMin) / binLength, SBVHBINS );
+			int last = ClampBin( (ref.bounds.bmax[axis] - edgeMin) / binLength, SBVHBINS );
+			entries[first]++;
+			exits[last]++;
+			if ( first == last )
+			{
+				boxes[first].Grow( ref.bounds );
+				continue;
+			}
+			for ( int b = first; b <= last; b++ )
+			{
+				float lo = edgeMin + b * binLength;
+				aabb part = ClipTriangle( triangles + ref.triangle, axis, lo, lo + binLength ).Intersection( ref.bounds );
+				if ( !IsEmpty( part ) )
+					boxes[b].Grow( part );
+			}
+		}
+
+		aabb rightBoxes[SBVHBINS];
+		uint rightCounts[SBVHBINS];
+		rightBoxes[SBVHBINS - 1] = boxes[SBVHBINS - 1];
+		rightCounts[SBVHBINS - 1] = exits[SBVHBINS - 1];
+		for ( int b = SBVHBINS - 2; b > 0; b-- )
+		{
+			rightBoxes[b] = aabb::Union( rightBoxes[b + 1], boxes[b] );
+			rightCounts[b] = rightCounts[b + 1] + exits[b];
+		}
+
+		aabb leftBox;
+		leftBox.Reset();
+		uint leftCount = 0;
+		for ( int b = 0; b < SBVHBINS - 1; b++ )
+		{
+			leftBox.Grow( boxes[b] );
+			leftCount += entries[b];
+			if ( leftCount == 0 || rightCounts[b + 1] == 0 )
+				continue;
+			float cost = leftBox.Area() * leftCount + rightBoxes[b + 1].Area() * rightCounts[b + 1];
+			if ( cost < split.cost )
+			{
+				split.cost = cost;
+				split.spatial = true;
+				split.axis = axis, split.bin = b;
+				split.edgeMin = edgeMin, split.binLength = binLength;
+				split.left = leftBox, split.right = rightBoxes[b + 1];
+			}
+		}
+	}
+}
+
+// Moves the references to the sides of the split, references that straddle a spatial split end up in both
+void Partition( const Triangle *triangles, const SBVHSplit &split, const std::vector<SBVHReference> &refs, std::vector<SBVHReference> &left, std::vector<SBVHReference> &right )
+{
+	const int axis = split.axis;
+	for ( const SBVHReference &ref : refs )
+	{
+		if ( !split.spatial )
+		{
+			// The same bin computation as during binning, so both agree
+			int bin = ClampBin( (ref.bounds.Center( axis ) - split.edgeMin) / split.binLength, BVHBINS );
+			(bin <= split.bin ? left : right).push_back( ref );
+			continue;
+		}
+
+		int first = ClampBin( (ref.bounds.bmin[axis] - split.edgeMin) / split.binLength, SBVHBINS );
+		int last = ClampBin( (ref.bounds.bmax[axis] - split.edgeMin) / split.binLength, SBVHBINS );
+		if ( last <= split.bin )
+			left.push_back( ref );
+		else if ( first > split.bin )
+			right.push_back( ref );
+		else
+		{
+			float plane = split.edgeMin + (split.bin + 1) * split.binLength;
+			const Triangle *tri = triangles + ref.triangle;
+			aabb leftPart = ClipTriangle( tri, axis, ref.bounds.bmin[axis], plane ).Intersection( ref.bounds );
+			aabb rightPart = ClipTriangle( tri, axis, plane, ref.bounds.bmax[axis] ).Intersection( ref.bounds );
+			if ( !IsEmpty( leftPart ) )
+				left.push_back( {leftPart, ref.triangle} );
+			if ( !IsEmpty( rightPart ) )
+				right.push_back( {rightPart, ref.triangle} );
+		}
+	}
+}
+
+void BVHNode::Subdivide_Spatial( BVH *bvh, SBVHBuild &build, std::vector<SBVHReference> &refs )
+{
+	const uint n = refs.size();
+	std::vector<SBVHReference> leftRefs, rightRefs;
+	bool reserved = false;
+	bool spatial = false;
+
+	// Max number of primitives per leaf
+	if ( n > BVHLEAFSIZE && bvh->nr_nodes + 2 <= bvh->nr_nodes_max )
+	{
+		SBVHSplit split;
+		split.cost = Bounds().Area() * n;
+		FindObjectSplit( refs, split );
+
+		// Spatial splits only pay off when the object split children overlap
+		aabb overlap = split.left.Intersection( split.right );
+		if ( split.bin < 0 || (!IsEmpty( overlap ) && overlap.Area() > SBVHALPHA * build.rootArea) )
+		{
+			// Reserve the worst case number of duplicates, so parallel tasks can never exceed the budget
+			reserved = build.nr_references.fetch_add( n ) + n <= build.max_references;
+			if ( reserved )
+				FindSpatialSplit( bvh->triangles, Bounds(), refs, split );
+			else
+				build.nr_references -= n;
+		}
+
+		if ( split.bin >= 0 )
+			Partition( bvh->triangles, split, refs, leftRefs, rightRefs );
+		spatial = split.spatial;
+	}
+
+	bool leaf = leftRefs.empty() || rightRefs.empty();
+	// Other tasks may have used up the pool since the check above, then this node stays a leaf
+	uint leftidx = 0;
+	if ( !leaf && !bvh->AllocateNodePair( leftidx ) )
+		leaf = true;
+	if ( reserved )
+	{
+		// Give back what was reserved, but not duplicated
+		int duplicates = leaf || !spatial ? 0 : (int)(leftRefs.size() + rightRefs.size()) - (int)n;
+		build.nr_references -= n - duplicates;
+	}
+
+	if ( leaf )
+	{
+		count = n;
+		firstleft = build.nr_indices.fetch_add( n );
+		for ( uint i = 0; i < n; i++ )
+			bvh->indices[firstleft + i] = refs[i].triangle;
+		return;
+	}
+	std::vector<SBVHReference>().swap( refs );
+
+	BVHNode *left = &bvh->pool[leftidx];
+	BVHNode *right = &bvh->pool[leftidx + 1];
+
+	aabb leftBox, rightBox;
+	leftBox.Reset(), rightBox.Reset();
+	for ( const SBVHReference &ref : leftRefs )
+		leftBox.Grow( ref.bounds );
+	for ( const SBVHReference &ref : rightRefs )
+		rightBox.Grow( ref.bounds );
+	left->SetBounds( leftBox );
+	right->SetBounds( rightBox );
+
+	this->count = 0;
+	this->firstleft = leftidx;
+
+	// Go in recursion on both child nodes, large ones as separate tasks
+	#pragma omp task shared( build, leftRefs ) if ( leftRefs.size() > BVHTASKSIZE )
+	left->Subdivide_Spatial( bvh, build, leftRefs );
+	#pragma omp task shared( build, rightRefs ) if ( rightRefs.size() > BVHTASKSIZE )
+	right->Subdivide_Spatial( bvh, build, rightRefs );
+	// The references live on this stack frame
+	#pragma omp taskwait
+}
+
+void BVH::ConstructSpatial( const aabb *triangle_bounds )
+{
+	SBVHBuild build;
+	build.rootArea = root->Bounds().Area();
+	build.nr_references = nr_triangles;
+	build.max_references = MaxIndices( nr_triangles );
+	build.nr_indices = 0;
+
+	std::vector<SBVHReference> refs( nr_triangles );
+	for ( uint t = 0; t < nr_triangles; t++ )
+		refs[t] = {triangle_bounds[t], t};
+
+	// The build tasks are spawned from a single thread, the others pick them up.
+	#pragma omp parallel
+	#pragma omp single
+	{
+		build_threads = omp_get_num_threads();
+		root->Subdivide_Spatial( this, build, refs );
+	}
+	nr_indices = build.nr_indices;
+	printf( "Spatial splits: %u references to %u triangles\n", nr_indices, nr_triangles );
+}
+
+#endif
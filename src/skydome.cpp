@@ -69,6 +69,11 @@ SkyDome::SkyDome() : width(0), height(0), pixels(nullptr)
 	f_bin.close();
 }
 
+SkyDome::~SkyDome()
+{
+	FREE64( pixels );
+}
+
 Color SkyDome::FindColor(vec3 direction)
 {
     float u = 1 + atan2f( direction.x, -direction.z ) * INVPI;
@@ -11,5 +11,6 @@ struct SkyDome
     Color* pixels;
 
     SkyDome();
+    ~SkyDome();
     Color FindColor(vec3 direction);
 };
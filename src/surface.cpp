@@ -31,7 +31,7 @@ Surface::Surface( int a_Width, int a_Height ) :
 	m_Height( a_Height ),
 	m_Pitch( a_Width )
 {
-	m_Buffer = (Pixel*)MALLOC64( a_Width * a_Height * sizeof( Pixel ) );
+	m_Buffer = (Pixel*)MALLOC64( (size_t)a_Width * a_Height * sizeof( Pixel ) );
 	m_Flags = OWNER;
 }
 
@@ -61,7 +61,7 @@ void Surface::LoadImage( const char *a_File )
 	FreeImage_Unload( tmp );
 	m_Width = m_Pitch = FreeImage_GetWidth( dib );
 	m_Height = FreeImage_GetHeight( dib );
-	m_Buffer = (Pixel*)MALLOC64( m_Width * m_Height * sizeof( Pixel ) );
+	m_Buffer = (Pixel*)MALLOC64( (size_t)m_Width * m_Height * sizeof( Pixel ) );
 	m_Flags = OWNER;
 	for( int y = 0; y < m_Height; y++)
 	{
@@ -99,13 +99,16 @@ void Surface::Print( const char *a_String, int x1, int y1, Pixel color )
 		InitCharset();
 		fontInitialized = true;
 	}
-	Pixel* t = m_Buffer + x1 + y1 * m_Pitch;
-	for ( int i = 0; i < (int)(strlen( a_String )); i++, t += 6 )
+	// A character is 5 pixels wide and 6 high with its shadow, the ones that do not fit are skipped
+	if (y1 < 0 || y1 + 6 > m_Height) return;
+	Pixel* t = m_Buffer + y1 * m_Pitch;
+	for ( int i = 0, x = x1; i < (int)(strlen( a_String )); i++, x += 6 )
 	{
+		if (x < 0 || x + 5 > m_Width) continue;
 		int pos = 0;
 		if ((a_String[i] >= 'A') && (a_String[i] <= 'Z')) pos = s_Transl[(unsigned short)(a_String[i] - ('A' - 'a'))];
 													 else pos = s_Transl[(unsigned short)a_String[i]];
-		Pixel* a = t;
+		Pixel* a = t + x;
 		const char *c = (const char *)s_Font[pos];
 		for ( int v = 0; v < 5; v++, c++, a += m_Pitch )
 			for ( int h = 0; h < 5; h++ ) if (*c++ == 'o') *(a + h) = color, *(a + h + m_Pitch) = 0;
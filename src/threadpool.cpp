@@ -0,0 +1,111 @@
+#include "precomp.h" // include (only) this in every .cpp file
+#include "threadpool.h"
+
+ThreadPool::ThreadPool( uint threads ) :
+	nr_threads( threads > 0 ? threads : std::max( 1u, std::thread::hardware_concurrency() ) ),
+	queues( nr_threads )
+{
+	for ( uint i = 0; i + 1 < nr_threads; i++ )
+		workers.emplace_back( &ThreadPool::WorkerLoop, this, i );
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock( mutex );
+		stop = true;
+	}
+	wake.notify_all();
+	for ( std::thread &worker : workers )
+		worker.join();
+}
+
+void ThreadPool::ParallelFor( uint count, const std::function<void( uint )> &task )
+{
+	if ( count == 0 )
+		return;
+	if ( nr_threads == 1 )
+	{
+		for ( uint i = 0; i < count; i++ )
+			task( i );
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock( mutex );
+		this->task = &task;
+		remaining = count;
+		// Consecutive tasks go to the same thread, neighbouring tiles share cache lines
+		for ( uint q = 0; q < nr_threads; q++ )
+		{
+			std::lock_guard<std::mutex> queueLock( queues[q].mutex );
+			for ( uint i = (uint64)count * q / nr_threads; i < (uint64)count * (q + 1) / nr_threads; i++ )
+				queues[q].tasks.push_back( i );
+		}
+		generation++;
+	}
+	wake.notify_all();
+
+	RunTasks( nr_threads - 1 );
+	std::unique_lock<std::mutex> lock( mutex );
+	finished.wait( lock, [this] { return remaining == 0; } );
+}
+
+void ThreadPool::WorkerLoop( uint index )
+{
+	uint64 seen = 0;
+	while ( true )
+	{
+		{
+			std::unique_lock<std::mutex> lock( mutex );
+			wake.wait( lock, [&] { return stop || generation != seen; } );
+			if ( stop )
+				return;
+			seen = generation;
+		}
+		RunTasks( index );
+	}
+}
+
+void ThreadPool::RunTasks( uint index )
+{
+	uint t, done = 0;
+	while ( Pop( index, t ) || Steal( index, t ) )
+	{
+		(*task)( t );
+		done++;
+	}
+	if ( done == 0 )
+		return;
+	std::lock_guard<std::mutex> lock( mutex );
+	remaining -= done;
+	if ( remaining == 0 )
+		finished.notify_all();
+}
+
+bool ThreadPool::Pop( uint index, uint &t )
+{
+	Queue &queue = queues[index];
+	std::lock_guard<std::mutex> lock( queue.mutex );
+	if ( queue.tasks.empty() )
+		return false;
+	t = queue.tasks.front();
+	queue.tasks.pop_front();
+	return true;
+}
+
+bool ThreadPool::Steal( uint index, uint &t )
+{
+	// Start at the next thread, so the thieves spread over the victims
+	for ( uint i = 1; i < nr_threads; i++ )
+	{
+		Queue &queue = queues[(index + i) % nr_threads];
+		std::lock_guard<std::mutex> lock( queue.mutex );
+		if ( queue.tasks.empty() )
+			continue;
+		t = queue.tasks.back();
+		queue.tasks.pop_back();
+		return true;
+	}
+	return false;
+}
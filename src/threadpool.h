@@ -0,0 +1,46 @@
+#pragma once
+
+namespace AdvancedGraphics
+{
+
+// Persistent worker threads for the render loops. Every thread owns a deque of task indices:
+// it takes its own tasks from the front, and when it runs out it steals from the back of
+// the deque of another thread, so uneven tiles do not leave threads idle.
+class ThreadPool
+{
+  public:
+	// With 0 threads the pool uses all hardware threads. The calling thread counts as one of them.
+	ThreadPool( uint threads = 0 );
+	~ThreadPool();
+
+	inline uint Size() const { return nr_threads; }
+	// Runs task( i ) for every i in [0, count), returns when all of them are done
+	void ParallelFor( uint count, const std::function<void( uint )> &task );
+
+  private:
+	struct Queue
+	{
+		std::mutex mutex;
+		std::deque<uint> tasks;
+	};
+
+	uint nr_threads;
+	std::vector<std::thread> workers;
+	// One per thread, the calling thread uses the last one
+	std::vector<Queue> queues;
+
+	const std::function<void( uint )> *task = nullptr;
+	std::mutex mutex;
+	std::condition_variable wake, finished;
+	uint64 generation = 0;
+	uint remaining = 0;
+	bool stop = false;
+
+	void WorkerLoop( uint index );
+	// Runs the tasks of queue index, and then tasks stolen from the others, until all queues are empty
+	void RunTasks( uint index );
+	bool Pop( uint index, uint &t );
+	bool Steal( uint index, uint &t );
+};
+
+}; // namespace AdvancedGraphics
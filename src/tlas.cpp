@@ -0,0 +1,382 @@
+#include "precomp.h" // include (only) this in every .cpp file
+#include "tlas.h"
+
+Instance::Instance( BVH *bvh, const mat4 &transform ) :
+	bvh( bvh )
+{
+	SetTransform( transform );
+}
+
+void Instance::SetTransform( const mat4 &m )
+{
+	transform = m;
+	inverse = m.inverted();
+
+	// Bounds of the 8 transformed corners of the mesh bounds
+	const aabb b = bvh->root->Bounds();
+	bounds.Reset();
+	for ( int i = 0; i < 8; i++ )
+	{
+		vec3 corner( i & 1 ? b.bmax[0] : b.bmin[0], i & 2 ? b.bmax[1] : b.bmin[1], i & 4 ? b.bmax[2] : b.bmin[2] );
+		bounds.Grow( transform.TransformPoint( corner ) );
+	}
+}
+
+vec3 Instance::NormalToWorld( const vec3 &n ) const
+{
+	const float *c = inverse.cell;
+	return vec3( c[0] * n.x + c[4] * n.y + c[8] * n.z,
+		c[1] * n.x + c[5] * n.y + c[9] * n.z,
+		c[2] * n.x + c[6] * n.y + c[10] * n.z ).normalized();
+}
+
+bool Instance::Traverse( Ray *r, uint &depth, bool checkOcclusion )
+{
+	// The direction is not normalized, so distances along the ray are the same in both spaces
+	Ray local( inverse.TransformPoint( r->origin ), inverse.TransformVector( r->direction ) );
+	local.t = r->t;
+	if ( checkOcclusion )
+		return bvh->Occludes( &local );
+	if ( !bvh->Intersect( &local, depth ) )
+		return false;
+	r->t = local.t;
+	r->obj = local.obj;
+	r->instance = this;
+	r->light = nullptr;
+	return true;
+}
+
+void Instance::TraversePacket( RayPacket &packet, uint first, uint last, bool checkOcclusion )
+{
+	Ray local[MAXPACKETRAYS];
+	bool occluded[MAXPACKETRAYS];
+	const uint count = last - first;
+	for ( uint i = 0; i < count; i++ )
+	{
+		const Ray &r = packet.rays[first + i];
+		local[i] = Ray( inverse.TransformPoint( r.origin ), inverse.TransformVector( r.direction ) );
+		local[i].t = r.t;
+		occluded[i] = packet.Done( first + i );
+	}
+
+	RayPacket localPacket( local, count, checkOcclusion ? occluded : nullptr );
+	bvh->TraversePacket( localPacket, checkOcclusion );
+	for ( uint i = 0; i < count; i++ )
+	{
+		Ray &r = packet.rays[first + i];
+		if ( checkOcclusion )
+			packet.occluded[first + i] = occluded[i];
+		else if ( local[i].obj != nullptr )
+		{
+			r.t = local[i].t;
+			r.obj = local[i].obj;
+			r.instance = this;
+			r.light = nullptr;
+		}
+	}
+}
+
+TLAS::TLAS( Instance *instances, uint instanceCount, Sphere *spheres, uint sphereCount, Light **lights, uint lightCount ) :
+	instances( instances ),
+	nr_instances( instanceCount ),
+	spheres( spheres ),
+	nr_spheres( sphereCount ),
+	lights( lights ),
+	nr_lights( lightCount ),
+	nr_primitives( instanceCount + sphereCount + lightCount )
+{
+	// Like the BVH, the root is at index 1 so siblings share a cache line
+	pool = (BVHNode *)MALLOC64( std::max( 2u, nr_primitives * 2 ) * sizeof( BVHNode ) );
+	indices = new uint[nr_primitives];
+	bounds = new aabb[nr_primitives];
+}
+
+TLAS::~TLAS()
+{
+	FREE64( pool );
+	delete[] indices;
+	delete[] bounds;
+}
+
+void TLAS::Build()
+{
+	for ( uint i = 0; i < nr_instances; i++ )
+		bounds[i] = instances[i].bounds;
+	for ( uint i = 0; i < nr_spheres; i++ )
+		bounds[nr_instances + i] = spheres[i].Bounds();
+	for ( uint i = 0; i < nr_lights; i++ )
+		bounds[nr_instances + nr_spheres + i] = lights[i]->Bounds();
+
+	for ( uint i = 0; i < nr_primitives; i++ )
+		indices[i] = i;
+	nr_nodes = 2;
+	nr_levels = 0;
+	if ( nr_primitives > 0 )
+		Subdivide( 1, 0, nr_primitives, 1 );
+}
+
+void TLAS::Subdivide( uint index, uint first, uint count, uint level )
+{
+	nr_levels = std::max( nr_levels, level );
+	aabb nodeBounds, centers;
+	nodeBounds.Reset();
+	centers.Reset();
+	for ( uint i = first; i < first + count; i++ )
+	{
+		nodeBounds.Grow( bounds[indices[i]] );
+		centers.Grow( bounds[indices[i]].Center() );
+	}
+	BVHNode &node = pool[index];
+	node.bmin4 = nodeBounds.bmin4, node.bmax4 = nodeBounds.bmax4;
+
+	// Every primitive gets its own leaf, since traversing an instance is expensive
+	if ( count == 1 )
+	{
+		node.firstleft = first;
+		node.count = 1;
+		return;
+	}
+
+	// There are few primitives, so sort them and sweep for the best SAH split
+	const int axis = centers.LongestAxis();
+	std::sort( indices + first, indices + first + count, [&]( uint a, uint b ) {
+		return bounds[a].Center( axis ) < bounds[b].Center( axis );
+	} );
+	std::vector<float> rightArea( count );
+	aabb grow;
+	grow.Reset();
+	for ( uint i = count - 1; i > 0; i-- )
+	{
+		grow.Grow( bounds[indices[first + i]] );
+		rightArea[i] = grow.Area();
+	}
+	uint split = 1;
+	float bestCost = 1e34f;
+	grow.Reset();
+	for ( uint i = 1; i < count; i++ )
+	{
+		grow.Grow( bounds[indices[first + i - 1]] );
+		const float cost = grow.Area() * i + rightArea[i] * (count - i);
+		if ( cost < bestCost )
+		{
+			bestCost = cost;
+			split = i;
+		}
+	}
+
+	const uint left = nr_nodes;
+	nr_nodes += 2;
+	node.firstleft = left;
+	node.count = 0;
+	Subdivide( left, first, split, level + 1 );
+	Subdivide( left + 1, first + split, count - split, level + 1 );
+}
+
+bool TLAS::IntersectPrimitive( uint primitive, Ray *r, uint &depth, bool checkOcclusion )
+{
+	if ( primitive < nr_instances )
+		return instances[primitive].Traverse( r, depth, checkOcclusion );
+	primitive -= nr_instances;
+
+	if ( primitive < nr_spheres )
+	{
+		// Not through Primitive::Intersect, to avoid the virtual call
+		Sphere &sphere = spheres[primitive];
+		const float t = sphere.Sphere::IntersectionDistance( r );
+		if ( t <= 0 || t >= r->t )
+			return false;
+		// Occlusion by a mesh is counted by its BVH
+		TRAVERSAL_STATS( TraversalStats::Local().earlyOuts += checkOcclusion );
+		if ( !checkOcclusion )
+		{
+			r->t = t;
+			r->obj = &sphere;
+			r->instance = nullptr;
+			r->light = nullptr;
+		}
+		return true;
+	}
+	primitive -= nr_spheres;
+
+	Light *light = lights[primitive];
+	if ( checkOcclusion )
+	{
+		const bool occluded = light->Occludes( r );
+		TRAVERSAL_STATS( TraversalStats::Local().earlyOuts += occluded );
+		return occluded;
+	}
+	if ( !light->Intersect( r ) )
+		return false;
+	r->obj = nullptr;
+	r->instance = nullptr;
+	r->light = light;
+	return true;
+}
+
+// The TLAS grows with the number of instances, spheres and lights, deeper trees get a stack on the heap
+#define TLASSTACKSIZE 128
+
+bool TLAS::Traverse( Ray *r, uint &depth, bool checkOcclusion )
+{
+	if ( nr_primitives == 0 )
+		return false;
+	TRAVERSAL_STATS( TraversalStats &stats = TraversalStats::Local() );
+	TRAVERSAL_STATS( stats.aabbTests++ );
+	float tmin, tmax;
+	if ( !pool[1].AABBIntersection( r, tmin, tmax ) )
+		return false;
+
+	// Same scheme as BVH::Traverse, the far child is pushed and the near child visited directly
+	struct StackEntry
+	{
+		const BVHNode *node;
+		float tmin;
+	};
+	TraversalStack<StackEntry, TLASSTACKSIZE> stack( nr_levels );
+	uint stackPtr = 0;
+
+	bool found = false;
+	const BVHNode *node = pool + 1;
+	while ( true )
+	{
+		if ( node->count > 0 )
+		{
+			TRAVERSAL_STATS( stats.leafVisits++ );
+			if ( IntersectPrimitive( indices[node->firstleft], r, depth, checkOcclusion ) )
+			{
+				if ( checkOcclusion )
+					return true;
+				found = true;
+			}
+		}
+		else
+		{
+			const BVHNode *left = pool + node->firstleft;
+			const BVHNode *right = left + 1;
+			float tminL, tmaxL, tminR, tmaxR;
+			TRAVERSAL_STATS( stats.aabbTests += 2 );
+			bool intL = left->AABBIntersection( r, tminL, tmaxL );
+			bool intR = right->AABBIntersection( r, tminR, tmaxR );
+			if ( intL && intR )
+			{
+				depth += 2;
+				if ( tminR < tminL )
+				{
+					std::swap( left, right );
+					std::swap( tminL, tminR );
+				}
+				assert( stackPtr < stack.size );
+				stack[stackPtr++] = {right, tminR};
+				node = left;
+				continue;
+			}
+			if ( intL || intR )
+			{
+				depth++;
+				node = intL ? left : right;
+				continue;
+			}
+		}
+
+		// Pop the next node, skipping the ones behind the closest intersection so far
+		while ( true )
+		{
+			if ( stackPtr == 0 )
+				return found;
+			node = stack[--stackPtr].node;
+			if ( stack[stackPtr].tmin <= r->t )
+				break;
+			TRAVERSAL_STATS( stats.culledNodes++ );
+		}
+	}
+}
+
+void TLAS::IntersectPacket( Ray *rays, uint count )
+{
+	RayPacket packet( rays, count );
+	TraversePacket( packet, false );
+	#ifdef TRAVERSALSTATS
+	TraversalStats &stats = TraversalStats::Local();
+	for ( uint i = 0; i < count; i++ )
+		stats.lightHits += rays[i].light != nullptr;
+	#endif
+}
+
+void TLAS::OccludesPacket( Ray *rays, uint count, bool *occluded )
+{
+	for ( uint i = 0; i < count; i++ )
+		occluded[i] = false;
+	RayPacket packet( rays, count, occluded );
+	TraversePacket( packet, true );
+}
+
+void TLAS::TraversePacket( RayPacket &packet, bool checkOcclusion )
+{
+	if ( nr_primitives == 0 )
+		return;
+	uint depth = 0;
+	if ( !packet.coherent )
+	{
+		for ( uint i = 0; i < packet.count; i++ )
+		{
+			if ( checkOcclusion )
+				packet.occluded[i] = Traverse( packet.rays + i, depth, true );
+			else
+				Traverse( packet.rays + i, depth, false );
+		}
+		return;
+	}
+
+	// Same scheme as BVH::TraversePacket, with the primitives of the TLAS in the leaves
+	struct StackEntry
+	{
+		const BVHNode *node;
+		uint first, last;
+	};
+	TraversalStack<StackEntry, TLASSTACKSIZE> stack( nr_levels );
+	uint stackPtr = 0;
+	stack[stackPtr++] = {pool + 1, 0, packet.count};
+	TRAVERSAL_STATS( TraversalStats &stats = TraversalStats::Local() );
+
+	while ( stackPtr > 0 )
+	{
+		StackEntry entry = stack[--stackPtr];
+		const BVHNode *node = entry.node;
+		TRAVERSAL_STATS( stats.aabbTests++ );
+		if ( !packet.IntersectsInterval( *node ) || !packet.Active( *node, entry.first, entry.last ) )
+			continue;
+
+		if ( node->count > 0 )
+		{
+			// For every ray that is left, instead of only those that hit the leaf
+			TRAVERSAL_STATS( stats.leafVisits += entry.last - entry.first );
+			const uint primitive = indices[node->firstleft];
+			if ( primitive < nr_instances )
+			{
+				instances[primitive].TraversePacket( packet, entry.first, entry.last, checkOcclusion );
+				continue;
+			}
+			for ( uint i = entry.first; i < entry.last; i++ )
+			{
+				if ( !packet.Done( i ) && IntersectPrimitive( primitive, packet.rays + i, depth, checkOcclusion ) && checkOcclusion )
+					packet.occluded[i] = true;
+			}
+			continue;
+		}
+
+		const BVHNode *left = pool + node->firstleft;
+		const BVHNode *right = left + 1;
+		float tminL, tmaxL, tminR, tmaxR;
+		const Ray *r = packet.rays + entry.first;
+		TRAVERSAL_STATS( stats.aabbTests += 2 );
+		if ( !left->AABBIntersection( r, tminL, tmaxL ) )
+			tminL = 1e34f;
+		if ( !right->AABBIntersection( r, tminR, tmaxR ) )
+			tminR = 1e34f;
+		if ( tminR < tminL )
+			std::swap( left, right );
+		assert( stackPtr + 2 <= stack.size );
+		stack[stackPtr++] = {right, entry.first, entry.last};
+		stack[stackPtr++] = {left, entry.first, entry.last};
+	}
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "vectors.h"
+#include "ray.h"
+#include "bvh.h"
+#include "light.h"
+
+namespace AdvancedGraphics
+{
+
+// A placement of a mesh in the scene. Many instances can share the same BVH,
+// rays are transformed into the space of the mesh to traverse it.
+struct Instance
+{
+  public:
+	BVH *bvh;
+	// Object to world, and world to object
+	mat4 transform, inverse;
+	// World space bounds of the transformed mesh
+	aabb bounds;
+
+	Instance() = default;
+	Instance( BVH *bvh, const mat4 &transform );
+
+	// The TLAS needs to be rebuilt after the instance moved
+	void SetTransform( const mat4 &transform );
+	inline vec3 ToObject( const vec3 &point ) const { return inverse.TransformPoint( point ); }
+	// Normals transform with the transpose of the inverse
+	vec3 NormalToWorld( const vec3 &normal ) const;
+
+	bool Traverse( Ray *r, uint &depth, bool checkOcclusion );
+	// Traverses the mesh with the rays [first, last) of the packet
+	void TraversePacket( RayPacket &packet, uint first, uint last, bool checkOcclusion );
+};
+
+// Top level BVH over instances, spheres and lights, small enough to rebuild every time one of them moves.
+// Every leaf holds a single primitive, numbered with the instances first, then the spheres, then the lights.
+struct TLAS
+{
+  public:
+	Instance *instances;
+	uint nr_instances;
+	Sphere *spheres;
+	uint nr_spheres;
+	Light **lights;
+	uint nr_lights;
+	uint nr_primitives;
+
+	BVHNode *pool = nullptr;
+	uint nr_nodes;
+	// Number of levels of the tree, the traversal stacks are sized from it
+	uint nr_levels = 0;
+	uint *indices = nullptr;
+	aabb *bounds = nullptr;
+
+	TLAS( Instance *instances, uint instanceCount, Sphere *spheres, uint sphereCount, Light **lights, uint lightCount );
+	// Frees the tree, the instances, spheres and lights belong to the scene
+	~TLAS();
+	void Build();
+
+	inline bool Occludes( Ray *r )
+	{
+		uint depth = 0;
+		return Traverse( r, depth, true );
+	}
+	inline bool Intersect( Ray *r, uint &depth )
+	{
+		return Traverse( r, depth, false );
+	}
+	// Like Intersect and Occludes for up to MAXPACKETRAYS coherent rays, such as a tile of primary rays.
+	// Incoherent packets are traced one ray at a time.
+	void IntersectPacket( Ray *rays, uint count );
+	void OccludesPacket( Ray *rays, uint count, bool *occluded );
+
+  private:
+	void Subdivide( uint index, uint first, uint count, uint level );
+	// Sets r->light instead of r->obj when the closest hit is a light
+	bool IntersectPrimitive( uint primitive, Ray *r, uint &depth, bool checkOcclusion );
+	bool Traverse( Ray *r, uint &depth, bool checkOcclusion );
+	void TraversePacket( RayPacket &packet, bool checkOcclusion );
+};
+
+}; // namespace AdvancedGraphics
@@ -0,0 +1,74 @@
+#include "precomp.h" // include (only) this in every .cpp file
+#include "traversalstats.h"
+
+using namespace AdvancedGraphics;
+
+TraversalStats &TraversalStats::operator+=( const TraversalStats &other )
+{
+	for ( int kind = 0; kind < RAY_KINDS; kind++ )
+		rays[kind] += other.rays[kind];
+	lightHits += other.lightHits;
+	aabbTests += other.aabbTests;
+	triangleTests += other.triangleTests;
+	leafVisits += other.leafVisits;
+	earlyOuts += other.earlyOuts;
+	culledNodes += other.culledNodes;
+	return *this;
+}
+
+TraversalStats TraversalStats::operator-( const TraversalStats &other ) const
+{
+	TraversalStats d;
+	for ( int kind = 0; kind < RAY_KINDS; kind++ )
+		d.rays[kind] = rays[kind] - other.rays[kind];
+	d.lightHits = lightHits - other.lightHits;
+	d.aabbTests = aabbTests - other.aabbTests;
+	d.triangleTests = triangleTests - other.triangleTests;
+	d.leafVisits = leafVisits - other.leafVisits;
+	d.earlyOuts = earlyOuts - other.earlyOuts;
+	d.culledNodes = culledNodes - other.culledNodes;
+	return d;
+}
+
+void TraversalStats::Print( const char *indent ) const
+{
+	const double perRay = 1.0 / std::max( Rays(), (uint64)1 );
+	printf( "%sRays: %" PRIu64 " primary, %" PRIu64 " bounce, %" PRIu64 " shadow, %" PRIu64 " light hits\n", indent,
+		rays[RAY_PRIMARY], rays[RAY_BOUNCE], rays[RAY_SHADOW], lightHits );
+	printf( "%sAABB tests:     %12" PRIu64 " (%.1f per ray)\n", indent, aabbTests, aabbTests * perRay );
+	printf( "%sTriangle tests: %12" PRIu64 " (%.1f per ray)\n", indent, triangleTests, triangleTests * perRay );
+	printf( "%sLeaf visits:    %12" PRIu64 " (%.1f per ray)\n", indent, leafVisits, leafVisits * perRay );
+	printf( "%sEarly-outs:     %12" PRIu64 " (%.1f%% of the shadow rays)\n", indent, earlyOuts,
+		100.0 * earlyOuts / std::max( rays[RAY_SHADOW], (uint64)1 ) );
+	printf( "%sCulled nodes:   %12" PRIu64 " (%.1f per ray)\n", indent, culledNodes, culledNodes * perRay );
+}
+
+#ifdef TRAVERSALSTATS
+
+// Like the ring buffers of the profiler, the counters of a thread are never freed, so the
+// counts of the threads of a thread pool stay in the total after they exit.
+static std::mutex threadsMutex;
+static std::vector<std::unique_ptr<TraversalStats>> threads;
+static thread_local TraversalStats *currentThread = nullptr;
+
+TraversalStats &TraversalStats::Local()
+{
+	if ( currentThread == nullptr )
+	{
+		std::lock_guard<std::mutex> lock( threadsMutex );
+		threads.emplace_back( new TraversalStats() );
+		currentThread = threads.back().get();
+	}
+	return *currentThread;
+}
+
+TraversalStats TraversalStats::Total()
+{
+	TraversalStats total;
+	std::lock_guard<std::mutex> lock( threadsMutex );
+	for ( const auto &thread : threads )
+		total += *thread;
+	return total;
+}
+
+#endif
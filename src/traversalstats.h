@@ -0,0 +1,54 @@
+#pragma once
+
+namespace AdvancedGraphics
+{
+
+// The rays that are counted separately
+enum RayKind
+{
+	RAY_PRIMARY = 0,
+	RAY_BOUNCE,
+	RAY_SHADOW,
+	RAY_KINDS
+};
+
+// What tracing rays through the TLAS and the BVHs cost, summed over the rays
+struct TraversalStats
+{
+	uint64 rays[RAY_KINDS] = {};
+	// Closest hits that were a light
+	uint64 lightHits = 0;
+	// Rays against bounding boxes. An MBVH node counts as BVHWIDTH boxes. A packet counts one
+	// test for the interval of the whole packet, and one for every ray it tests by itself.
+	uint64 aabbTests = 0;
+	// Triangles in the leaves that were visited, without the empty slots of their blocks
+	uint64 triangleTests = 0;
+	// Leaves of the TLAS and of the BVHs
+	uint64 leafVisits = 0;
+	// Occlusion traversals that stopped at the first hit
+	uint64 earlyOuts = 0;
+	// Nodes on the stack that were skipped, because a closer hit was found after they were pushed
+	uint64 culledNodes = 0;
+
+	uint64 Rays() const { return rays[RAY_PRIMARY] + rays[RAY_BOUNCE] + rays[RAY_SHADOW]; }
+	TraversalStats &operator+=( const TraversalStats &other );
+	TraversalStats operator-( const TraversalStats &other ) const;
+	// One line per counter, with the average per ray
+	void Print( const char *indent ) const;
+
+#ifdef TRAVERSALSTATS
+	// The counters of the calling thread
+	static TraversalStats &Local();
+	// The sum over all threads. Only call this while no other thread traces rays, between frames.
+	static TraversalStats Total();
+#endif
+};
+
+#ifdef TRAVERSALSTATS
+// Runs the statement only in builds that count, like TRAVERSAL_STATS( stats.leafVisits++ )
+#define TRAVERSAL_STATS( statement ) statement
+#else
+#define TRAVERSAL_STATS( statement )
+#endif
+
+}; // namespace AdvancedGraphics
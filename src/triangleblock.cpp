@@ -0,0 +1,113 @@
+#include "precomp.h" // include (only) this in every .cpp file
+#include "triangleblock.h"
+
+#if TRIANGLEBLOCKWIDTH == 8
+typedef __m256 floatb;
+#define LOADB( x ) _mm256_load_ps( x )
+#define SETB( x ) _mm256_set1_ps( x )
+#define ADDB( a, b ) _mm256_add_ps( a, b )
+#define SUBB( a, b ) _mm256_sub_ps( a, b )
+#define MULB( a, b ) _mm256_mul_ps( a, b )
+#define DIVB( a, b ) _mm256_div_ps( a, b )
+#define ANDB( a, b ) _mm256_and_ps( a, b )
+#define ANDNOTB( a, b ) _mm256_andnot_ps( a, b )
+#define GEB( a, b ) _mm256_cmp_ps( a, b, _CMP_GE_OQ )
+#define LEB( a, b ) _mm256_cmp_ps( a, b, _CMP_LE_OQ )
+#define GTB( a, b ) _mm256_cmp_ps( a, b, _CMP_GT_OQ )
+#define LTB( a, b ) _mm256_cmp_ps( a, b, _CMP_LT_OQ )
+#define MASKB( a ) _mm256_movemask_ps( a )
+#define STOREB( x, v ) _mm256_storeu_ps( x, v )
+#else
+typedef __m128 floatb;
+#define LOADB( x ) _mm_load_ps( x )
+#define SETB( x ) _mm_set1_ps( x )
+#define ADDB( a, b ) _mm_add_ps( a, b )
+#define SUBB( a, b ) _mm_sub_ps( a, b )
+#define MULB( a, b ) _mm_mul_ps( a, b )
+#define DIVB( a, b ) _mm_div_ps( a, b )
+#define ANDB( a, b ) _mm_and_ps( a, b )
+#define ANDNOTB( a, b ) _mm_andnot_ps( a, b )
+#define GEB( a, b ) _mm_cmpge_ps( a, b )
+#define LEB( a, b ) _mm_cmple_ps( a, b )
+#define GTB( a, b ) _mm_cmpgt_ps( a, b )
+#define LTB( a, b ) _mm_cmplt_ps( a, b )
+#define MASKB( a ) _mm_movemask_ps( a )
+#define STOREB( x, v ) _mm_storeu_ps( x, v )
+#endif
+
+void TriangleBlock::Set( const Triangle *triangles, const uint *indices, uint count )
+{
+	for ( uint i = 0; i < TRIANGLEBLOCKWIDTH; i++ )
+	{
+		if ( i >= count )
+		{
+			// Zero edges make the determinant 0, so the slot never intersects
+			p0x[i] = p0y[i] = p0z[i] = 0;
+			e1x[i] = e1y[i] = e1z[i] = 0;
+			e2x[i] = e2y[i] = e2z[i] = 0;
+			triangle[i] = indices[0];
+			continue;
+		}
+		const Triangle &tri = triangles[indices[i]];
+		const vec3 e1 = tri.p1 - tri.p0;
+		const vec3 e2 = tri.p2 - tri.p0;
+		p0x[i] = tri.p0.x, p0y[i] = tri.p0.y, p0z[i] = tri.p0.z;
+		e1x[i] = e1.x, e1y[i] = e1.y, e1z[i] = e1.z;
+		e2x[i] = e2.x, e2y[i] = e2.y, e2z[i] = e2.z;
+		triangle[i] = indices[i];
+	}
+}
+
+bool TriangleBlock::Intersect( Triangle *triangles, Ray *r, bool checkOcclusion ) const
+{
+	// Same tests as Triangle::IntersectionDistance, for every slot at once
+	const floatb dx = SETB( r->direction.x ), dy = SETB( r->direction.y ), dz = SETB( r->direction.z );
+	const floatb e1X = LOADB( e1x ), e1Y = LOADB( e1y ), e1Z = LOADB( e1z );
+	const floatb e2X = LOADB( e2x ), e2Y = LOADB( e2y ), e2Z = LOADB( e2z );
+
+	// pvec = direction x edge2
+	const floatb px = SUBB( MULB( dy, e2Z ), MULB( dz, e2Y ) );
+	const floatb py = SUBB( MULB( dz, e2X ), MULB( dx, e2Z ) );
+	const floatb pz = SUBB( MULB( dx, e2Y ), MULB( dy, e2X ) );
+	const floatb det = ADDB( ADDB( MULB( e1X, px ), MULB( e1Y, py ) ), MULB( e1Z, pz ) );
+	const floatb absdet = ANDNOTB( SETB( -0.0f ), det );
+	floatb mask = GEB( absdet, SETB( 0.0000001f ) );
+	const floatb invdet = DIVB( SETB( 1.0f ), det );
+
+	const floatb tx = SUBB( SETB( r->origin.x ), LOADB( p0x ) );
+	const floatb ty = SUBB( SETB( r->origin.y ), LOADB( p0y ) );
+	const floatb tz = SUBB( SETB( r->origin.z ), LOADB( p0z ) );
+	const floatb u = MULB( ADDB( ADDB( MULB( tx, px ), MULB( ty, py ) ), MULB( tz, pz ) ), invdet );
+	mask = ANDB( mask, ANDB( GEB( u, SETB( 0.0f ) ), LEB( u, SETB( 1.0f ) ) ) );
+
+	// qvec = tvec x edge1
+	const floatb qx = SUBB( MULB( ty, e1Z ), MULB( tz, e1Y ) );
+	const floatb qy = SUBB( MULB( tz, e1X ), MULB( tx, e1Z ) );
+	const floatb qz = SUBB( MULB( tx, e1Y ), MULB( ty, e1X ) );
+	const floatb v = MULB( ADDB( ADDB( MULB( dx, qx ), MULB( dy, qy ) ), MULB( dz, qz ) ), invdet );
+	mask = ANDB( mask, ANDB( GEB( v, SETB( 0.0f ) ), LEB( ADDB( u, v ), SETB( 1.0f ) ) ) );
+
+	const floatb t = MULB( ADDB( ADDB( MULB( e2X, qx ), MULB( e2Y, qy ) ), MULB( e2Z, qz ) ), invdet );
+	mask = ANDB( mask, ANDB( GTB( t, SETB( 0.0f ) ), LTB( t, SETB( r->t ) ) ) );
+
+	const int hits = MASKB( mask );
+	if ( hits == 0 )
+		return false;
+	if ( checkOcclusion )
+		return true;
+
+	// Closest of the slots that were hit
+	float ts[TRIANGLEBLOCKWIDTH];
+	STOREB( ts, t );
+	for ( uint i = 0; i < TRIANGLEBLOCKWIDTH; i++ )
+	{
+		if ( (hits & (1 << i)) && ts[i] < r->t )
+		{
+			r->t = ts[i];
+			r->obj = triangles + triangle[i];
+			r->instance = nullptr;
+			r->light = nullptr;
+		}
+	}
+	return true;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "vectors.h"
+#include "ray.h"
+#include "primitive.h"
+#include "utils.h"
+
+#if BVHLEAFSIZE > 8
+#error "BVHLEAFSIZE can be at most 8"
+#elif BVHLEAFSIZE > 4
+#if !defined( __AVX__ )
+#error "A leaf size above 4 requires AVX, enable it in the compiler flags (e.g. -mavx2)"
+#endif
+#define TRIANGLEBLOCKWIDTH 8
+#else
+#define TRIANGLEBLOCKWIDTH 4
+#endif
+
+namespace AdvancedGraphics
+{
+
+// The triangles of a BVH leaf, gathered and stored per component,
+// so a single SIMD Moller-Trumbore test covers all of them.
+// Leaves with more triangles than fit in a block use consecutive blocks.
+struct ALIGN( 64 ) TriangleBlock
+{
+  public:
+	float p0x[TRIANGLEBLOCKWIDTH], p0y[TRIANGLEBLOCKWIDTH], p0z[TRIANGLEBLOCKWIDTH];
+	float e1x[TRIANGLEBLOCKWIDTH], e1y[TRIANGLEBLOCKWIDTH], e1z[TRIANGLEBLOCKWIDTH];
+	float e2x[TRIANGLEBLOCKWIDTH], e2y[TRIANGLEBLOCKWIDTH], e2z[TRIANGLEBLOCKWIDTH];
+	// Index into BVH::triangles, unused slots hold a degenerate triangle that is never hit
+	uint triangle[TRIANGLEBLOCKWIDTH];
+
+	// Fills the block with the triangles indices[0..count)
+	void Set( const Triangle *triangles, const uint *indices, uint count );
+	// Like Primitive::Intersect and Primitive::Occludes, for all triangles in the block
+	bool Intersect( Triangle *triangles, Ray *r, bool checkOcclusion ) const;
+};
+
+}; // namespace AdvancedGraphics
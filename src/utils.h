@@ -38,13 +38,6 @@
 
 #define BADFLOAT(x) ((*(uint*)&x & 0x7f000000) == 0x7f000000)
 
-// deterministic rng
-static uint seed = 0x12345678;
-inline uint RandomUInt() { seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5; return seed; }
-inline float RandomFloat() { return RandomUInt() * 2.3283064365387e-10f; }
-inline float Rand( float range ) { return RandomFloat() * range; }
-inline size_t RandomIndex( uint range ) { return RandomFloat() * (range - 1); }
-
 namespace AdvancedGraphics {
 
 inline void NotifyUser( const char *s )
@@ -58,34 +51,51 @@ inline void NotifyUser( const char *s )
 	exit( 0 );
 }
 
-inline vec3 RandomPointOnSphere(float radius)
+// The nodes a traversal still has to visit. The stack lives on the stack of the thread when
+// size fits in N entries, deeper trees get one on the heap of the size they need.
+template <typename T, uint N>
+struct TraversalStack
+{
+	T *entries;
+	uint size;
+
+	TraversalStack( uint size ) : entries( local ), size( std::max( size, N ) )
+	{
+		if ( size > N )
+		{
+			heap.resize( size );
+			entries = heap.data();
+		}
+	}
+	inline T &operator[]( uint i ) { return entries[i]; }
+
+  private:
+	T local[N];
+	std::vector<T> heap;
+};
+
+// 64 bit FNV-1a hash, pass a previous result as hash to continue it
+inline uint64 HashBytes( const void *data, size_t size, uint64 hash = 14695981039346656037ull )
+{
+	const uchar *bytes = (const uchar *)data;
+	for ( size_t i = 0; i < size; i++ )
+		hash = (hash ^ bytes[i]) * 1099511628211ull;
+	return hash;
+}
+
+// Maps a sample in [0, 1)^2 to a uniform point on the sphere, without rejection so that
+// stratified samples stay stratified. From: https://mathworld.wolfram.com/SpherePointPicking.html
+inline vec3 RandomPointOnSphere(float radius, const vec2 &sample)
 {
-	// From: https://mathworld.wolfram.com/SpherePointPicking.html
-	// Equation 12, 13, and 14
-	float x0, x1, x2, x3;
-	float x02, x12, x22, x32;
-	float sum;
-	do {
-		x0 = RandomFloat() * 2 - 1;
-		x1 = RandomFloat() * 2 - 1;
-		x2 = RandomFloat() * 2 - 1;
-		x3 = RandomFloat() * 2 - 1;
-		x02 = x0 * x0;
-		x12 = x1 * x1;
-		x22 = x2 * x2;
-		x32 = x3 * x3;
-		sum = x02 + x12 + x22 + x32;
-	} while( sum >= 1);
-	return (radius / sum) * vec3(
-		2 * (x1 * x3 + x0 * x2), 
-		2 * (x2 * x3 + x0 * x1),
-		x02 + x32 - x12 -x22
-		);
+	float z = 1 - 2 * sample.x;
+	float r = sqrtf( std::max( 0.0f, 1 - z * z ) );
+	float phi = 2 * PI * sample.y;
+	return radius * vec3( r * cosf( phi ), r * sinf( phi ), z );
 }
 
-inline vec3 RandomPointOnHemisphere(float radius, vec3 interNormal)
+inline vec3 RandomPointOnHemisphere(float radius, vec3 interNormal, const vec2 &sample)
 {
-	vec3 point = RandomPointOnSphere(radius);
+	vec3 point = RandomPointOnSphere(radius, sample);
 	float angle = dot(point, interNormal);
 	if ( angle < 0.0f )
 		point *= -1;
@@ -108,14 +118,85 @@ inline vec3 FlipYZ(const vec3 v)
 	return vec3(v.x, v.z, v.y);
 }
 
-inline vec3 CosineWeightedDiffuseReflection( const vec3 N )
+inline vec3 CosineWeightedDiffuseReflection( const vec3 N, const vec2 &sample )
 {
-	float r1 = RandomFloat();
-	float r2 = RandomFloat();
+	float r1 = sample.x;
+	float r2 = sample.y;
 	float theta = 2 * PI * r1;
 	float r = sqrtf( 1 - r2 );
 	vec3 p = TangentToWorld( FlipYZ(N), cosf( theta ) * r, sinf( theta ) * r, sqrtf( r2 ) );
 	return FlipYZ(p);
 }
 
+// Spreads the lower 21 bits of v, leaving two zero bits between each of them
+inline uint64 ExpandBits( uint64 v )
+{
+	v &= 0x1fffff;
+	v = (v | v << 32) & 0x1f00000000ffffull;
+	v = (v | v << 16) & 0x1f0000ff0000ffull;
+	v = (v | v << 8) & 0x100f00f00f00f00full;
+	v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+	v = (v | v << 2) & 0x1249249249249249ull;
+	return v;
+}
+
+// Parallel LSD radix sort on the lowest bits of the keys, 8 bits per pass.
+// The values are moved along with their keys.
+inline void RadixSort( uint64 *keys, uint *values, uint n, uint bits )
+{
+	uint64 *keysTmp = new uint64[n];
+	uint *valuesTmp = new uint[n];
+	uint64 *src = keys, *dst = keysTmp;
+	uint *srcv = values, *dstv = valuesTmp;
+
+	const int nr_chunks = omp_get_max_threads();
+	uint *offsets = new uint[nr_chunks * 256];
+	for ( uint shift = 0; shift < bits; shift += 8 )
+	{
+		// Count the digits of every chunk
+		#pragma omp parallel for
+		for ( int c = 0; c < nr_chunks; c++ )
+		{
+			uint *count = offsets + c * 256;
+			for ( int d = 0; d < 256; d++ )
+				count[d] = 0;
+			for ( uint i = (uint64)n * c / nr_chunks; i < (uint64)n * (c + 1) / nr_chunks; i++ )
+				count[(src[i] >> shift) & 255]++;
+		}
+
+		// Turn the counts into write offsets, digit first and then chunk, which keeps the sort stable
+		uint sum = 0;
+		for ( int d = 0; d < 256; d++ )
+			for ( int c = 0; c < nr_chunks; c++ )
+			{
+				uint t = offsets[c * 256 + d];
+				offsets[c * 256 + d] = sum;
+				sum += t;
+			}
+
+		#pragma omp parallel for
+		for ( int c = 0; c < nr_chunks; c++ )
+		{
+			uint *offset = offsets + c * 256;
+			for ( uint i = (uint64)n * c / nr_chunks; i < (uint64)n * (c + 1) / nr_chunks; i++ )
+			{
+				uint o = offset[(src[i] >> shift) & 255]++;
+				dst[o] = src[i];
+				dstv[o] = srcv[i];
+			}
+		}
+		std::swap( src, dst );
+		std::swap( srcv, dstv );
+	}
+
+	if ( src != keys )
+	{
+		memcpy( keys, src, n * sizeof( uint64 ) );
+		memcpy( values, srcv, n * sizeof( uint ) );
+	}
+	delete[] offsets;
+	delete[] keysTmp;
+	delete[] valuesTmp;
+}
+
 }; // namespace AdvancedGraphics
@@ -136,6 +136,21 @@ struct mat4
 	static mat4 rotatex( const float a );
 	static mat4 rotatey( const float a );
 	static mat4 rotatez( const float a );
+	static mat4 translate( const vec3 &v ) { mat4 r; r.cell[3] = v.x, r.cell[7] = v.y, r.cell[11] = v.z; return r; }
+	static mat4 scale( const float s ) { mat4 r; r.cell[0] = r.cell[5] = r.cell[10] = s; return r; }
+	mat4 inverted() const { mat4 r = *this; r.invert(); return r; }
+	vec3 TransformPoint( const vec3 &v ) const
+	{
+		return vec3( cell[0] * v.x + cell[1] * v.y + cell[2] * v.z + cell[3],
+			cell[4] * v.x + cell[5] * v.y + cell[6] * v.z + cell[7],
+			cell[8] * v.x + cell[9] * v.y + cell[10] * v.z + cell[11] );
+	}
+	vec3 TransformVector( const vec3 &v ) const
+	{
+		return vec3( cell[0] * v.x + cell[1] * v.y + cell[2] * v.z,
+			cell[4] * v.x + cell[5] * v.y + cell[6] * v.z,
+			cell[8] * v.x + cell[9] * v.y + cell[10] * v.z );
+	}
 	void invert()
 	{
 		// from MESA, via http://stackoverflow.com/questions/1148309/inverting-a-4x4-matrix
@@ -0,0 +1,560 @@
+#include "precomp.h" // include (only) this in every .cpp file
+#include "wavefront.h"
+#include "game.h"
+
+void RayBuffer::Resize( uint size )
+{
+	Free();
+	float **components[] = {&ox, &oy, &oz, &dx, &dy, &dz, &t};
+	for ( float **c : components )
+		*c = (float *)MALLOC64( size * sizeof( float ) );
+}
+
+void RayBuffer::Free()
+{
+	float **components[] = {&ox, &oy, &oz, &dx, &dy, &dz, &t};
+	for ( float **c : components )
+	{
+		FREE64( *c );
+		*c = nullptr;
+	}
+}
+
+Wavefront::Wavefront( Game *game ) :
+	game( game )
+{
+}
+
+Wavefront::~Wavefront()
+{
+	Free();
+}
+
+void Wavefront::ForChunks( uint count, const std::function<void( uint first, uint last )> &f )
+{
+	game->threadPool->ParallelFor( (count + WAVEFRONTCHUNK - 1) / WAVEFRONTCHUNK, [&]( uint c ) {
+		f( c * WAVEFRONTCHUNK, std::min( count, (c + 1) * WAVEFRONTCHUNK ) );
+	} );
+}
+
+// Tiles of Generate, so the primary rays of a tile are consecutive and can be traced as a packet
+#if PACKETSIZE > 0
+#define WAVEFRONTTILESIZE PACKETSIZE
+#else
+#define WAVEFRONTTILESIZE 1
+#endif
+
+void Wavefront::Resize( uint pixels )
+{
+	size = pixels;
+	const int width = game->screen->GetWidth(), height = game->screen->GetHeight();
+	nr_tiles = ((width + WAVEFRONTTILESIZE - 1) / WAVEFRONTTILESIZE) * ((height + WAVEFRONTTILESIZE - 1) / WAVEFRONTTILESIZE);
+	Free();
+	rays.Resize( size );
+	nextRays.Resize( size );
+	shadowRays.Resize( size );
+	nextShadowRays.Resize( size );
+
+	paths = new PathState[size];
+	nextPaths = new PathState[size];
+	keep = new bool[size];
+	hitObj = new Primitive *[size];
+	hitInstance = new Instance *[size];
+	hitLight = new Light *[size];
+	shadows = new ShadowState[size];
+	nextShadows = new ShadowState[size];
+	keepShadow = new bool[size];
+	radiance = new Color[size];
+	chunkOffsets = new uint[(size + WAVEFRONTCHUNK - 1) / WAVEFRONTCHUNK + 1];
+	tileOffsets = new uint[nr_tiles + 1];
+	#ifdef RAYSORTING
+	sortKeys = new uint64[size];
+	sortOrder = new uint[size];
+	unsortedHits = new Primitive *[size];
+	#endif
+}
+
+void Wavefront::Free()
+{
+	rays.Free();
+	nextRays.Free();
+	shadowRays.Free();
+	nextShadowRays.Free();
+	delete[] paths;
+	delete[] nextPaths;
+	delete[] keep;
+	delete[] hitObj;
+	delete[] hitInstance;
+	delete[] hitLight;
+	delete[] shadows;
+	delete[] nextShadows;
+	delete[] keepShadow;
+	delete[] radiance;
+	delete[] chunkOffsets;
+	delete[] tileOffsets;
+	#ifdef RAYSORTING
+	delete[] sortKeys;
+	delete[] sortOrder;
+	delete[] unsortedHits;
+	#endif
+}
+
+template <class MoveFunc>
+uint Wavefront::Compact( const bool *keep, uint count, MoveFunc move )
+{
+	PROFILE_ZONE( "Compact" );
+	// Count the entries per chunk, the prefix sum of the counts is where each chunk starts
+	const uint chunks = (count + WAVEFRONTCHUNK - 1) / WAVEFRONTCHUNK;
+	ForChunks( count, [&]( uint first, uint last ) {
+		uint n = 0;
+		for ( uint i = first; i < last; i++ )
+			n += keep[i];
+		chunkOffsets[first / WAVEFRONTCHUNK + 1] = n;
+	} );
+	chunkOffsets[0] = 0;
+	for ( uint c = 0; c < chunks; c++ )
+		chunkOffsets[c + 1] += chunkOffsets[c];
+
+	ForChunks( count, [&]( uint first, uint last ) {
+		uint j = chunkOffsets[first / WAVEFRONTCHUNK];
+		for ( uint i = first; i < last; i++ )
+			if ( keep[i] )
+				move( i, j++ );
+	} );
+	return chunkOffsets[chunks];
+}
+
+// Every variant of Render, indexed by the mask of features. The wavefront renderer does not do SSAA
+// and does not filter, so only the features of the paths make a difference.
+template <size_t... F>
+static std::array<void (Wavefront::*)(), sizeof...( F )> RenderVariants( std::index_sequence<F...> )
+{
+	return {{&Wavefront::RenderVariant<CanonicalFeatures( F ) & (FEATURE_NEE | FEATURE_MIS | FEATURE_RUSSIANROULETTE)>...}};
+}
+
+void Wavefront::Render()
+{
+	PROFILE_ZONE( "Path tracing" );
+	static const auto variants = RenderVariants( std::make_index_sequence<FEATURE_VARIANTS>() );
+	(this->*variants[game->features])();
+}
+
+template <uint F>
+void Wavefront::RenderVariant()
+{
+	const int width = game->screen->GetWidth(), height = game->screen->GetHeight();
+	if ( size != (uint)(width * height) )
+		Resize( width * height );
+
+	Generate();
+	nr_rays = nr_shadow_rays = 0;
+	nr_secondary_rays = nr_node_visits = nr_hit_switches = nr_hit_switches_unsorted = 0;
+	uint count = size;
+	for ( uint depth = 0; count > 0 && ((F & FEATURE_RUSSIANROULETTE) || depth < MAX_NR_ITERATIONS); depth++ )
+	{
+		nr_rays += count;
+		#ifdef RAYSORTING
+		if ( depth > 0 )
+			Sort( count );
+		#endif
+		Extend( count, depth );
+		if ( depth > 0 )
+		{
+			nr_secondary_rays += count;
+			nr_hit_switches += CountHitSwitches( hitObj, count );
+			#ifdef RAYSORTING
+			ForChunks( count, [&]( uint first, uint last ) {
+				for ( uint i = first; i < last; i++ )
+					unsortedHits[sortOrder[i]] = hitObj[i];
+			} );
+			nr_hit_switches_unsorted += CountHitSwitches( unsortedHits, count );
+			#else
+			nr_hit_switches_unsorted = nr_hit_switches;
+			#endif
+		}
+		Shade<F>( count, depth );
+
+		const uint shadowCount = Compact( keepShadow, count, [&]( uint i, uint j ) {
+			shadowRays.Move( i, nextShadowRays, j );
+			nextShadows[j] = shadows[i];
+		} );
+		nr_shadow_rays += shadowCount;
+		Connect<F>( shadowCount );
+
+		// The paths that continue become the active paths of the next bounce
+		count = Compact( keep, count, [&]( uint i, uint j ) {
+			nextRays.Move( i, rays, j );
+			paths[j] = nextPaths[i];
+		} );
+	}
+
+	PROFILE_ZONE( "Accumulate" );
+	ForChunks( size, [&]( uint first, uint last ) {
+		for ( uint id = first; id < last; id++ )
+		{
+			game->AddSample( id, radiance[id] );
+		}
+	} );
+}
+
+void Wavefront::Generate()
+{
+	PROFILE_ZONE( "Generate" );
+	const int width = game->screen->GetWidth(), height = game->screen->GetHeight();
+	const int tileSize = WAVEFRONTTILESIZE;
+	const int tilesX = (width + tileSize - 1) / tileSize;
+	const int tilesY = (height + tileSize - 1) / tileSize;
+	tileOffsets[nr_tiles] = size;
+
+	game->threadPool->ParallelFor( tilesY, [&]( uint row ) {
+		for ( int tile = row * tilesX; tile < (int)(row + 1) * tilesX; tile++ )
+		{
+			const int x0 = (tile % tilesX) * tileSize, y0 = (tile / tilesX) * tileSize;
+			const int w = std::min( tileSize, width - x0 ), h = std::min( tileSize, height - y0 );
+			// All tiles above, and the tiles to the left, which have the same height
+			uint i = y0 * width + x0 * h;
+			tileOffsets[tile] = i;
+			for ( int y = y0; y < y0 + h; y++ )
+				for ( int x = x0; x < x0 + w; x++, i++ )
+				{
+					const uint id = x + y * width;
+					Sampler sampler( game->samplerType, x, y, game->pixelData[id].samples, game->samplerSeed );
+					rays.Set( i, game->ComputePrimaryRay<0>( x, y, 0.0f, 1.0f, sampler ) );
+					paths[i] = {Color( 1, 1, 1 ), 0, 0, id, true, sampler};
+					radiance[id] = Color( 0, 0, 0 );
+				}
+		}
+	} );
+}
+
+#ifdef RAYSORTING
+void Wavefront::Sort( uint count )
+{
+	PROFILE_ZONE( "Sort" );
+	// Grid of 2^8 cells per axis over the bounds of the origins
+	aabb bounds;
+	bounds.Reset();
+	for ( uint i = 0; i < count; i++ )
+		bounds.Grow( vec3( rays.ox[i], rays.oy[i], rays.oz[i] ) );
+	float scale[3];
+	for ( int a = 0; a < 3; a++ )
+	{
+		const float extent = bounds.bmax[a] - bounds.bmin[a];
+		scale[a] = extent > 0 ? 255.0f / extent : 0;
+	}
+
+	// The octant is above the Morton code, so rays that travel in the same direction are grouped first
+	ForChunks( count, [&]( uint first, uint last ) {
+		for ( uint i = first; i < last; i++ )
+		{
+			const uint64 octant = (rays.dx[i] < 0) | (rays.dy[i] < 0) << 1 | (rays.dz[i] < 0) << 2;
+			uint64 code = ExpandBits( (uint64)((rays.ox[i] - bounds.bmin[0]) * scale[0]) ) << 2;
+			code |= ExpandBits( (uint64)((rays.oy[i] - bounds.bmin[1]) * scale[1]) ) << 1;
+			code |= ExpandBits( (uint64)((rays.oz[i] - bounds.bmin[2]) * scale[2]) );
+			sortKeys[i] = octant << 24 | code;
+			sortOrder[i] = i;
+		}
+	} );
+	RadixSort( sortKeys, sortOrder, count, 27 );
+
+	ForChunks( count, [&]( uint first, uint last ) {
+		for ( uint i = first; i < last; i++ )
+		{
+			rays.Move( sortOrder[i], nextRays, i );
+			nextPaths[i] = paths[sortOrder[i]];
+		}
+	} );
+	std::swap( rays, nextRays );
+	std::swap( paths, nextPaths );
+}
+#endif
+
+void Wavefront::Extend( uint count, uint depth )
+{
+	PROFILE_ZONE( "Extend" );
+	#if PACKETSIZE > 0 && defined( USEBVH )
+	if ( depth == 0 )
+	{
+		// The primary rays are still in the tile order of Generate, every tile is a packet
+		game->threadPool->ParallelFor( nr_tiles, [&]( uint tile ) {
+			Ray packet[MAXPACKETRAYS];
+			const uint first = tileOffsets[tile], n = tileOffsets[tile + 1] - first;
+			for ( uint i = 0; i < n; i++ )
+				packet[i] = rays.Get( first + i );
+			game->tlas->IntersectPacket( packet, n );
+			TRAVERSAL_STATS( TraversalStats::Local().rays[RAY_PRIMARY] += n );
+			for ( uint i = 0; i < n; i++ )
+			{
+				const Ray &r = packet[i];
+				rays.t[first + i] = r.t;
+				hitObj[first + i] = r.obj;
+				hitInstance[first + i] = r.instance;
+				hitLight[first + i] = r.light;
+			}
+		} );
+		return;
+	}
+	#endif
+
+	std::atomic<uint64> visits( 0 );
+	ForChunks( count, [&]( uint first, uint last ) {
+		uint64 chunkVisits = 0;
+		TRAVERSAL_STATS( TraversalStats::Local().rays[depth == 0 ? RAY_PRIMARY : RAY_BOUNCE] += last - first );
+		for ( uint i = first; i < last; i++ )
+		{
+			Ray r = rays.Get( i );
+			uint bvhDepth = 0;
+			const bool found = game->Intersect( &r, bvhDepth );
+			chunkVisits += bvhDepth;
+			rays.t[i] = r.t;
+			hitObj[i] = found ? r.obj : nullptr;
+			hitInstance[i] = r.instance;
+			hitLight[i] = r.light;
+		}
+		visits += chunkVisits;
+	} );
+	if ( depth > 0 )
+		nr_node_visits += visits;
+}
+
+uint64 Wavefront::CountHitSwitches( Primitive *const *hits, uint count )
+{
+	std::atomic<uint64> switches( 0 );
+	ForChunks( count, [&]( uint first, uint last ) {
+		uint64 chunkSwitches = 0;
+		for ( uint i = std::max( first, 1u ); i < last; i++ )
+			chunkSwitches += hits[i] != hits[i - 1];
+		switches += chunkSwitches;
+	} );
+	return switches;
+}
+
+// The body of the loop in Game::Sample, for all paths at once
+template <uint F>
+void Wavefront::Shade( uint count, uint depth )
+{
+	PROFILE_ZONE( "Shade" );
+	ForChunks( count, [&]( uint first, uint last ) {
+		for ( uint i = first; i < last; i++ )
+		{
+			keep[i] = false;
+			keepShadow[i] = false;
+			// Only the origin, direction and distance are needed, not the inverse direction of a Ray
+			const vec3 origin( rays.ox[i], rays.oy[i], rays.oz[i] );
+			const vec3 direction( rays.dx[i], rays.dy[i], rays.dz[i] );
+			const float t = rays.t[i];
+			const PathState &path = paths[i];
+			Color T = path.throughput;
+			Color &E = radiance[path.pixel];
+
+			// No intersection point found
+			if ( hitObj[i] == nullptr )
+			{
+				Light *light = hitLight[i];
+				Color nohitcolor;
+				vec3 interPoint, interNormal;
+				if ( light != nullptr )
+				{
+					interPoint = origin + t * direction;
+					interNormal = light->NormalAt( interPoint );
+					if ( !(F & FEATURE_NEE) || path.specular )
+						nohitcolor = light->color;
+					else if ( F & FEATURE_MIS )
+					{
+						float solidAngle = (path.pdf_angle * light->Area()) / (t * t);
+						float pdf_light = 1 / solidAngle;
+						float pdf_mis = path.pdf_brdf + pdf_light;
+						nohitcolor = light->color * (1.0f / pdf_mis);
+					}
+					else
+						nohitcolor = Color( 0, 0, 0 );
+				}
+				else if ( game->sky != nullptr )
+				{
+					interPoint = vec3( INFINITY, INFINITY, INFINITY );
+					interNormal = -direction;
+					nohitcolor = game->sky->FindColor( direction );
+				}
+				else
+				{
+					interPoint = vec3( INFINITY, INFINITY, INFINITY );
+					interNormal = -direction;
+					nohitcolor = SKYDOME_DEFAULT_COLOR;
+				}
+
+				if ( depth == 0 )
+				{
+					PixelData &pixel = game->pixelData[path.pixel];
+					pixel.interNormal = interNormal;
+					pixel.firstIntersect = interPoint;
+					pixel.materialIndex = -2147483647;
+					pixel.albedo = nohitcolor;
+					nohitcolor = Color( 1, 1, 1 );
+				}
+				E += T * nohitcolor;
+				continue;
+			}
+
+			// intersection point found
+			Primitive *obj = hitObj[i];
+			Instance *instance = hitInstance[i];
+			vec3 interPoint = origin + t * direction;
+			// Instanced meshes are shaded in object space
+			vec3 objectPoint = instance != nullptr ? instance->ToObject( interPoint ) : interPoint;
+			vec3 interNormal = obj->NormalAt( objectPoint );
+			if ( instance != nullptr )
+				interNormal = instance->NormalToWorld( interNormal );
+
+			Color albedo = obj->ColorAt( game->materials, objectPoint );
+			Color BRDF = albedo * INVPI;
+			float angle = -dot( direction, interNormal );
+			bool backfacing = angle < 0.0f;
+			if ( backfacing )
+			{
+				interNormal *= -1;
+				angle *= -1;
+			}
+
+			Material *mat = game->default_material;
+			if ( obj->material >= 0 )
+				mat = &game->materials[obj->material];
+
+			// Save data for filtering
+			if ( depth == 0 )
+			{
+				PixelData &pixel = game->pixelData[path.pixel];
+				pixel.interNormal = interNormal;
+				pixel.firstIntersect = interPoint;
+				pixel.materialIndex = obj->material;
+				pixel.albedo = albedo;
+
+				albedo = Color( 1, 1, 1 );
+				BRDF = albedo * INVPI;
+			}
+
+			PathState &next = nextPaths[i];
+			next.pixel = path.pixel;
+			next.pdf_brdf = path.pdf_brdf;
+			next.pdf_angle = path.pdf_angle;
+			next.sampler = path.sampler;
+			Sampler &sampler = next.sampler;
+
+			bool reflect = false;
+			bool refract = false;
+			if ( mat->HasRefraction() )
+				refract = sampler.Get1D( depth, SAMPLE_SPECULAR ) < mat->GetRefraction();
+			else if ( mat->HasReflection() )
+				reflect = sampler.Get1D( depth, SAMPLE_SPECULAR ) < mat->GetReflection();
+
+			if ( refract )
+			{
+				float n = mat->GetIoR();
+				if ( backfacing )
+					n = 1.0f / n;
+				float k = 1 - (n * n * (1 - angle * angle));
+				if ( k < 0 )
+					reflect = true;
+				else
+				{
+					vec3 refractDir = n * -direction + interNormal * (n * angle - sqrtf( k ));
+					Ray refracted( interPoint, refractDir.normalized() );
+					refracted.Offset( 1e-3 );
+					nextRays.Set( i, refracted );
+					next.throughput = T * albedo;
+					next.specular = true;
+					keep[i] = true;
+					continue;
+				}
+			}
+
+			if ( reflect )
+			{
+				Ray reflected( interPoint, -direction );
+				reflected.Reflect( interPoint, interNormal, angle );
+				reflected.Offset( 1e-3 );
+				nextRays.Set( i, reflected );
+				next.throughput = T * albedo;
+				next.specular = true;
+				keep[i] = true;
+				continue;
+			}
+
+			// Random bounce
+			Ray bounce( interPoint, CosineWeightedDiffuseReflection( interNormal, sampler.Get2D( depth, SAMPLE_BRDF ) ) );
+			bounce.Offset( 1e-3 );
+			nextRays.Set( i, bounce );
+			next.specular = false;
+
+			// irradiance
+			float pdf_angle = dot( interNormal, bounce.direction );
+			float pdf_brdf = pdf_angle * INVPI;
+			next.pdf_angle = pdf_angle;
+			next.pdf_brdf = pdf_brdf;
+
+			// Direct light for NEE, traced by Connect
+			if ( F & FEATURE_NEE )
+			{
+				Light *rLight = game->lights[sampler.GetIndex( depth, SAMPLE_LIGHT, game->nr_lights )];
+				vec3 rLightPoint = rLight->PointOnLight( sampler.Get2D( depth, SAMPLE_LIGHTPOINT ) );
+				vec3 rLightNormal = rLight->NormalAt( rLightPoint );
+				vec3 rLightDir = rLightPoint - interPoint;
+				float rLightDist = rLightDir.length();
+				rLightDir *= 1 / rLightDist;
+
+				float cos_i = interNormal.dot( rLightDir );
+				float cos_o = rLightNormal.dot( -rLightDir );
+				if ( cos_i > 0 && cos_o > 0 )
+				{
+					Ray rLightRay( interPoint, rLightDir );
+					// Stop short of the light, or it can occlude its own shadow ray by the rounding of the intersection
+					rLightRay.t = rLightDist * (1 - 1e-4f);
+					float solidAngle = (cos_o * rLight->Area()) / (rLightDist * rLightDist);
+					float pdf_light = 1 / solidAngle;
+					ShadowState &shadow = shadows[i];
+					shadow.pixel = path.pixel;
+					if ( F & FEATURE_MIS )
+					{
+						// If the light turns out to be visible, the pdf of the bounce becomes pdf_brdf + pdf_light
+						shadow.path = i;
+						shadow.misScale = pdf_brdf / (pdf_brdf + pdf_light);
+						pdf_light += pdf_brdf;
+					}
+					shadow.contribution = T * (cos_i / pdf_light) * BRDF * rLight->color;
+					shadowRays.Set( i, rLightRay );
+					keepShadow[i] = true;
+				}
+			}
+
+			if ( F & FEATURE_RUSSIANROULETTE )
+			{
+				// Russian Roulette
+				float survival = albedo.Max();
+				clamp( survival, 0.1f, 1.0f );
+				if ( sampler.Get1D( depth, SAMPLE_ROULETTE ) > survival )
+					continue;
+				T *= (1 / survival);
+			}
+
+			next.throughput = T * (pdf_angle / pdf_brdf) * BRDF;
+			keep[i] = true;
+		}
+	} );
+}
+
+template <uint F>
+void Wavefront::Connect( uint count )
+{
+	PROFILE_ZONE( "Connect" );
+	ForChunks( count, [&]( uint first, uint last ) {
+		for ( uint i = first; i < last; i++ )
+		{
+			Ray r = nextShadowRays.Get( i );
+			if ( game->CheckOcclusion( &r ) )
+				continue;
+			const ShadowState &shadow = nextShadows[i];
+			radiance[shadow.pixel] += shadow.contribution;
+			if ( F & FEATURE_MIS )
+				nextPaths[shadow.path].throughput *= shadow.misScale;
+		}
+	} );
+}
@@ -0,0 +1,152 @@
+#pragma once
+
+#include "vectors.h"
+#include "ray.h"
+#include "sampler.h"
+#include "color.h"
+
+namespace AdvancedGraphics
+{
+
+class Game; // forward declaration
+
+// Adaptive sampling and the BVH visualization are only supported by Game::Sample,
+// and so is SSAA, Game::Tick falls back to it when that feature is on
+#if defined( USEWAVEFRONT ) && !defined( VISUALIZEBVH ) && !defined( ADAPTIVESAMPLING )
+#define RENDERWAVEFRONT
+#endif
+
+// Paths are processed in chunks of this size, by the thread pool and the stream compaction
+#define WAVEFRONTCHUNK 256
+
+// Rays stored per component, so the stages stream through them
+struct RayBuffer
+{
+  public:
+	float *ox = nullptr, *oy = nullptr, *oz = nullptr;
+	float *dx = nullptr, *dy = nullptr, *dz = nullptr;
+	float *t = nullptr;
+
+	void Resize( uint size );
+	// The buffers are swapped by value, so the owner frees them instead of a destructor
+	void Free();
+	inline Ray Get( uint i ) const
+	{
+		Ray r( vec3( ox[i], oy[i], oz[i] ), vec3( dx[i], dy[i], dz[i] ) );
+		r.t = t[i];
+		return r;
+	}
+	inline void Set( uint i, const Ray &r )
+	{
+		ox[i] = r.origin.x, oy[i] = r.origin.y, oz[i] = r.origin.z;
+		dx[i] = r.direction.x, dy[i] = r.direction.y, dz[i] = r.direction.z;
+		t[i] = r.t;
+	}
+	// Copies ray i to slot j of dst
+	inline void Move( uint i, RayBuffer &dst, uint j ) const
+	{
+		dst.ox[j] = ox[i], dst.oy[j] = oy[i], dst.oz[j] = oz[i];
+		dst.dx[j] = dx[i], dst.dy[j] = dy[i], dst.dz[j] = dz[i];
+		dst.t[j] = t[i];
+	}
+};
+
+// What a path carries from one bounce to the next
+struct PathState
+{
+	Color throughput;
+	// Of the last diffuse bounce, for MIS when the path hits a light
+	float pdf_brdf, pdf_angle;
+	uint pixel;
+	// The last bounce was specular, so a light that is hit counts even with NEE
+	bool specular;
+	Sampler sampler;
+};
+
+// A NEE shadow ray, the contribution is added to the pixel if the light is visible
+struct ShadowState
+{
+	Color contribution;
+	uint pixel;
+	// With MIS, the slot of the path in the buffer of the next bounce, and the factor for its throughput if the light is visible
+	uint path;
+	float misScale;
+};
+
+// Alternative to Game::Sample that traces all paths of a frame together. Every bounce runs
+// as separate stages over all active paths: extend (closest hit), shade (emission,
+// the next bounce and a shadow ray), connect (shadow rays). Paths and shadow rays that
+// are terminated are compacted away between the stages.
+class Wavefront
+{
+  public:
+	Wavefront( Game *game );
+	~Wavefront();
+
+	// Traces one sample for every pixel and accumulates it, like the loop over Sample in Game::Tick
+	void Render();
+	// Render with the mask of features F
+	template <uint F>
+	void RenderVariant();
+
+	// Number of paths and shadow rays traced in the last frame
+	uint64 nr_rays = 0, nr_shadow_rays = 0;
+	// Counters of the last frame for the rays of the bounces after the first. Hit switches are neighbouring
+	// rays in the buffer that hit a different primitive, a proxy for the cache misses of their traversal.
+	// With RAYSORTING these are also counted in the order before sorting.
+	uint64 nr_secondary_rays = 0, nr_node_visits = 0, nr_hit_switches = 0, nr_hit_switches_unsorted = 0;
+
+  private:
+	Game *game;
+	uint size = 0;
+
+	// Active paths, and the paths of the next bounce before compaction
+	RayBuffer rays, nextRays;
+	PathState *paths = nullptr, *nextPaths = nullptr;
+	bool *keep = nullptr;
+	// Closest hits of the active paths
+	Primitive **hitObj = nullptr;
+	Instance **hitInstance = nullptr;
+	Light **hitLight = nullptr;
+
+	// Shadow rays per path slot, and compacted
+	RayBuffer shadowRays, nextShadowRays;
+	ShadowState *shadows = nullptr, *nextShadows = nullptr;
+	bool *keepShadow = nullptr;
+
+	// Radiance of this frame per pixel
+	Color *radiance = nullptr;
+	uint *chunkOffsets = nullptr;
+	// Generate stores the primary rays per tile, tile t starts at tileOffsets[t]. The tiles at the
+	// right and bottom edge of the screen are smaller when it is not a multiple of the tile size.
+	uint *tileOffsets = nullptr;
+	uint nr_tiles = 0;
+
+	#ifdef RAYSORTING
+	uint64 *sortKeys = nullptr;
+	// Position of every sorted path before sorting
+	uint *sortOrder = nullptr;
+	Primitive **unsortedHits = nullptr;
+	#endif
+
+	void Resize( uint pixels );
+	void Free();
+	// Runs f( first, last ) for chunks of WAVEFRONTCHUNK paths on the thread pool of the game
+	void ForChunks( uint count, const std::function<void( uint first, uint last )> &f );
+	void Generate();
+	#ifdef RAYSORTING
+	// Orders the active paths by the octant of their direction, then by the Morton code of their origin
+	void Sort( uint count );
+	#endif
+	void Extend( uint count, uint depth );
+	uint64 CountHitSwitches( Primitive *const *hits, uint count );
+	template <uint F>
+	void Shade( uint count, uint depth );
+	template <uint F>
+	void Connect( uint count );
+	// Moves the entries with keep set to the front, in order, returns how many there are
+	template <class MoveFunc>
+	uint Compact( const bool *keep, uint count, MoveFunc move );
+};
+
+}; // namespace AdvancedGraphics
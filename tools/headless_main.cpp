@@ -0,0 +1,18 @@
+// The path tracer without a window, for batch jobs and benchmarks. Takes the options of the window
+// front end, with --headless implied, and needs neither SDL nor OpenGL, see src/renderer.h.
+
+#include "precomp.h"
+#include "headless.h"
+
+using namespace AdvancedGraphics;
+
+int main( int argc, char **argv )
+{
+	Config config;
+	if ( !config.Parse( argc, argv ) )
+		return 1;
+	if ( !config.benchmark.empty() )
+		return RunBenchmark( config );
+	config.headless = true;
+	return RenderHeadless( config );
+}